@@ -0,0 +1,54 @@
+//////////////////////////////////////
+// ChocoLang Atom Table
+// Interned identifiers, field and function names
+//////////////////////////////////////
+
+#ifndef CHOCO_ATOM_H
+#define CHOCO_ATOM_H
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
+
+// An atom is the index of a name in the process-wide table. Equal names always
+// intern to the same atom, so names compare and hash as plain integers.
+typedef uint32_t Atom;
+
+// Atom 0 is the empty name; tokens and strings that carry no name use it
+const Atom NO_ATOM = 0;
+
+class AtomTable {
+public:
+    static Atom intern(std::string_view name) {
+        AtomTable& table = instance();
+        auto it = table.ids.find(name);
+        if (it != table.ids.end()) return it->second;
+        Atom atom = static_cast<Atom>(table.names.size());
+        table.names.emplace_back(name);
+        table.ids.emplace(table.names.back(), atom);
+        return atom;
+    }
+
+    static const std::string& name(Atom atom) {
+        return instance().names[atom];
+    }
+
+private:
+    // Keys view the names they map from; a deque never moves its elements
+    std::unordered_map<std::string_view, Atom> ids;
+    std::deque<std::string> names;
+
+    AtomTable() {
+        names.push_back("");
+        ids.emplace(names.back(), NO_ATOM);
+    }
+
+    static AtomTable& instance() {
+        static AtomTable table;
+        return table;
+    }
+};
+
+#endif
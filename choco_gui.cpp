@@ -4,81 +4,9 @@
 //////////////////////////////////////
 
 #include "choco_gui.h"
+#include "choco_value.h"
 #include <iostream>
 
-struct Value {
-    enum Type { NUMBER, STRING, BOOL, ARRAY, STRUCT, LAMBDA, NIL } type;
-    double num;
-    std::string str;
-    bool boolean;
-    std::vector<Value> array;
-    std::unordered_map<std::string, Value> structFields;
-    std::string structType;
-    
-    std::vector<std::string> lambdaParams;
-    size_t lambdaBodyStart;
-    size_t lambdaBodyEnd;
-    std::unordered_map<std::string, Value> closureCaptures;
-
-    Value() : type(NIL), num(0), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(double n) : type(NUMBER), num(n), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(const std::string& s) : type(STRING), str(s), num(0), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(bool b) : type(BOOL), num(0), boolean(b), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(const std::vector<Value>& arr) : type(ARRAY), num(0), boolean(false), array(arr), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-
-    std::string toString() const {
-        switch (type) {
-            case NUMBER: {
-                if (num == static_cast<int>(num)) {
-                    return std::to_string(static_cast<int>(num));
-                }
-                std::string s = std::to_string(num);
-                s.erase(s.find_last_not_of('0') + 1, std::string::npos);
-                if (s.back() == '.') s.pop_back();
-                return s;
-            }
-            case STRING: return str;
-            case BOOL: return boolean ? "true" : "false";
-            case ARRAY: {
-                std::string result = "[";
-                for (size_t i = 0; i < array.size(); i++) {
-                    result += array[i].toString();
-                    if (i < array.size() - 1) result += ", ";
-                }
-                result += "]";
-                return result;
-            }
-            case STRUCT: {
-                std::string result = structType + " { ";
-                bool first = true;
-                for (const auto& field : structFields) {
-                    if (!first) result += ", ";
-                    result += field.first + ": " + field.second.toString();
-                    first = false;
-                }
-                result += " }";
-                return result;
-            }
-            case LAMBDA: return "<lambda>";
-            case NIL: return "nil";
-        }
-        return "";
-    }
-    
-    std::string getType() const {
-        switch (type) {
-            case NUMBER: return "number";
-            case STRING: return "string";
-            case BOOL: return "bool";
-            case ARRAY: return "array";
-            case STRUCT: return structType.empty() ? "struct" : structType;
-            case LAMBDA: return "lambda";
-            case NIL: return "nil";
-        }
-        return "unknown";
-    }
-};
-
 class RuntimeError : public std::runtime_error {
 public:
     int line;
@@ -146,7 +74,7 @@ void ChocoGUI::executeCallback(const std::string& widgetId, const std::string& e
 Value ChocoGUI::gui_init(const std::vector<Value>& args, int line) {
     std::string appId = "com.chocolang.app";
     if (args.size() > 0 && args[0].type == Value::STRING) {
-        appId = args[0].str;
+        appId = args[0].str();
     }
     
     // Create application with DEFAULT_FLAGS
@@ -178,7 +106,7 @@ Value ChocoGUI::gui_window(const std::vector<Value>& args, int line) {
     std::string id = "main_window";
     
     if (args.size() > 0 && args[0].type == Value::STRING) {
-        title = args[0].str;
+        title = args[0].str();
     }
     if (args.size() > 1 && args[1].type == Value::NUMBER) {
         width = static_cast<int>(args[1].num);
@@ -187,7 +115,7 @@ Value ChocoGUI::gui_window(const std::vector<Value>& args, int line) {
         height = static_cast<int>(args[2].num);
     }
     if (args.size() > 3 && args[3].type == Value::STRING) {
-        id = args[3].str;
+        id = args[3].str();
     }
     
     GtkWidget* window = gtk_application_window_new(app);
@@ -209,11 +137,11 @@ Value ChocoGUI::gui_button(const std::vector<Value>& args, int line) {
         throw RuntimeError("gui_button() requires label as first argument", line);
     }
     
-    std::string label = args[0].str;
+    std::string label = args[0].str();
     std::string id = "button_" + std::to_string(widgets.size());
     
     if (args.size() > 1 && args[1].type == Value::STRING) {
-        id = args[1].str;
+        id = args[1].str();
     }
     
     GtkWidget* button = gtk_button_new_with_label(label.c_str());
@@ -234,10 +162,10 @@ Value ChocoGUI::gui_label(const std::vector<Value>& args, int line) {
     std::string id = "label_" + std::to_string(widgets.size());
     
     if (args.size() > 0 && args[0].type == Value::STRING) {
-        text = args[0].str;
+        text = args[0].str();
     }
     if (args.size() > 1 && args[1].type == Value::STRING) {
-        id = args[1].str;
+        id = args[1].str();
     }
     
     GtkWidget* label = gtk_label_new(text.c_str());
@@ -255,10 +183,10 @@ Value ChocoGUI::gui_entry(const std::vector<Value>& args, int line) {
     std::string id = "entry_" + std::to_string(widgets.size());
     
     if (args.size() > 0 && args[0].type == Value::STRING) {
-        placeholder = args[0].str;
+        placeholder = args[0].str();
     }
     if (args.size() > 1 && args[1].type == Value::STRING) {
-        id = args[1].str;
+        id = args[1].str();
     }
     
     GtkWidget* entry = gtk_entry_new();
@@ -283,13 +211,13 @@ Value ChocoGUI::gui_box(const std::vector<Value>& args, int line) {
     std::string id = "box_" + std::to_string(widgets.size());
     
     if (args.size() > 0 && args[0].type == Value::STRING) {
-        orientation = args[0].str;
+        orientation = args[0].str();
     }
     if (args.size() > 1 && args[1].type == Value::NUMBER) {
         spacing = static_cast<int>(args[1].num);
     }
     if (args.size() > 2 && args[2].type == Value::STRING) {
-        id = args[2].str;
+        id = args[2].str();
     }
     
     GtkOrientation orient = (orientation == "horizontal" || orientation == "h") 
@@ -311,8 +239,8 @@ Value ChocoGUI::gui_add(const std::vector<Value>& args, int line) {
         throw RuntimeError("gui_add() requires two widget IDs (parent, child)", line);
     }
     
-    std::string parentId = args[0].str;
-    std::string childId = args[1].str;
+    std::string parentId = args[0].str();
+    std::string childId = args[1].str();
     
     auto parentIt = widgets.find(parentId);
     auto childIt = widgets.find(childId);
@@ -348,8 +276,8 @@ Value ChocoGUI::gui_set_text(const std::vector<Value>& args, int line) {
         throw RuntimeError("gui_set_text() requires widget ID and text", line);
     }
     
-    std::string widgetId = args[0].str;
-    std::string text = args[1].str;
+    std::string widgetId = args[0].str();
+    std::string text = args[1].str();
     
     auto it = widgets.find(widgetId);
     if (it == widgets.end()) {
@@ -387,7 +315,7 @@ Value ChocoGUI::gui_get_text(const std::vector<Value>& args, int line) {
         throw RuntimeError("gui_get_text() requires widget ID", line);
     }
     
-    std::string widgetId = args[0].str;
+    std::string widgetId = args[0].str();
     
     auto it = widgets.find(widgetId);
     if (it == widgets.end()) {
@@ -427,9 +355,9 @@ Value ChocoGUI::gui_on(const std::vector<Value>& args, int line) {
         throw RuntimeError("gui_on() requires widget ID, event name, and callback function name", line);
     }
     
-    std::string widgetId = args[0].str;
-    std::string event = args[1].str;
-    std::string callback = args[2].str;
+    std::string widgetId = args[0].str();
+    std::string event = args[1].str();
+    std::string callback = args[2].str();
     
     auto it = widgets.find(widgetId);
     if (it == widgets.end()) {
@@ -446,7 +374,7 @@ Value ChocoGUI::gui_show(const std::vector<Value>& args, int line) {
         throw RuntimeError("gui_show() requires widget ID", line);
     }
     
-    std::string widgetId = args[0].str;
+    std::string widgetId = args[0].str();
     
     auto it = widgets.find(widgetId);
     if (it == widgets.end()) {
@@ -501,10 +429,10 @@ Value ChocoGUI::gui_checkbox(const std::vector<Value>& args, int line) {
     std::string id = "checkbox_" + std::to_string(widgets.size());
     
     if (args.size() > 0 && args[0].type == Value::STRING) {
-        label = args[0].str;
+        label = args[0].str();
     }
     if (args.size() > 1 && args[1].type == Value::STRING) {
-        id = args[1].str;
+        id = args[1].str();
     }
     
     GtkWidget* checkbox = gtk_check_button_new_with_label(label.c_str());
@@ -521,7 +449,7 @@ Value ChocoGUI::gui_textview(const std::vector<Value>& args, int line) {
     std::string id = "textview_" + std::to_string(widgets.size());
     
     if (args.size() > 0 && args[0].type == Value::STRING) {
-        id = args[0].str;
+        id = args[0].str();
     }
     
     GtkWidget* textview = gtk_text_view_new();
@@ -540,10 +468,10 @@ Value ChocoGUI::gui_frame(const std::vector<Value>& args, int line) {
     std::string id = "frame_" + std::to_string(widgets.size());
     
     if (args.size() > 0 && args[0].type == Value::STRING) {
-        label = args[0].str;
+        label = args[0].str();
     }
     if (args.size() > 1 && args[1].type == Value::STRING) {
-        id = args[1].str;
+        id = args[1].str();
     }
     
     GtkWidget* frame = gtk_frame_new(label.c_str());
@@ -561,10 +489,10 @@ Value ChocoGUI::gui_separator(const std::vector<Value>& args, int line) {
     std::string id = "separator_" + std::to_string(widgets.size());
     
     if (args.size() > 0 && args[0].type == Value::STRING) {
-        orientation = args[0].str;
+        orientation = args[0].str();
     }
     if (args.size() > 1 && args[1].type == Value::STRING) {
-        id = args[1].str;
+        id = args[1].str();
     }
     
     GtkOrientation orient = (orientation == "horizontal" || orientation == "h") 
@@ -586,7 +514,7 @@ Value ChocoGUI::gui_set_sensitive(const std::vector<Value>& args, int line) {
         throw RuntimeError("gui_set_sensitive() requires widget ID and boolean", line);
     }
     
-    std::string widgetId = args[0].str;
+    std::string widgetId = args[0].str();
     bool sensitive = args[1].boolean;
     
     auto it = widgets.find(widgetId);
@@ -604,7 +532,7 @@ Value ChocoGUI::gui_get_checked(const std::vector<Value>& args, int line) {
         throw RuntimeError("gui_get_checked() requires widget ID", line);
     }
     
-    std::string widgetId = args[0].str;
+    std::string widgetId = args[0].str();
     
     auto it = widgets.find(widgetId);
     if (it == widgets.end()) {
@@ -624,7 +552,7 @@ Value ChocoGUI::gui_set_checked(const std::vector<Value>& args, int line) {
         throw RuntimeError("gui_set_checked() requires widget ID and boolean", line);
     }
     
-    std::string widgetId = args[0].str;
+    std::string widgetId = args[0].str();
     bool checked = args[1].boolean;
     
     auto it = widgets.find(widgetId);
@@ -0,0 +1,256 @@
+//////////////////////////////////////
+// ChocoLang Numeric Kernels
+// Vectorized loops over contiguous doubles for float arrays
+//////////////////////////////////////
+
+#ifndef CHOCO_KERNELS_H
+#define CHOCO_KERNELS_H
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define CHOCO_KERNEL_AVX 1
+#define CHOCO_KERNEL_LANES 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CHOCO_KERNEL_SSE2 1
+#define CHOCO_KERNEL_LANES 1
+#endif
+
+// Each kernel runs LANES numbers per instruction (4 with AVX, 2 with SSE2) and
+// finishes the last few one at a time; without either it is a plain loop.
+// Sums and dot products keep several running totals, so their last bits of
+// rounding can differ from adding left to right. Which instruction set is used
+// is decided when the interpreter is compiled (-mavx, -march=native).
+struct Kernels {
+    enum Comparison { LESS, LESS_EQUAL, GREATER, GREATER_EQUAL, EQUAL, NOT_EQUAL };
+
+    static double sum(const double* x, size_t n) {
+        size_t i = 0;
+        double total = 0;
+#ifdef CHOCO_KERNEL_LANES
+        Lanes a = Lanes::zero(), b = Lanes::zero();
+        for (; i + 2 * LANES <= n; i += 2 * LANES) {
+            a = Lanes::add(a, Lanes::load(x + i));
+            b = Lanes::add(b, Lanes::load(x + i + LANES));
+        }
+        total = Lanes::total(Lanes::add(a, b));
+#endif
+        for (; i < n; i++) total += x[i];
+        return total;
+    }
+
+    static double dot(const double* x, const double* y, size_t n) {
+        size_t i = 0;
+        double total = 0;
+#ifdef CHOCO_KERNEL_LANES
+        Lanes a = Lanes::zero(), b = Lanes::zero();
+        for (; i + 2 * LANES <= n; i += 2 * LANES) {
+            a = Lanes::add(a, Lanes::mul(Lanes::load(x + i), Lanes::load(y + i)));
+            b = Lanes::add(b, Lanes::mul(Lanes::load(x + i + LANES), Lanes::load(y + i + LANES)));
+        }
+        total = Lanes::total(Lanes::add(a, b));
+#endif
+        for (; i < n; i++) total += x[i] * y[i];
+        return total;
+    }
+
+    // n has to be at least 1. Any NaN makes the result NaN, as it does for sum
+    static double min(const double* x, size_t n) {
+        size_t i = 0;
+        double best = x[0];
+#ifdef CHOCO_KERNEL_LANES
+        if (n >= LANES) {
+            Lanes m = Lanes::load(x);
+            for (i = LANES; i + LANES <= n; i += LANES) m = Lanes::min(m, Lanes::load(x + i));
+            double lanes[LANES];
+            Lanes::store(lanes, m);
+            for (size_t j = 0; j < LANES; j++) {
+                if (std::isnan(lanes[j])) return NOT_A_NUMBER;
+                best = lanes[j] < best ? lanes[j] : best;
+            }
+        }
+#endif
+        for (; i < n; i++) {
+            if (std::isnan(x[i])) return NOT_A_NUMBER;
+            best = x[i] < best ? x[i] : best;
+        }
+        return best;
+    }
+
+    static double max(const double* x, size_t n) {
+        size_t i = 0;
+        double best = x[0];
+#ifdef CHOCO_KERNEL_LANES
+        if (n >= LANES) {
+            Lanes m = Lanes::load(x);
+            for (i = LANES; i + LANES <= n; i += LANES) m = Lanes::max(m, Lanes::load(x + i));
+            double lanes[LANES];
+            Lanes::store(lanes, m);
+            for (size_t j = 0; j < LANES; j++) {
+                if (std::isnan(lanes[j])) return NOT_A_NUMBER;
+                best = lanes[j] > best ? lanes[j] : best;
+            }
+        }
+#endif
+        for (; i < n; i++) {
+            if (std::isnan(x[i])) return NOT_A_NUMBER;
+            best = x[i] > best ? x[i] : best;
+        }
+        return best;
+    }
+
+    static void scale(const double* x, double k, double* out, size_t n) {
+        size_t i = 0;
+#ifdef CHOCO_KERNEL_LANES
+        Lanes factor = Lanes::splat(k);
+        for (; i + LANES <= n; i += LANES) Lanes::store(out + i, Lanes::mul(Lanes::load(x + i), factor));
+#endif
+        for (; i < n; i++) out[i] = x[i] * k;
+    }
+
+    static void add(const double* x, const double* y, double* out, size_t n) {
+        size_t i = 0;
+#ifdef CHOCO_KERNEL_LANES
+        for (; i + LANES <= n; i += LANES) {
+            Lanes::store(out + i, Lanes::add(Lanes::load(x + i), Lanes::load(y + i)));
+        }
+#endif
+        for (; i < n; i++) out[i] = x[i] + y[i];
+    }
+
+    static void add(const double* x, double k, double* out, size_t n) {
+        size_t i = 0;
+#ifdef CHOCO_KERNEL_LANES
+        Lanes term = Lanes::splat(k);
+        for (; i + LANES <= n; i += LANES) Lanes::store(out + i, Lanes::add(Lanes::load(x + i), term));
+#endif
+        for (; i < n; i++) out[i] = x[i] + k;
+    }
+
+    // Each total depends on the one before, so this one stays a plain loop
+    static void cumsum(const double* x, double* out, size_t n) {
+        double total = 0;
+        for (size_t i = 0; i < n; i++) {
+            total += x[i];
+            out[i] = total;
+        }
+    }
+
+    // out[i] is 1 where x[i] op y[i] holds and 0 elsewhere; with a null y every
+    // x[i] is compared with k instead
+    static void compare(const double* x, const double* y, double k, Comparison op, double* out, size_t n) {
+        switch (op) {
+            case LESS: compare<LESS>(x, y, k, out, n); break;
+            case LESS_EQUAL: compare<LESS_EQUAL>(x, y, k, out, n); break;
+            case GREATER: compare<GREATER>(x, y, k, out, n); break;
+            case GREATER_EQUAL: compare<GREATER_EQUAL>(x, y, k, out, n); break;
+            case EQUAL: compare<EQUAL>(x, y, k, out, n); break;
+            case NOT_EQUAL: compare<NOT_EQUAL>(x, y, k, out, n); break;
+        }
+    }
+
+private:
+    static constexpr double NOT_A_NUMBER = std::numeric_limits<double>::quiet_NaN();
+
+#if defined(CHOCO_KERNEL_AVX)
+    static const size_t LANES = 4;
+    struct Lanes {
+        __m256d v;
+        static Lanes wrap(__m256d v) { return Lanes{v}; }
+        static Lanes load(const double* p) { return wrap(_mm256_loadu_pd(p)); }
+        static void store(double* p, Lanes a) { _mm256_storeu_pd(p, a.v); }
+        static Lanes zero() { return wrap(_mm256_setzero_pd()); }
+        static Lanes splat(double k) { return wrap(_mm256_set1_pd(k)); }
+        static Lanes add(Lanes a, Lanes b) { return wrap(_mm256_add_pd(a.v, b.v)); }
+        static Lanes mul(Lanes a, Lanes b) { return wrap(_mm256_mul_pd(a.v, b.v)); }
+        // minpd and maxpd give b when either is NaN; or-ing in a's unordered
+        // mask keeps a NaN already in a, so NaN lanes stay NaN
+        static Lanes min(Lanes a, Lanes b) { return keepNaN(a, _mm256_min_pd(a.v, b.v)); }
+        static Lanes max(Lanes a, Lanes b) { return keepNaN(a, _mm256_max_pd(a.v, b.v)); }
+        static Lanes keepNaN(Lanes a, __m256d r) { return wrap(_mm256_or_pd(r, _mm256_cmp_pd(a.v, a.v, _CMP_UNORD_Q))); }
+        static Lanes bitAnd(Lanes a, Lanes b) { return wrap(_mm256_and_pd(a.v, b.v)); }
+        template <Comparison op>
+        static Lanes test(Lanes a, Lanes b) {
+            switch (op) {
+                case LESS: return wrap(_mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ));
+                case LESS_EQUAL: return wrap(_mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ));
+                case GREATER: return wrap(_mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ));
+                case GREATER_EQUAL: return wrap(_mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ));
+                case EQUAL: return wrap(_mm256_cmp_pd(a.v, b.v, _CMP_EQ_OQ));
+                default: return wrap(_mm256_cmp_pd(a.v, b.v, _CMP_NEQ_UQ));
+            }
+        }
+        static double total(Lanes a) {
+            __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(a.v), _mm256_extractf128_pd(a.v, 1));
+            return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+        }
+    };
+#elif defined(CHOCO_KERNEL_SSE2)
+    static const size_t LANES = 2;
+    struct Lanes {
+        __m128d v;
+        static Lanes wrap(__m128d v) { return Lanes{v}; }
+        static Lanes load(const double* p) { return wrap(_mm_loadu_pd(p)); }
+        static void store(double* p, Lanes a) { _mm_storeu_pd(p, a.v); }
+        static Lanes zero() { return wrap(_mm_setzero_pd()); }
+        static Lanes splat(double k) { return wrap(_mm_set1_pd(k)); }
+        static Lanes add(Lanes a, Lanes b) { return wrap(_mm_add_pd(a.v, b.v)); }
+        static Lanes mul(Lanes a, Lanes b) { return wrap(_mm_mul_pd(a.v, b.v)); }
+        static Lanes min(Lanes a, Lanes b) { return keepNaN(a, _mm_min_pd(a.v, b.v)); }
+        static Lanes max(Lanes a, Lanes b) { return keepNaN(a, _mm_max_pd(a.v, b.v)); }
+        static Lanes keepNaN(Lanes a, __m128d r) { return wrap(_mm_or_pd(r, _mm_cmpunord_pd(a.v, a.v))); }
+        static Lanes bitAnd(Lanes a, Lanes b) { return wrap(_mm_and_pd(a.v, b.v)); }
+        template <Comparison op>
+        static Lanes test(Lanes a, Lanes b) {
+            switch (op) {
+                case LESS: return wrap(_mm_cmplt_pd(a.v, b.v));
+                case LESS_EQUAL: return wrap(_mm_cmple_pd(a.v, b.v));
+                case GREATER: return wrap(_mm_cmpgt_pd(a.v, b.v));
+                case GREATER_EQUAL: return wrap(_mm_cmpge_pd(a.v, b.v));
+                case EQUAL: return wrap(_mm_cmpeq_pd(a.v, b.v));
+                default: return wrap(_mm_cmpneq_pd(a.v, b.v));
+            }
+        }
+        static double total(Lanes a) {
+            return _mm_cvtsd_f64(_mm_add_sd(a.v, _mm_unpackhi_pd(a.v, a.v)));
+        }
+    };
+#endif
+
+    template <Comparison op>
+    static bool holds(double a, double b) {
+        switch (op) {
+            case LESS: return a < b;
+            case LESS_EQUAL: return a <= b;
+            case GREATER: return a > b;
+            case GREATER_EQUAL: return a >= b;
+            case EQUAL: return a == b;
+            default: return a != b;
+        }
+    }
+
+    template <Comparison op>
+    static void compare(const double* x, const double* y, double k, double* out, size_t n) {
+        size_t i = 0;
+#ifdef CHOCO_KERNEL_LANES
+        // A true lane is all ones, so masking 1.0 with it leaves 1.0 or 0.0
+        Lanes one = Lanes::splat(1.0);
+        Lanes constant = Lanes::splat(k);
+        for (; i + LANES <= n; i += LANES) {
+            Lanes right = y ? Lanes::load(y + i) : constant;
+            Lanes::store(out + i, Lanes::bitAnd(Lanes::test<op>(Lanes::load(x + i), right), one));
+        }
+#endif
+        for (; i < n; i++) out[i] = holds<op>(x[i], y ? y[i] : k) ? 1.0 : 0.0;
+    }
+};
+
+#undef CHOCO_KERNEL_LANES
+#undef CHOCO_KERNEL_AVX
+#undef CHOCO_KERNEL_SSE2
+
+#endif
@@ -0,0 +1,104 @@
+//////////////////////////////////////
+// ChocoLang Native Functions
+// Registry of builtins implemented in C++
+//////////////////////////////////////
+
+#ifndef CHOCO_NATIVES_H
+#define CHOCO_NATIVES_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include "choco_atom.h"
+#include "choco_value.h"
+
+class Interpreter;
+
+// The arguments of a native call. They are read in place from the interpreter
+// stack, so a native that calls back into the interpreter (a lambda, a user
+// function) must copy the values it still needs before doing so.
+struct NativeArgs {
+    const Value* values;
+    size_t count;
+
+    size_t size() const { return count; }
+    const Value& operator[](size_t i) const { return values[i]; }
+    std::vector<Value> toVector() const { return std::vector<Value>(values, values + count); }
+};
+
+typedef Value (*NativeFn)(Interpreter& interp, NativeArgs args, int callLine);
+
+struct NativeFunction {
+    Atom name;
+    NativeFn fn;
+    uint8_t arity;          // minimum argument count, checked before the call
+    std::string params;     // parameter list shown in arity errors, e.g. "array, lambda"
+    bool pure;              // no side effects and no callbacks: constant calls may be folded
+};
+
+// Builtins are looked up here by name. Call sites that name a native directly
+// are bound to its index when they are compiled, so natives have to be added
+// before the scripts using them are compiled. A name is looked up as a local,
+// then a captured variable, then a global, and only then as a native, so a
+// script's own binding of a native's name wins.
+//
+// Adding a native:
+//
+//     static Value native_twice(Interpreter&, NativeArgs args, int callLine) {
+//         if (args[0].type != Value::NUMBER) {
+//             throw RuntimeError("twice() requires a number, got " + args[0].getType(), callLine);
+//         }
+//         return Value(args[0].num * 2);
+//     }
+//
+//     NativeRegistry::instance().add("twice", native_twice, 1, "number", true);
+//
+// If fewer than `arity` arguments are passed the interpreter raises
+// "twice() expects 1 argument (number), got 0" without calling the native.
+class NativeRegistry {
+public:
+    static NativeRegistry& instance() {
+        static NativeRegistry registry;
+        return registry;
+    }
+
+    // Registers fn under name, replacing an earlier native of the same name
+    uint16_t add(const std::string& name, NativeFn fn, uint8_t arity = 0,
+                 const std::string& params = "", bool pure = false) {
+        Atom atom = AtomTable::intern(name);
+        NativeFunction native = {atom, fn, arity, params, pure};
+        auto it = slots.find(atom);
+        if (it != slots.end()) {
+            natives[it->second] = native;
+            return it->second;
+        }
+        uint16_t index = static_cast<uint16_t>(natives.size());
+        natives.push_back(native);
+        slots[atom] = index;
+        return index;
+    }
+
+    // Index of the native called name, or -1
+    int find(Atom name) const {
+        auto it = slots.find(name);
+        return it == slots.end() ? -1 : it->second;
+    }
+
+    const NativeFunction& get(uint16_t index) const { return natives[index]; }
+
+    static std::string arityError(const NativeFunction& native, size_t got) {
+        std::string message = AtomTable::name(native.name) + "() expects " + std::to_string(native.arity) +
+                              (native.arity == 1 ? " argument" : " arguments");
+        if (!native.params.empty()) {
+            message += " (" + native.params + ")";
+        }
+        return message + ", got " + std::to_string(got);
+    }
+
+private:
+    std::vector<NativeFunction> natives;
+    std::unordered_map<Atom, uint16_t> slots;
+};
+
+#endif
@@ -0,0 +1,89 @@
+//////////////////////////////////////
+// ChocoLang Number Text
+// Shortest round-trip number formatting and parsing without exceptions
+//////////////////////////////////////
+
+#ifndef CHOCO_NUMBER_H
+#define CHOCO_NUMBER_H
+
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <system_error>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+struct NumberText {
+    // Longer than any text format() writes
+    static const size_t MAX_LENGTH = 48;
+
+    // The shortest text that reads back as the same number. Numbers from 1e-7
+    // up to 1e21 are written out in full (250000, 0.1, 1.5); smaller and larger
+    // ones with an exponent (1e+21, 2.5e-08). Integers print without a point.
+    static size_t format(double value, char* out) {
+        if (value == 0) {
+            out[0] = '0';   // -0 as well
+            return 1;
+        }
+        double magnitude = std::fabs(value);
+        bool fixed = magnitude >= 1e-7 && magnitude < 1e21;
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+        std::to_chars_result result = std::to_chars(out, out + MAX_LENGTH, value,
+                                                    fixed ? std::chars_format::fixed : std::chars_format::scientific);
+        return static_cast<size_t>(result.ptr - out);
+#else
+        // Without floating point to_chars: the fewest digits that read back,
+        // though %g picks the notation by its own rules
+        (void)fixed;
+        int length = 0;
+        for (int precision = 1; precision <= 17; precision++) {
+            length = std::snprintf(out, MAX_LENGTH, "%.*g", precision, value);
+            if (std::strtod(out, nullptr) == value) break;
+        }
+        return static_cast<size_t>(length);
+#endif
+    }
+
+    static std::string format(double value) {
+        char text[MAX_LENGTH];
+        return std::string(text, format(value, text));
+    }
+
+    // Reads the number text starts with, after any whitespace and an optional
+    // '+'. Whatever follows the number is ignored. Returns false if there is no number.
+    static bool parse(std::string_view text, double& value) {
+        const char* p = skipSign(text);
+        const char* end = text.data() + text.size();
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+        return std::from_chars(p, end, value).ec == std::errc();
+#else
+        // strtod needs a terminator
+        std::string copy(p, end);
+        char* stop;
+        value = std::strtod(copy.c_str(), &stop);
+        return stop != copy.c_str();
+#endif
+    }
+
+    // The same for a whole number, which has to fit in 64 bits; "3.7" reads as 3
+    static bool parseInteger(std::string_view text, double& value) {
+        const char* p = skipSign(text);
+        long long integer;
+        if (std::from_chars(p, text.data() + text.size(), integer).ec != std::errc()) return false;
+        value = static_cast<double>(integer);
+        return true;
+    }
+
+private:
+    static const char* skipSign(std::string_view text) {
+        const char* p = text.data();
+        const char* end = p + text.size();
+        while (p < end && (*p == ' ' || (*p >= '\t' && *p <= '\r'))) p++;
+        if (p < end && *p == '+' && p + 1 < end && *(p + 1) != '-') p++;
+        return p;
+    }
+};
+
+#endif
@@ -0,0 +1,72 @@
+//////////////////////////////////////
+// ChocoLang Script Output
+// Buffered stdout for puts and print
+//////////////////////////////////////
+
+#ifndef CHOCO_OUTPUT_H
+#define CHOCO_OUTPUT_H
+
+#include <string>
+#include <string_view>
+#include <cstdio>
+#include "choco_value.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define CHOCO_ISATTY(fd) _isatty(fd)
+#define CHOCO_FILENO(file) _fileno(file)
+#else
+#include <unistd.h>
+#define CHOCO_ISATTY(fd) isatty(fd)
+#define CHOCO_FILENO(file) fileno(file)
+#endif
+
+// Values are appended to the buffer as text directly, without building a
+// string for each one first. On a terminal every puts or print is flushed
+// right away, as before; into a pipe or a file the buffer only goes out when it
+// fills, before input() reads, and at exit.
+class Output {
+public:
+    static Output& standard() {
+        static Output out(stdout);
+        return out;
+    }
+
+    ~Output() { flush(); }
+
+    Output(const Output&) = delete;
+    Output& operator=(const Output&) = delete;
+
+    void write(const Value& value) { value.appendTo(buffer); }
+    void write(std::string_view text) { buffer.append(text.data(), text.size()); }
+    void write(char c) { buffer += c; }
+
+    // Ends one puts or print
+    void done() {
+        if (interactive || buffer.size() >= CAPACITY) flush();
+    }
+
+    void flush() {
+        if (!buffer.empty()) {
+            std::fwrite(buffer.data(), 1, buffer.size(), file);
+            buffer.clear();
+        }
+        std::fflush(file);
+    }
+
+private:
+    static const size_t CAPACITY = 64 * 1024;
+
+    std::FILE* file;
+    bool interactive;
+    std::string buffer;
+
+    explicit Output(std::FILE* f) : file(f), interactive(CHOCO_ISATTY(CHOCO_FILENO(f)) != 0) {
+        buffer.reserve(CAPACITY);
+    }
+};
+
+#undef CHOCO_ISATTY
+#undef CHOCO_FILENO
+
+#endif
@@ -0,0 +1,187 @@
+//////////////////////////////////////
+// ChocoLang Source Files
+// Memory-mapped script sources and the byte-class scans the lexer runs on them
+//////////////////////////////////////
+
+#ifndef CHOCO_SOURCE_H
+#define CHOCO_SOURCE_H
+
+#include <string>
+#include <string_view>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef NOGDI
+#define NOGDI
+#endif
+// winnt.h has a TokenType of its own, which would clash with the lexer's
+#define TokenType WinTokenType
+#include <windows.h>
+#undef TokenType
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define CHOCO_SCAN_SSE2 1
+#endif
+
+// A file mapped read-only into memory. Where it cannot be mapped (an empty
+// file, a pipe) it is read into a buffer instead. Tokens lexed from the text
+// point into it, so it has to outlive them.
+class SourceFile {
+public:
+    explicit SourceFile(const std::string& path) {
+        if (!map(path)) {
+            std::ifstream file(path, std::ios::binary);
+            if (!file) return;
+            buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            bytes = buffer.data();
+            length = buffer.size();
+        }
+        opened = true;
+    }
+
+    ~SourceFile() {
+        if (!mapped) return;
+#ifdef _WIN32
+        UnmapViewOfFile(bytes);
+#else
+        munmap(const_cast<char*>(bytes), length);
+#endif
+    }
+
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    bool ok() const { return opened; }
+    std::string_view text() const { return std::string_view(bytes, length); }
+
+private:
+    const char* bytes = "";
+    size_t length = 0;
+    bool mapped = false;
+    bool opened = false;
+    std::string buffer;
+
+    bool map(const std::string& path) {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        HANDLE mapping = nullptr;
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        }
+        CloseHandle(file);
+        if (!mapping) return false;
+        void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (!view) return false;
+        bytes = static_cast<const char*>(view);
+        length = static_cast<size_t>(size.QuadPart);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        void* view = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (view == MAP_FAILED) return false;
+        bytes = static_cast<const char*>(view);
+        length = static_cast<size_t>(info.st_size);
+#endif
+        mapped = true;
+        return true;
+    }
+};
+
+// Byte-class scans over [p, end). With SSE2 they test 16 bytes per step and
+// fall back to one byte at a time for the last partial block.
+struct CharScan {
+    static bool isSpace(char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    static bool isIdentifier(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+    }
+
+    // First byte that is not whitespace
+    static const char* whitespace(const char* p, const char* end) {
+#ifdef CHOCO_SCAN_SSE2
+        while (end - p >= 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i control = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('\t' - 1)),
+                                            _mm_cmplt_epi8(block, _mm_set1_epi8('\r' + 1)));
+            __m128i space = _mm_or_si128(control, _mm_cmpeq_epi8(block, _mm_set1_epi8(' ')));
+            unsigned stop = ~static_cast<unsigned>(_mm_movemask_epi8(space)) & 0xffff;
+            if (stop != 0) return p + __builtin_ctz(stop);
+            p += 16;
+        }
+#endif
+        while (p < end && isSpace(*p)) p++;
+        return p;
+    }
+
+    // First byte that cannot continue an identifier
+    static const char* identifier(const char* p, const char* end) {
+#ifdef CHOCO_SCAN_SSE2
+        while (end - p >= 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i lower = _mm_or_si128(block, _mm_set1_epi8(0x20));
+            __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                           _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+            __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('0' - 1)),
+                                          _mm_cmplt_epi8(block, _mm_set1_epi8('9' + 1)));
+            __m128i word = _mm_or_si128(_mm_or_si128(letter, digit), _mm_cmpeq_epi8(block, _mm_set1_epi8('_')));
+            unsigned stop = ~static_cast<unsigned>(_mm_movemask_epi8(word)) & 0xffff;
+            if (stop != 0) return p + __builtin_ctz(stop);
+            p += 16;
+        }
+#endif
+        while (p < end && isIdentifier(*p)) p++;
+        return p;
+    }
+
+    // First byte inside a string literal that needs a closer look: the
+    // closing quote, an escape, a newline or a possible interpolation
+    static const char* stringRun(const char* p, const char* end) {
+#ifdef CHOCO_SCAN_SSE2
+        while (end - p >= 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('"')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\\'))),
+                _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(block, _mm_set1_epi8('#'))));
+            unsigned stop = static_cast<unsigned>(_mm_movemask_epi8(special));
+            if (stop != 0) return p + __builtin_ctz(stop);
+            p += 16;
+        }
+#endif
+        while (p < end && *p != '"' && *p != '\\' && *p != '\n' && *p != '#') p++;
+        return p;
+    }
+
+    // The end of the line p is on
+    static const char* lineEnd(const char* p, const char* end) {
+        const void* newline = memchr(p, '\n', static_cast<size_t>(end - p));
+        return newline ? static_cast<const char*>(newline) : end;
+    }
+};
+
+#endif
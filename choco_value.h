@@ -0,0 +1,293 @@
+//////////////////////////////////////
+// ChocoLang Value Representation
+// Shared by the interpreter and GUI bindings
+//////////////////////////////////////
+
+#ifndef CHOCO_VALUE_H
+#define CHOCO_VALUE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <memory>
+#include <cstdint>
+#include <utility>
+#include "choco_atom.h"
+#include "choco_number.h"
+
+struct FunctionProto;
+struct Value;
+
+// Heap objects. Values point at them and share them through a reference count;
+// numbers, bools and nil are stored inline in the Value itself.
+struct Obj {
+    enum Kind : uint8_t { STRING, ARRAY, STRUCT, LAMBDA, BUILDER, FLOAT_ARRAY } kind;
+    uint32_t refCount;
+
+    explicit Obj(Kind k) : kind(k), refCount(0) {}
+};
+
+struct ObjString : Obj {
+    std::string str;
+    // Set when the string is a name (a function referenced by value), so calls
+    // through it need no hashing
+    Atom atom;
+    explicit ObjString(std::string s, Atom a = NO_ATOM) : Obj(STRING), str(std::move(s)), atom(a) {}
+};
+
+struct ObjArray : Obj {
+    std::vector<Value> items;
+    explicit ObjArray(std::vector<Value> v) : Obj(ARRAY), items(std::move(v)) {}
+};
+
+// The field layout of struct instances: the value of fields[i] lives in slot i.
+// Shapes are interned and never freed, so every instance built from the same
+// definition shares one and field lookups can be cached per shape.
+struct Shape {
+    Atom type;
+    std::vector<Atom> fields;
+
+    // Slot of field, or -1
+    int slot(Atom field) const {
+        for (size_t i = 0; i < fields.size(); i++) {
+            if (fields[i] == field) return static_cast<int>(i);
+        }
+        return -1;
+    }
+
+    static const Shape* get(Atom type, const std::vector<Atom>& fields) {
+        static std::map<std::pair<Atom, std::vector<Atom>>, std::unique_ptr<Shape>> shapes;
+        std::unique_ptr<Shape>& shape = shapes[std::make_pair(type, fields)];
+        if (!shape) shape.reset(new Shape{type, fields});
+        return shape.get();
+    }
+};
+
+// A slot left UNDEFINED is a field the literal did not set
+struct ObjStruct : Obj {
+    const Shape* shape;
+    std::vector<Value> slots;
+    explicit ObjStruct(const Shape* s);
+};
+
+struct ObjLambda : Obj {
+    const FunctionProto* proto;
+    std::vector<Value> captures;
+    explicit ObjLambda(const FunctionProto* p) : Obj(LAMBDA), proto(p) {}
+};
+
+// A string under construction. Unlike strings and arrays a builder is shared,
+// not copied on write: appending through any value holding it changes it for all.
+struct ObjBuilder : Obj {
+    std::string text;
+    ObjBuilder() : Obj(BUILDER) {}
+};
+
+// Numbers stored side by side as plain doubles, for the numeric kernels.
+// Never changed once made; the builtins working on them return new ones.
+struct ObjFloatArray : Obj {
+    std::vector<double> items;
+    explicit ObjFloatArray(std::vector<double> i) : Obj(FLOAT_ARRAY), items(std::move(i)) {}
+};
+
+// A 16 byte tagged value: one type byte plus an 8 byte payload
+struct Value {
+    // UNDEFINED marks a variable slot that has not been assigned yet; scripts never see it
+    enum Type : uint8_t { NUMBER, STRING, BOOL, ARRAY, STRUCT, LAMBDA, BUILDER, FLOAT_ARRAY, NIL, UNDEFINED } type;
+    union {
+        double num;
+        bool boolean;
+        Obj* obj;
+    };
+
+    Value() : type(NIL), num(0) {}
+    Value(double n) : type(NUMBER), num(n) {}
+    Value(bool b) : type(BOOL), num(0) { boolean = b; }
+    Value(const char* s) : Value(std::string(s)) {}
+    Value(const std::string& s) : Value(STRING, new ObjString(s)) {}
+    Value(std::string&& s) : Value(STRING, new ObjString(std::move(s))) {}
+    Value(const std::vector<Value>& arr) : Value(ARRAY, new ObjArray(arr)) {}
+    Value(std::vector<Value>&& arr) : Value(ARRAY, new ObjArray(std::move(arr))) {}
+    Value(ObjStruct* s) : Value(STRUCT, s) {}
+    Value(ObjLambda* l) : Value(LAMBDA, l) {}
+    Value(ObjBuilder* b) : Value(BUILDER, b) {}
+    Value(ObjFloatArray* f) : Value(FLOAT_ARRAY, f) {}
+
+    // A string that remembers the atom it was made from
+    static Value fromAtom(Atom atom) {
+        return Value(STRING, new ObjString(AtomTable::name(atom), atom));
+    }
+
+    static Value undefined() {
+        Value v;
+        v.type = UNDEFINED;
+        return v;
+    }
+
+    Value(const Value& other) : type(other.type), num(other.num) {
+        if (isObj()) obj->refCount++;
+    }
+
+    Value(Value&& other) noexcept : type(other.type), num(other.num) {
+        other.type = NIL;
+    }
+
+    Value& operator=(const Value& other) {
+        if (other.isObj()) other.obj->refCount++;
+        release();
+        type = other.type;
+        num = other.num;
+        return *this;
+    }
+
+    Value& operator=(Value&& other) noexcept {
+        if (this != &other) {
+            release();
+            type = other.type;
+            num = other.num;
+            other.type = NIL;
+        }
+        return *this;
+    }
+
+    ~Value() { release(); }
+
+    inline bool isObj() const {
+        return type == STRING || type == ARRAY || type == STRUCT || type == LAMBDA || type == BUILDER ||
+               type == FLOAT_ARRAY;
+    }
+
+    const std::string& str() const { return static_cast<ObjString*>(obj)->str; }
+    Atom atom() const { return static_cast<ObjString*>(obj)->atom; }
+    const std::vector<Value>& array() const { return static_cast<ObjArray*>(obj)->items; }
+    ObjStruct* asStruct() const { return static_cast<ObjStruct*>(obj); }
+    ObjLambda* asLambda() const { return static_cast<ObjLambda*>(obj); }
+    std::string& builder() const { return static_cast<ObjBuilder*>(obj)->text; }
+    const std::vector<double>& floats() const { return static_cast<ObjFloatArray*>(obj)->items; }
+    Atom structType() const { return asStruct()->shape->type; }
+
+    // Copy-on-write access: the buffer is cloned first if another value shares it
+    std::vector<Value>& mutableArray() {
+        if (obj->refCount > 1) {
+            obj->refCount--;
+            obj = new ObjArray(array());
+            obj->refCount = 1;
+        }
+        return static_cast<ObjArray*>(obj)->items;
+    }
+
+    std::string& mutableStr() {
+        if (obj->refCount > 1) {
+            obj->refCount--;
+            obj = new ObjString(str());
+            obj->refCount = 1;
+        }
+        static_cast<ObjString*>(obj)->atom = NO_ATOM;
+        return static_cast<ObjString*>(obj)->str;
+    }
+
+    std::string toString() const {
+        std::string result;
+        appendTo(result);
+        return result;
+    }
+
+    // Appends the text of the value to out, as toString() would return it
+    void appendTo(std::string& out) const {
+        switch (type) {
+            case NUMBER: {
+                char digits[NumberText::MAX_LENGTH];
+                out.append(digits, NumberText::format(num, digits));
+                break;
+            }
+            case STRING: out += str(); break;
+            case BOOL: out += boolean ? "true" : "false"; break;
+            case ARRAY: {
+                const std::vector<Value>& items = array();
+                out += '[';
+                for (size_t i = 0; i < items.size(); i++) {
+                    items[i].appendTo(out);
+                    if (i < items.size() - 1) out += ", ";
+                }
+                out += ']';
+                break;
+            }
+            case STRUCT: {
+                const ObjStruct* s = asStruct();
+                out += AtomTable::name(s->shape->type);
+                out += " { ";
+                bool first = true;
+                for (size_t i = 0; i < s->slots.size(); i++) {
+                    if (s->slots[i].type == UNDEFINED) continue;
+                    if (!first) out += ", ";
+                    out += AtomTable::name(s->shape->fields[i]);
+                    out += ": ";
+                    s->slots[i].appendTo(out);
+                    first = false;
+                }
+                out += " }";
+                break;
+            }
+            case LAMBDA: out += "<lambda>"; break;
+            case BUILDER: out += builder(); break;
+            case FLOAT_ARRAY: {
+                const std::vector<double>& items = floats();
+                char digits[NumberText::MAX_LENGTH];
+                out += '[';
+                for (size_t i = 0; i < items.size(); i++) {
+                    out.append(digits, NumberText::format(items[i], digits));
+                    if (i < items.size() - 1) out += ", ";
+                }
+                out += ']';
+                break;
+            }
+            case NIL:
+            case UNDEFINED: out += "nil"; break;
+        }
+    }
+
+    std::string getType() const {
+        switch (type) {
+            case NUMBER: return "number";
+            case STRING: return "string";
+            case BOOL: return "bool";
+            case ARRAY: return "array";
+            case STRUCT: return structType() == NO_ATOM ? "struct" : AtomTable::name(structType());
+            case LAMBDA: return "lambda";
+            case BUILDER: return "builder";
+            case FLOAT_ARRAY: return "float_array";
+            case NIL:
+            case UNDEFINED: return "nil";
+        }
+        return "unknown";
+    }
+
+private:
+    Value(Type t, Obj* o) : type(t) {
+        obj = o;
+        o->refCount = 1;
+    }
+
+    void release() {
+        if (isObj() && --obj->refCount == 0) {
+            destroy(obj);
+        }
+    }
+
+    static void destroy(Obj* o) {
+        switch (o->kind) {
+            case Obj::STRING: delete static_cast<ObjString*>(o); break;
+            case Obj::ARRAY: delete static_cast<ObjArray*>(o); break;
+            case Obj::STRUCT: delete static_cast<ObjStruct*>(o); break;
+            case Obj::LAMBDA: delete static_cast<ObjLambda*>(o); break;
+            case Obj::BUILDER: delete static_cast<ObjBuilder*>(o); break;
+            case Obj::FLOAT_ARRAY: delete static_cast<ObjFloatArray*>(o); break;
+        }
+    }
+};
+
+inline ObjStruct::ObjStruct(const Shape* s)
+    : Obj(STRUCT), shape(s), slots(s->fields.size(), Value::undefined()) {}
+
+#endif
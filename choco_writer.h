@@ -0,0 +1,141 @@
+//////////////////////////////////////
+// ChocoLang File Writers
+// Buffered output files drained by a background thread
+//////////////////////////////////////
+
+#ifndef CHOCO_WRITER_H
+#define CHOCO_WRITER_H
+
+#include <string>
+#include <string_view>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// An open output file. write() only appends to a memory buffer; the writer's
+// thread takes the buffer and writes it out once it holds capacity bytes, when
+// flush() asks for it, or otherwise within about a second. The script only
+// waits when it gets two buffers ahead of the disk.
+//
+// A failed write is reported by the next write(), flush() or close(), which
+// return false with the reason in error().
+class FileWriter {
+public:
+    FileWriter(const std::string& path, bool append, size_t capacity, bool sync)
+        : capacity(capacity), sync(sync) {
+        file = std::fopen(path.c_str(), append ? "ab" : "wb");
+        if (!file) return;
+        // Blocks are written whole, so stdio's own buffer would only add a copy
+        std::setvbuf(file, nullptr, _IONBF, 0);
+        buffer.reserve(capacity);
+        thread = std::thread(&FileWriter::drain, this);
+    }
+
+    ~FileWriter() { close(); }
+
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+
+    bool ok() const { return file != nullptr; }
+    const std::string& error() const { return failure; }
+
+    bool write(std::string_view data) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (buffer.size() >= 2 * capacity) {
+            spaceFree.wait(lock, [this] { return buffer.size() < 2 * capacity || !failure.empty(); });
+        }
+        if (!failure.empty()) return false;
+        bool wasBelow = buffer.size() < capacity;
+        buffer.append(data.data(), data.size());
+        appended += data.size();
+        if (wasBelow && buffer.size() >= capacity) work.notify_one();
+        return true;
+    }
+
+    // Waits until everything written so far is in the file (and on disk, with sync)
+    bool flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!buffer.empty()) {
+            flushWanted = true;
+            work.notify_one();
+        }
+        spaceFree.wait(lock, [this] { return written == appended || !failure.empty(); });
+        return failure.empty();
+    }
+
+    bool close() {
+        if (!file) return failure.empty();
+        bool flushed = flush();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work.notify_one();
+        thread.join();
+        if (std::fclose(file) != 0 && flushed) {
+            failure = "could not close the file";
+        }
+        file = nullptr;
+        return failure.empty();
+    }
+
+private:
+    std::FILE* file = nullptr;
+    size_t capacity;
+    bool sync;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable work;       // the thread waits on this for a full buffer or a flush
+    std::condition_variable spaceFree;  // writers wait on this for the thread to catch up
+    std::string buffer;
+    size_t appended = 0;
+    size_t written = 0;
+    bool flushWanted = false;
+    bool stopping = false;
+    std::string failure;
+
+    void drain() {
+        std::string block;
+        block.reserve(capacity);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work.wait_for(lock, std::chrono::seconds(1), [this] {
+                return buffer.size() >= capacity || flushWanted || stopping;
+            });
+            if (buffer.empty()) {
+                if (stopping) return;
+                continue;
+            }
+            block.swap(buffer);
+            flushWanted = false;
+            lock.unlock();
+
+            bool ok = std::fwrite(block.data(), 1, block.size(), file) == block.size();
+            if (ok && sync) ok = syncFile();
+
+            lock.lock();
+            written += block.size();
+            block.clear();
+            if (!ok && failure.empty()) failure = "could not write to the file";
+            spaceFree.notify_all();
+        }
+    }
+
+    bool syncFile() {
+#ifdef _WIN32
+        return _commit(_fileno(file)) == 0;
+#else
+        return fsync(fileno(file)) == 0;
+#endif
+    }
+};
+
+#endif
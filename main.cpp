@@ -9,6 +9,9 @@
 #include <vector>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <string_view>
 #include <memory>
 #include <fstream>
 #include <sstream>
@@ -19,7 +22,18 @@
 #include <ctime>
 #include <cstdlib>
 #include <functional>
+#include <filesystem>
+#include <random>
+#include <chrono>
+#include <cstring>
 #include "choco_gui.h"
+#include "choco_atom.h"
+#include "choco_value.h"
+#include "choco_natives.h"
+#include "choco_source.h"
+#include "choco_writer.h"
+#include "choco_output.h"
+#include "choco_kernels.h"
 
 // Token types
 enum TokenType {
@@ -37,16 +51,88 @@ enum TokenType {
     TOKEN_PIPE
 };
 
-struct Token {
-    TokenType type;
-    std::string value;
-    int line;
+static_assert(TOKEN_PIPE <= UINT8_MAX, "token kinds are stored in one byte");
+
+// The lexed tokens as parallel arrays: per token a kind byte, the offset where
+// it starts in the source and a payload, which is the atom of an identifier or
+// the index of a literal's value. Lines are not stored; line() counts them
+// from the offsets, starting where the last call left off, since the parser
+// asks in source order. Literal text views the source (or `decoded`, for a
+// string with escapes), so the source has to outlive the stream.
+class TokenStream {
+public:
+    TokenStream(std::string_view src, int firstLine) : source(src), cursorLine(firstLine) {}
+
+    // Includes the trailing TOKEN_EOF
+    size_t size() const { return kinds.size(); }
+
+    TokenType type(size_t i) const { return static_cast<TokenType>(kinds[i]); }
+    Atom atom(size_t i) const { return payloads[i]; }
+    double number(size_t i) const { return numbers[payloads[i]]; }
+    std::string_view string(size_t i) const { return strings[payloads[i]]; }
+
+    // For every '{' the index of its matching '}', and the other way round
+    size_t brace(size_t i) const { return braces[i]; }
+
+    int line(size_t i) const {
+        const char* target = source.data() + offsets[i];
+        const char* cursor = source.data() + cursorOffset;
+        if (target >= cursor) {
+            cursorLine += static_cast<int>(std::count(cursor, target, '\n'));
+        } else {
+            cursorLine -= static_cast<int>(std::count(target, cursor, '\n'));
+        }
+        cursorOffset = offsets[i];
+        return cursorLine;
+    }
+
+    // The token as written, for error messages
+    std::string text(size_t i) const {
+        const char* start = source.data() + offsets[i];
+        const char* end = source.data() + source.size();
+        switch (type(i)) {
+            case TOKEN_EOF: return "";
+            case TOKEN_STRING: return std::string(string(i));
+            case TOKEN_IDENTIFIER: return AtomTable::name(atom(i));
+            case TOKEN_NUMBER: {
+                const char* p = CharScan::identifier(start, end);
+                if (p + 1 < end && *p == '.' && std::isdigit(static_cast<unsigned char>(p[1]))) {
+                    p = CharScan::identifier(p + 1, end);
+                }
+                return std::string(start, p);
+            }
+            case TOKEN_EQUAL_EQUAL: case TOKEN_BANG_EQUAL: case TOKEN_LESS_EQUAL: case TOKEN_GREATER_EQUAL:
+            case TOKEN_AND: case TOKEN_OR: case TOKEN_ARROW: case TOKEN_ARROW_FAT: case TOKEN_DOTDOT:
+                return std::string(start, 2);
+            default:
+                if (type(i) < TOKEN_PLUS) return std::string(start, CharScan::identifier(start, end));
+                return std::string(start, 1);
+        }
+    }
+
+private:
+    friend class Lexer;
+
+    std::string_view source;
+    std::vector<uint8_t> kinds;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> payloads;
+    std::vector<double> numbers;
+    std::vector<std::string_view> strings;
+    // String literals whose value differs from their source text (escapes);
+    // a deque never moves its elements, so views into them stay valid
+    std::deque<std::string> decoded;
+    std::vector<uint32_t> braces;
+
+    mutable size_t cursorOffset = 0;
+    mutable int cursorLine;
 };
 
 // Runtime error exception
 class RuntimeError : public std::runtime_error {
 public:
     int line;
+    std::string trace;      // the calls active when it was raised, filled in by the VM
     RuntimeError(const std::string& msg, int line_num) 
         : std::runtime_error(msg), line(line_num) {}
 };
@@ -69,20 +155,48 @@ public:
 
 // Lexer
 class Lexer {
-    std::string source;
+    // The source is not copied; it has to outlive the lexer and its tokens
+    std::string_view source;
     size_t pos = 0;
-    int line = 1;
+    int firstLine;
+    TokenStream tokens;
     
-    static const std::unordered_map<std::string, TokenType> keywords;
+    static const std::unordered_map<std::string_view, TokenType> keywords;
 
 public:
-    Lexer(const std::string& src) : source(src) {}
+    Lexer(std::string_view src, int firstLine = 1) : source(src), firstLine(firstLine), tokens(src, firstLine) {}
 
-    std::vector<Token> tokenize() {
-        std::vector<Token> tokens;
-        tokens.reserve(source.length() / 4);
-        
+    // Index of the '}' closing an interpolation whose expression starts at
+    // start, skipping nested braces and string literals; npos if the line ends first
+    static size_t interpolationEnd(std::string_view text, size_t start) {
+        int depth = 0;
+        for (size_t i = start; i < text.size() && text[i] != '\n'; i++) {
+            if (text[i] == '"') {
+                for (i++; i < text.size() && text[i] != '"' && text[i] != '\n'; i++) {
+                    if (text[i] == '\\') i++;
+                }
+                if (i >= text.size() || text[i] != '"') return std::string::npos;
+            } else if (text[i] == '{') {
+                depth++;
+            } else if (text[i] == '}') {
+                if (depth == 0) return i;
+                depth--;
+            }
+        }
+        return std::string::npos;
+    }
+
+    // Can only be called once; the tokens are moved out of the lexer
+    TokenStream tokenize() {
         try {
+            // Offsets are 32 bits
+            if (source.length() > UINT32_MAX) {
+                throw LexerError("Source is too large (over 4 GB)", firstLine);
+            }
+            tokens.kinds.reserve(source.length() / 4);
+            tokens.offsets.reserve(source.length() / 4);
+            tokens.payloads.reserve(source.length() / 4);
+
             while (pos < source.length()) {
                 skipWhitespace();
                 if (pos >= source.length()) break;
@@ -92,32 +206,72 @@ public:
                     continue;
                 }
 
-                Token tok = nextToken();
-                tokens.push_back(std::move(tok));
+                nextToken();
             }
-            tokens.push_back({TOKEN_EOF, "", line});
-            tokens.shrink_to_fit();
+            add(TOKEN_EOF, source.length());
+            matchBraces();
         } catch (const LexerError& e) {
             std::cerr << "Lexer Error on line " << e.line << ": " << e.what() << std::endl;
             throw;
         }
         
-        return tokens;
+        return std::move(tokens);
     }
 
 private:
-    void skipWhitespace() {
-        while (pos < source.length() && std::isspace(static_cast<unsigned char>(source[pos]))) {
-            if (source[pos] == '\n') line++;
+    void matchBraces() {
+        tokens.braces.assign(tokens.size(), 0);
+        std::vector<uint32_t> open;
+        for (size_t i = 0; i < tokens.size(); i++) {
+            if (tokens.type(i) == TOKEN_LBRACE) {
+                open.push_back(static_cast<uint32_t>(i));
+            } else if (tokens.type(i) == TOKEN_RBRACE) {
+                if (open.empty()) {
+                    throw LexerError("Unexpected '}' without matching '{'", tokens.line(i));
+                }
+                tokens.braces[open.back()] = static_cast<uint32_t>(i);
+                tokens.braces[i] = open.back();
+                open.pop_back();
+            }
+        }
+        if (!open.empty()) {
+            throw LexerError("Unclosed '{'", tokens.line(open.back()));
+        }
+    }
+
+    // Lines are only counted for errors
+    int lineAt(size_t offset) const {
+        return firstLine + static_cast<int>(std::count(source.data(), at(offset), '\n'));
+    }
+
+    const char* at(size_t offset) const { return source.data() + offset; }
+    const char* sourceEnd() const { return source.data() + source.size(); }
+
+    void add(TokenType type, size_t start, uint32_t payload = 0) {
+        tokens.kinds.push_back(static_cast<uint8_t>(type));
+        tokens.offsets.push_back(static_cast<uint32_t>(start));
+        tokens.payloads.push_back(payload);
+    }
+
+    // Consumes c if it comes next
+    bool follows(char c) {
+        if (pos < source.length() && source[pos] == c) {
             pos++;
+            return true;
         }
+        return false;
+    }
+
+    void skipWhitespace() {
+        pos = CharScan::whitespace(at(pos), sourceEnd()) - source.data();
     }
 
     void skipComment() {
-        while (pos < source.length() && source[pos] != '\n') pos++;
+        pos = CharScan::lineEnd(at(pos), sourceEnd()) - source.data();
     }
 
-    Token nextToken() {
+    void nextToken() {
+        size_t start = pos;
         char c = source[pos];
 
         if (std::isdigit(static_cast<unsigned char>(c))) return number();
@@ -126,92 +280,50 @@ private:
 
         pos++;
         switch (c) {
-            case '+': return {TOKEN_PLUS, "+", line};
-            case '*': return {TOKEN_STAR, "*", line};
-            case '/': return {TOKEN_SLASH, "/", line};
-            case '%': return {TOKEN_PERCENT, "%", line};
-            case '(': return {TOKEN_LPAREN, "(", line};
-            case ')': return {TOKEN_RPAREN, ")", line};
-            case '{': return {TOKEN_LBRACE, "{", line};
-            case '}': return {TOKEN_RBRACE, "}", line};
-            case '[': return {TOKEN_LBRACKET, "[", line};
-            case ']': return {TOKEN_RBRACKET, "]", line};
-            case ',': return {TOKEN_COMMA, ",", line};
-            case ';': return {TOKEN_SEMICOLON, ";", line};
-            case ':': return {TOKEN_COLON, ":", line};
-            case '.':
-                if (pos < source.length() && source[pos] == '.') {
-                    pos++;
-                    return {TOKEN_DOTDOT, "..", line};
-                }
-                return {TOKEN_DOT, ".", line};
-            case '-':
-                if (pos < source.length() && source[pos] == '>') {
-                    pos++;
-                    return {TOKEN_ARROW, "->", line};
-                }
-                return {TOKEN_MINUS, "-", line};
+            case '+': return add(TOKEN_PLUS, start);
+            case '*': return add(TOKEN_STAR, start);
+            case '/': return add(TOKEN_SLASH, start);
+            case '%': return add(TOKEN_PERCENT, start);
+            case '(': return add(TOKEN_LPAREN, start);
+            case ')': return add(TOKEN_RPAREN, start);
+            case '{': return add(TOKEN_LBRACE, start);
+            case '}': return add(TOKEN_RBRACE, start);
+            case '[': return add(TOKEN_LBRACKET, start);
+            case ']': return add(TOKEN_RBRACKET, start);
+            case ',': return add(TOKEN_COMMA, start);
+            case ';': return add(TOKEN_SEMICOLON, start);
+            case ':': return add(TOKEN_COLON, start);
+            case '.': return add(follows('.') ? TOKEN_DOTDOT : TOKEN_DOT, start);
+            case '-': return add(follows('>') ? TOKEN_ARROW : TOKEN_MINUS, start);
             case '=':
-                if (pos < source.length() && source[pos] == '=') {
-                    pos++;
-                    return {TOKEN_EQUAL_EQUAL, "==", line};
-                } else if (pos < source.length() && source[pos] == '>') {
-                    pos++;
-                    return {TOKEN_ARROW_FAT, "=>", line};
-                }
-                return {TOKEN_EQUAL, "=", line};
-            case '!':
-                if (pos < source.length() && source[pos] == '=') {
-                    pos++;
-                    return {TOKEN_BANG_EQUAL, "!=", line};
-                }
-                return {TOKEN_BANG, "!", line};
-            case '<':
-                if (pos < source.length() && source[pos] == '=') {
-                    pos++;
-                    return {TOKEN_LESS_EQUAL, "<=", line};
-                }
-                return {TOKEN_LESS, "<", line};
-            case '>':
-                if (pos < source.length() && source[pos] == '=') {
-                    pos++;
-                    return {TOKEN_GREATER_EQUAL, ">=", line};
-                }
-                return {TOKEN_GREATER, ">", line};
+                if (follows('=')) return add(TOKEN_EQUAL_EQUAL, start);
+                return add(follows('>') ? TOKEN_ARROW_FAT : TOKEN_EQUAL, start);
+            case '!': return add(follows('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG, start);
+            case '<': return add(follows('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS, start);
+            case '>': return add(follows('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER, start);
             case '&':
-                if (pos < source.length() && source[pos] == '&') {
-                    pos++;
-                    return {TOKEN_AND, "&&", line};
-                }
-                throw LexerError("Unexpected character '&'. Did you mean '&&'?", line);
-            case '|':
-                if (pos < source.length() && source[pos] == '|') {
-                    pos++;
-                    return {TOKEN_OR, "||", line};
-                }
-                return {TOKEN_PIPE, "|", line};
+                if (follows('&')) return add(TOKEN_AND, start);
+                throw LexerError("Unexpected character '&'. Did you mean '&&'?", lineAt(start));
+            case '|': return add(follows('|') ? TOKEN_OR : TOKEN_PIPE, start);
             default:
-                throw LexerError("Unexpected character: '" + std::string(1, c) + "'", line);
+                throw LexerError("Unexpected character: '" + std::string(1, c) + "'", lineAt(start));
         }
-        return {TOKEN_EOF, "", line};
     }
 
-    Token number() {
-        std::string num;
-        num.reserve(16);
+    void number() {
+        size_t start = pos;
         bool hasDot = false;
-        int startLine = line;
         
         while (pos < source.length()) {
             if (std::isdigit(static_cast<unsigned char>(source[pos]))) {
-                num += source[pos++];
+                pos++;
             } else if (source[pos] == '.' && !hasDot) {
                 if (pos + 1 < source.length() && source[pos + 1] == '.') {
                     break;
                 }
                 if (pos + 1 < source.length() && std::isdigit(static_cast<unsigned char>(source[pos + 1]))) {
                     hasDot = true;
-                    num += source[pos++];
+                    pos++;
                 } else {
                     break;
                 }
@@ -220,64 +332,80 @@ private:
             }
         }
         
-        return {TOKEN_NUMBER, num, startLine};
+        double value = 0;
+        NumberText::parse(source.substr(start, pos - start), value);
+        add(TOKEN_NUMBER, start, static_cast<uint32_t>(tokens.numbers.size()));
+        tokens.numbers.push_back(value);
     }
 
-    Token identifier() {
-        std::string id;
-        id.reserve(32);
-        int startLine = line;
-        
-        while (pos < source.length() && (std::isalnum(static_cast<unsigned char>(source[pos])) || source[pos] == '_')) {
-            id += source[pos++];
-        }
+    void identifier() {
+        size_t start = pos;
+        pos = CharScan::identifier(at(pos), sourceEnd()) - source.data();
+        std::string_view id = source.substr(start, pos - start);
 
         auto it = keywords.find(id);
         if (it != keywords.end()) {
-            return {it->second, id, startLine};
+            return add(it->second, start);
         }
 
-        return {TOKEN_IDENTIFIER, id, startLine};
+        add(TOKEN_IDENTIFIER, start, AtomTable::intern(id));
     }
 
-    Token string() {
-        int startLine = line;
+    // A literal without escapes is a view of its source text; one with escapes
+    // is decoded into the token stream
+    void string() {
+        size_t quote = pos;
         pos++; // skip opening "
-        std::string str;
-        str.reserve(64);
+        size_t start = pos;
+        std::string* str = nullptr;
         
-        while (pos < source.length() && source[pos] != '"') {
+        while (true) {
+            size_t run = CharScan::stringRun(at(pos), sourceEnd()) - source.data();
+            if (str) str->append(source, pos, run - pos);
+            pos = run;
+            if (pos >= source.length() || source[pos] == '"') break;
             if (source[pos] == '\n') {
-                throw LexerError("Unterminated string literal", startLine);
+                throw LexerError("Unterminated string literal", lineAt(quote));
             }
             if (source[pos] == '\\' && pos + 1 < source.length()) {
+                if (!str) {
+                    tokens.decoded.emplace_back(source.substr(start, pos - start));
+                    str = &tokens.decoded.back();
+                }
                 pos++;
                 switch (source[pos]) {
-                    case 'n': str += '\n'; break;
-                    case 't': str += '\t'; break;
-                    case '\\': str += '\\'; break;
-                    case '"': str += '"'; break;
-                    default: str += source[pos];
+                    case 'n': *str += '\n'; break;
+                    case 't': *str += '\t'; break;
+                    case '\\': *str += '\\'; break;
+                    case '"': *str += '"'; break;
+                    default: *str += source[pos];
                 }
                 pos++;
             } else if (source[pos] == '#' && pos + 1 < source.length() && source[pos + 1] == '{') {
-                str += "#{";
-                pos += 2;
+                // The embedded expression is kept verbatim for the parser,
+                // string literals inside it included. An unclosed "#{" is plain text.
+                size_t close = interpolationEnd(source, pos + 2);
+                size_t end = close == std::string::npos ? pos + 2 : close + 1;
+                if (str) str->append(source, pos, end - pos);
+                pos = end;
             } else {
-                str += source[pos++];
+                // A lone '#', or a '\\' ending the source
+                if (str) *str += source[pos];
+                pos++;
             }
         }
         
         if (pos >= source.length()) {
-            throw LexerError("Unterminated string literal", startLine);
+            throw LexerError("Unterminated string literal", lineAt(quote));
         }
         
+        add(TOKEN_STRING, quote, static_cast<uint32_t>(tokens.strings.size()));
+        tokens.strings.push_back(str ? std::string_view(*str) : source.substr(start, pos - start));
         pos++; // skip closing "
-        return {TOKEN_STRING, str, startLine};
     }
 };
 
-const std::unordered_map<std::string, TokenType> Lexer::keywords = {
+const std::unordered_map<std::string_view, TokenType> Lexer::keywords = {
     {"let", TOKEN_LET}, {"fn", TOKEN_FN}, {"if", TOKEN_IF}, {"else", TOKEN_ELSE},
     {"while", TOKEN_WHILE}, {"for", TOKEN_FOR}, {"in", TOKEN_IN}, {"return", TOKEN_RETURN},
     {"puts", TOKEN_PUTS}, {"true", TOKEN_TRUE}, {"false", TOKEN_FALSE}, {"struct", TOKEN_STRUCT},
@@ -287,1577 +415,4598 @@ const std::unordered_map<std::string, TokenType> Lexer::keywords = {
     {"await", TOKEN_AWAIT}
 };
 
-// Forward declarations
-class Interpreter;
+// AST
+struct Expr;
+struct Stmt;
+typedef std::unique_ptr<Expr> ExprPtr;
+typedef std::unique_ptr<Stmt> StmtPtr;
+typedef std::vector<StmtPtr> Block;
 
-// Value types
-struct Value {
-    enum Type { NUMBER, STRING, BOOL, ARRAY, STRUCT, LAMBDA, NIL } type;
-    double num;
-    std::string str;
-    bool boolean;
-    std::vector<Value> array;
-    std::unordered_map<std::string, Value> structFields;
-    std::string structType;
-    
-    std::vector<std::string> lambdaParams;
-    size_t lambdaBodyStart;
-    size_t lambdaBodyEnd;
-    std::unordered_map<std::string, Value> closureCaptures;
-
-    Value() : type(NIL), num(0), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(double n) : type(NUMBER), num(n), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(const std::string& s) : type(STRING), str(s), num(0), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(bool b) : type(BOOL), num(0), boolean(b), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(const std::vector<Value>& arr) : type(ARRAY), num(0), boolean(false), array(arr), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-
-    std::string toString() const {
-        switch (type) {
-            case NUMBER: {
-                if (num == static_cast<int>(num)) {
-                    return std::to_string(static_cast<int>(num));
-                }
-                std::string s = std::to_string(num);
-                s.erase(s.find_last_not_of('0') + 1, std::string::npos);
-                if (s.back() == '.') s.pop_back();
-                return s;
-            }
-            case STRING: return str;
-            case BOOL: return boolean ? "true" : "false";
-            case ARRAY: {
-                std::string result = "[";
-                for (size_t i = 0; i < array.size(); i++) {
-                    result += array[i].toString();
-                    if (i < array.size() - 1) result += ", ";
-                }
-                result += "]";
-                return result;
-            }
-            case STRUCT: {
-                std::string result = structType + " { ";
-                bool first = true;
-                for (const auto& field : structFields) {
-                    if (!first) result += ", ";
-                    result += field.first + ": " + field.second.toString();
-                    first = false;
-                }
-                result += " }";
-                return result;
-            }
-            case LAMBDA: return "<lambda>";
-            case NIL: return "nil";
-        }
-        return "";
-    }
-    
-    std::string getType() const {
-        switch (type) {
-            case NUMBER: return "number";
-            case STRING: return "string";
-            case BOOL: return "bool";
-            case ARRAY: return "array";
-            case STRUCT: return structType.empty() ? "struct" : structType;
-            case LAMBDA: return "lambda";
-            case NIL: return "nil";
-        }
-        return "unknown";
-    }
+struct Expr {
+    enum Kind {
+        NUMBER, STRING, BOOL, VARIABLE, ARRAY, STRUCT_LITERAL, LAMBDA,
+        UNARY, BINARY, LOGICAL, CALL, INDEX, FIELD, INTERPOLATION
+    } kind;
+    int line;
+
+    Expr(Kind k, int l) : kind(k), line(l) {}
+    virtual ~Expr() {}
 };
 
-struct Function {
-    std::vector<std::string> params;
-    size_t bodyStart;
-    size_t bodyEnd;
+struct NumberExpr : Expr {
+    double value;
+    NumberExpr(double v, int l) : Expr(NUMBER, l), value(v) {}
 };
 
-struct StructDef {
-    std::vector<std::string> fields;
+struct StringExpr : Expr {
+    std::string value;
+    StringExpr(const std::string& v, int l) : Expr(STRING, l), value(v) {}
 };
 
-struct ChocoException {
-    std::string message;
-    ChocoException(const std::string& msg) : message(msg) {}
+// "a #{x} b": literal StringExpr parts and the embedded expressions, in order
+struct InterpolationExpr : Expr {
+    std::vector<ExprPtr> parts;
+    InterpolationExpr(int l) : Expr(INTERPOLATION, l) {}
 };
 
-// Interpreter
-class Interpreter {
+struct BoolExpr : Expr {
+    bool value;
+    BoolExpr(bool v, int l) : Expr(BOOL, l), value(v) {}
+};
+
+struct VariableExpr : Expr {
+    Atom name;
+    VariableExpr(Atom n, int l) : Expr(VARIABLE, l), name(n) {}
+};
+
+struct ArrayExpr : Expr {
+    std::vector<ExprPtr> elements;
+    ArrayExpr(int l) : Expr(ARRAY, l) {}
+};
+
+struct StructLiteralExpr : Expr {
+    Atom structName;
+    std::vector<std::pair<Atom, ExprPtr>> fields;
+    StructLiteralExpr(Atom n, int l) : Expr(STRUCT_LITERAL, l), structName(n) {}
+};
+
+struct LambdaExpr : Expr {
+    std::vector<Atom> params;
+    Block body;
+    LambdaExpr(int l) : Expr(LAMBDA, l) {}
+};
+
+struct UnaryExpr : Expr {
+    TokenType op;
+    ExprPtr operand;
+    UnaryExpr(TokenType o, ExprPtr e, int l) : Expr(UNARY, l), op(o), operand(std::move(e)) {}
+};
+
+// Arithmetic and comparison operators (BINARY) and short-circuiting && / || (LOGICAL)
+struct BinaryExpr : Expr {
+    TokenType op;
+    ExprPtr left;
+    ExprPtr right;
+    BinaryExpr(Kind k, TokenType o, ExprPtr lhs, ExprPtr rhs, int l)
+        : Expr(k, l), op(o), left(std::move(lhs)), right(std::move(rhs)) {}
+};
+
+struct CallExpr : Expr {
+    ExprPtr callee;
+    std::vector<ExprPtr> args;
+    CallExpr(ExprPtr c, int l) : Expr(CALL, l), callee(std::move(c)) {}
+};
+
+struct IndexExpr : Expr {
+    ExprPtr object;
+    ExprPtr index;
+    IndexExpr(ExprPtr o, ExprPtr i, int l) : Expr(INDEX, l), object(std::move(o)), index(std::move(i)) {}
+};
+
+struct FieldExpr : Expr {
+    ExprPtr object;
+    Atom field;
+    FieldExpr(ExprPtr o, Atom f, int l) : Expr(FIELD, l), object(std::move(o)), field(f) {}
+};
+
+struct Stmt {
+    enum Kind {
+        LET, ASSIGN, EXPRESSION, PUTS, THROW, RETURN, BREAK, CONTINUE,
+        IF, WHILE, FOR, MATCH, TRY, FUNCTION, STRUCT, IMPORT
+    } kind;
+    int line;
+
+    Stmt(Kind k, int l) : kind(k), line(l) {}
+    virtual ~Stmt() {}
+};
+
+// let name = value; and name = value;
+struct AssignStmt : Stmt {
+    Atom name;
+    ExprPtr value;
+    AssignStmt(Kind k, Atom n, ExprPtr v, int l) : Stmt(k, l), name(n), value(std::move(v)) {}
+};
+
+// Statements carrying a single expression: EXPRESSION, PUTS, THROW, RETURN
+struct ExpressionStmt : Stmt {
+    ExprPtr expr;
+    ExpressionStmt(Kind k, ExprPtr e, int l) : Stmt(k, l), expr(std::move(e)) {}
+};
+
+struct IfStmt : Stmt {
+    ExprPtr condition;
+    Block thenBranch;
+    Block elseBranch;
+    bool hasElse = false;
+    IfStmt(ExprPtr c, int l) : Stmt(IF, l), condition(std::move(c)) {}
+};
+
+struct WhileStmt : Stmt {
+    ExprPtr condition;
+    Block body;
+    WhileStmt(ExprPtr c, int l) : Stmt(WHILE, l), condition(std::move(c)) {}
+};
+
+struct ForStmt : Stmt {
+    Atom var;
+    ExprPtr start;
+    ExprPtr end;
+    Block body;
+    ForStmt(Atom v, int l) : Stmt(FOR, l), var(v) {}
+};
+
+struct MatchCase {
+    ExprPtr value;
+    Block body;
+};
+
+struct MatchStmt : Stmt {
+    ExprPtr value;
+    std::vector<MatchCase> cases;
+    Block defaultBody;
+    bool hasDefault = false;
+    MatchStmt(ExprPtr v, int l) : Stmt(MATCH, l), value(std::move(v)) {}
+};
+
+struct TryStmt : Stmt {
+    Block tryBody;
+    Atom errorVar;
+    Block catchBody;
+    TryStmt(int l) : Stmt(TRY, l) {}
+};
+
+struct FunctionStmt : Stmt {
+    Atom name;
+    std::vector<Atom> params;
+    Block body;
+    FunctionStmt(Atom n, int l) : Stmt(FUNCTION, l), name(n) {}
+};
+
+struct StructStmt : Stmt {
+    Atom name;
+    std::vector<Atom> fields;
+    StructStmt(Atom n, int l) : Stmt(STRUCT, l), name(n) {}
+};
+
+// `import name;` binds the module as a namespace; `from name import a, b;`
+// binds the listed names instead
+struct ImportStmt : Stmt {
+    Atom module;
+    std::vector<Atom> names;
+    ImportStmt(Atom m, int l) : Stmt(IMPORT, l), module(m) {}
+};
+
+// Parser - builds the AST once so execution never touches the token stream
+class Parser {
+    const TokenStream& tokens;
+    size_t current = 0;
+    int functionDepth = 0;
+    int loopDepth = 0;
+    std::unordered_set<Atom> structNames;
+
 public:
-    std::unordered_map<std::string, Value> globalVars;
-    std::vector<std::unordered_map<std::string, Value>> scopes;
-    std::unordered_map<std::string, Function> functions;
-    std::unordered_map<std::string, StructDef> structDefs;
-    std::vector<Token> tokens;
-    size_t current;
-    bool inFunction;
-    bool inLoop;
-    bool hasReturned;
-    Value returnValue;
-    bool shouldBreak;
-    bool shouldContinue;
-    bool inTryCatch;
-    std::string currentException;
-    
-    static const std::unordered_map<std::string, bool> builtinFunctions;
+    explicit Parser(const TokenStream& toks) : tokens(toks) {}
 
-    Value callFunction(const std::string& name, const std::vector<Value>& args, int callLine) {
-        // Higher-order functions
-        if (name == "map") {
-            if (args.size() < 2) {
-                throw RuntimeError("map() expects 2 arguments (array, lambda), got " + std::to_string(args.size()), callLine);
-            }
-            if (args[0].type != Value::ARRAY) {
-                throw RuntimeError("map() first argument must be an array, got " + args[0].getType(), callLine);
-            }
-            if (args[1].type != Value::LAMBDA) {
-                throw RuntimeError("map() second argument must be a lambda, got " + args[1].getType(), callLine);
-            }
-            std::vector<Value> result;
-            result.reserve(args[0].array.size());
-            for (const auto& item : args[0].array) {
-                std::vector<Value> lambdaArgs = {item};
-                result.push_back(callLambda(args[1], lambdaArgs));
-            }
-            return Value(result);
-        }
-        
-        if (name == "filter") {
-            if (args.size() < 2) {
-                throw RuntimeError("filter() expects 2 arguments (array, lambda), got " + std::to_string(args.size()), callLine);
-            }
-            if (args[0].type != Value::ARRAY) {
-                throw RuntimeError("filter() first argument must be an array, got " + args[0].getType(), callLine);
-            }
-            if (args[1].type != Value::LAMBDA) {
-                throw RuntimeError("filter() second argument must be a lambda, got " + args[1].getType(), callLine);
-            }
-            std::vector<Value> result;
-            for (const auto& item : args[0].array) {
-                std::vector<Value> lambdaArgs = {item};
-                Value condition = callLambda(args[1], lambdaArgs);
-                if (condition.type == Value::BOOL && condition.boolean) {
-                    result.push_back(item);
-                }
-            }
-            return Value(result);
-        }
-        
-        if (name == "reduce") {
-            if (args.size() < 3) {
-                throw RuntimeError("reduce() expects 3 arguments (array, initial, lambda), got " + std::to_string(args.size()), callLine);
-            }
-            if (args[0].type != Value::ARRAY) {
-                throw RuntimeError("reduce() first argument must be an array, got " + args[0].getType(), callLine);
-            }
-            if (args[2].type != Value::LAMBDA) {
-                throw RuntimeError("reduce() third argument must be a lambda, got " + args[2].getType(), callLine);
-            }
-            Value accumulator = args[1];
-            for (const auto& item : args[0].array) {
-                std::vector<Value> lambdaArgs = {accumulator, item};
-                accumulator = callLambda(args[2], lambdaArgs);
-            }
-            return accumulator;
-        }
-        
-        if (name == "typeof") {
-            if (args.size() == 0) {
-                throw RuntimeError("typeof() expects 1 argument, got 0", callLine);
-            }
-            return Value(args[0].getType());
+    // Struct names declared by earlier programs (REPL lines, imports)
+    void declareStruct(Atom name) { structNames.insert(name); }
+
+    Block parse() {
+        Block program;
+        while (!isAtEnd()) {
+            program.push_back(statement());
         }
-        
-        // Standard library functions
-        if (name == "len") {
-            if (args.size() == 0) {
-                throw RuntimeError("len() expects 1 argument, got 0", callLine);
-            }
-            if (args[0].type == Value::ARRAY) {
-                return Value(static_cast<double>(args[0].array.size()));
-            } else if (args[0].type == Value::STRING) {
-                return Value(static_cast<double>(args[0].str.length()));
-            }
-            throw RuntimeError("len() requires array or string, got " + args[0].getType(), callLine);
+        return program;
+    }
+
+private:
+    inline bool isAtEnd() const { return peekType() == TOKEN_EOF; }
+
+    // Index of the token offset places ahead, or of the trailing EOF
+    inline size_t ahead(size_t offset = 0) const {
+        return std::min(current + offset, tokens.size() - 1);
+    }
+
+    inline TokenType peekType(size_t offset = 0) const { return tokens.type(ahead(offset)); }
+    inline int peekLine() const { return tokens.line(ahead()); }
+    inline int previousLine() const { return tokens.line(current - 1); }
+
+    // Index of the consumed token
+    inline size_t advance() {
+        if (current >= tokens.size()) {
+            throw ParseError("Unexpected end of file", tokens.line(tokens.size() - 1));
         }
-        
-        if (name == "push") {
-            if (args.size() < 2) {
-                throw RuntimeError("push() expects 2 arguments (array, value), got " + std::to_string(args.size()), callLine);
-            }
-            if (args[0].type != Value::ARRAY) {
-                throw RuntimeError("push() first argument must be an array, got " + args[0].getType(), callLine);
-            }
-            Value arr = args[0];
-            arr.array.push_back(args[1]);
-            return arr;
+        return current++;
+    }
+
+    inline bool check(TokenType type) const { return peekType() == type; }
+
+    inline bool match(TokenType type) {
+        if (check(type)) {
+            advance();
+            return true;
         }
-        
-        if (name == "pop") {
-            if (args.size() == 0) {
-                throw RuntimeError("pop() expects 1 argument (array), got 0", callLine);
-            }
-            if (args[0].type != Value::ARRAY) {
-                throw RuntimeError("pop() requires an array, got " + args[0].getType(), callLine);
-            }
-            Value arr = args[0];
-            if (arr.array.empty()) {
-                throw RuntimeError("Cannot pop from empty array", callLine);
-            }
-            Value last = arr.array.back();
-            arr.array.pop_back();
-            return last;
+        return false;
+    }
+
+    void expect(TokenType type, const std::string& message) {
+        if (!match(type)) {
+            throw ParseError(message, peekLine());
         }
-        
-        if (name == "sqrt") {
-            if (args.size() == 0) {
-                throw RuntimeError("sqrt() expects 1 argument, got 0", callLine);
-            }
-            if (args[0].type != Value::NUMBER) {
-                throw RuntimeError("sqrt() requires a number, got " + args[0].getType(), callLine);
-            }
-            if (args[0].num < 0) {
-                throw RuntimeError("sqrt() of negative number", callLine);
-            }
-            return Value(sqrt(args[0].num));
+    }
+
+    Atom expectIdentifier(const std::string& message) {
+        if (!check(TOKEN_IDENTIFIER)) {
+            throw ParseError(message, peekLine());
         }
-        
-        if (name == "pow") {
-            if (args.size() < 2) {
-                throw RuntimeError("pow() expects 2 arguments (base, exponent), got " + std::to_string(args.size()), callLine);
-            }
-            if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
-                throw RuntimeError("pow() requires two numbers", callLine);
-            }
-            return Value(pow(args[0].num, args[1].num));
+        return tokens.atom(advance());
+    }
+
+    // Parses the statements of a block whose '{' was just consumed. The closing
+    // '}' comes straight from the lexer's brace table.
+    Block block() {
+        size_t close = tokens.brace(current - 1);
+        Block body;
+        while (current < close) {
+            body.push_back(statement());
         }
-        
-        if (name == "abs") {
-            if (args.size() == 0) {
-                throw RuntimeError("abs() expects 1 argument, got 0", callLine);
-            }
-            if (args[0].type != Value::NUMBER) {
-                throw RuntimeError("abs() requires a number, got " + args[0].getType(), callLine);
-            }
-            return Value(fabs(args[0].num));
+        if (current != close) {
+            throw ParseError("Expected '}' to close block", peekLine());
         }
-        
-        if (name == "floor") {
-            if (args.size() == 0) {
-                throw RuntimeError("floor() expects 1 argument, got 0", callLine);
-            }
-            if (args[0].type != Value::NUMBER) {
-                throw RuntimeError("floor() requires a number, got " + args[0].getType(), callLine);
-            }
-            return Value(floor(args[0].num));
+        advance();
+        return body;
+    }
+
+    StmtPtr statement() {
+        int line = peekLine();
+
+        if (match(TOKEN_LET)) return letStatement();
+        if (match(TOKEN_FN)) return functionDeclaration();
+        if (match(TOKEN_STRUCT)) return structDeclaration();
+        if (match(TOKEN_IMPORT)) return importStatement();
+        if (match(TOKEN_FROM)) return fromImportStatement();
+        if (match(TOKEN_TRY)) return tryStatement();
+        if (match(TOKEN_THROW)) {
+            ExprPtr msg = expression();
+            expect(TOKEN_SEMICOLON, "Expected ';' after throw statement");
+            return StmtPtr(new ExpressionStmt(Stmt::THROW, std::move(msg), line));
         }
-        
-        if (name == "ceil") {
-            if (args.size() == 0) {
-                throw RuntimeError("ceil() expects 1 argument, got 0", callLine);
-            }
-            if (args[0].type != Value::NUMBER) {
-                throw RuntimeError("ceil() requires a number, got " + args[0].getType(), callLine);
+        if (match(TOKEN_BREAK)) {
+            if (loopDepth == 0) {
+                throw ParseError("'break' can only be used inside loops", line);
             }
-            return Value(ceil(args[0].num));
+            match(TOKEN_SEMICOLON);
+            return StmtPtr(new Stmt(Stmt::BREAK, line));
         }
-        
-        if (name == "round") {
-            if (args.size() == 0) {
-                throw RuntimeError("round() expects 1 argument, got 0", callLine);
+        if (match(TOKEN_CONTINUE)) {
+            if (loopDepth == 0) {
+                throw ParseError("'continue' can only be used inside loops", line);
             }
-            if (args[0].type != Value::NUMBER) {
-                throw RuntimeError("round() requires a number, got " + args[0].getType(), callLine);
-            }
-            return Value(round(args[0].num));
+            match(TOKEN_SEMICOLON);
+            return StmtPtr(new Stmt(Stmt::CONTINUE, line));
         }
-        
-        if (name == "min") {
-            if (args.size() < 2) {
-                throw RuntimeError("min() expects 2 arguments, got " + std::to_string(args.size()), callLine);
-            }
-            if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
-                throw RuntimeError("min() requires two numbers", callLine);
-            }
-            return Value(std::min(args[0].num, args[1].num));
+        if (match(TOKEN_PUTS)) {
+            ExprPtr val = expression();
+            expect(TOKEN_SEMICOLON, "Expected ';' after puts statement");
+            return StmtPtr(new ExpressionStmt(Stmt::PUTS, std::move(val), line));
         }
-        
-        if (name == "max") {
-            if (args.size() < 2) {
-                throw RuntimeError("max() expects 2 arguments, got " + std::to_string(args.size()), callLine);
+        if (match(TOKEN_IF)) return ifStatement();
+        if (match(TOKEN_WHILE)) return whileStatement();
+        if (match(TOKEN_FOR)) return forStatement();
+        if (match(TOKEN_MATCH)) return matchStatement();
+        if (match(TOKEN_RETURN)) {
+            if (functionDepth == 0) {
+                throw ParseError("'return' can only be used inside functions", line);
             }
-            if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
-                throw RuntimeError("max() requires two numbers", callLine);
-            }
-            return Value(std::max(args[0].num, args[1].num));
-        }
-        
-        if (name == "random") {
-            return Value(static_cast<double>(rand()) / RAND_MAX);
+            ExprPtr val = expression();
+            expect(TOKEN_SEMICOLON, "Expected ';' after return statement");
+            return StmtPtr(new ExpressionStmt(Stmt::RETURN, std::move(val), line));
         }
-        
-        if (name == "random_int") {
-            if (args.size() < 2) {
-                throw RuntimeError("random_int() expects 2 arguments (min, max), got " + std::to_string(args.size()), callLine);
-            }
-            if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
-                throw RuntimeError("random_int() requires two numbers", callLine);
-            }
-            int min = static_cast<int>(args[0].num);
-            int max = static_cast<int>(args[1].num);
-            if (min > max) {
-                throw RuntimeError("random_int(): min cannot be greater than max", callLine);
-            }
-            return Value(static_cast<double>(min + rand() % (max - min + 1)));
+        if (check(TOKEN_IDENTIFIER) && peekType(1) == TOKEN_EQUAL) {
+            Atom name = tokens.atom(advance());
+            advance();
+            ExprPtr val = expression();
+            expect(TOKEN_SEMICOLON, "Expected ';' after assignment");
+            return StmtPtr(new AssignStmt(Stmt::ASSIGN, name, std::move(val), line));
         }
-        
-        if (name == "str") {
-            if (args.size() == 0) {
-                return Value("");
+
+        ExprPtr expr = expression();
+        expect(TOKEN_SEMICOLON, "Expected ';' after expression");
+        return StmtPtr(new ExpressionStmt(Stmt::EXPRESSION, std::move(expr), line));
+    }
+
+    StmtPtr letStatement() {
+        int line = peekLine();
+        Atom name = expectIdentifier("Expected variable name after 'let'");
+        expect(TOKEN_EQUAL, "Expected '=' after variable name");
+        ExprPtr val = expression();
+        expect(TOKEN_SEMICOLON, "Expected ';' after variable declaration");
+        return StmtPtr(new AssignStmt(Stmt::LET, name, std::move(val), line));
+    }
+
+    StmtPtr functionDeclaration() {
+        int line = peekLine();
+        Atom name = expectIdentifier("Expected function name after 'fn'");
+        std::unique_ptr<FunctionStmt> func(new FunctionStmt(name, line));
+        expect(TOKEN_LPAREN, "Expected '(' after function name");
+
+        while (!match(TOKEN_RPAREN)) {
+            func->params.push_back(expectIdentifier("Expected parameter name"));
+            if (!match(TOKEN_COMMA)) {
+                expect(TOKEN_RPAREN, "Expected ')' or ',' in parameter list");
+                break;
             }
-            return Value(args[0].toString());
         }
-        
-        if (name == "int") {
-            if (args.size() == 0) {
-                throw RuntimeError("int() expects 1 argument, got 0", callLine);
-            }
-            if (args[0].type == Value::NUMBER) {
-                return Value(static_cast<double>(static_cast<int>(args[0].num)));
-            } else if (args[0].type == Value::STRING) {
-                try {
-                    return Value(static_cast<double>(std::stoi(args[0].str)));
-                } catch (...) {
-                    throw RuntimeError("int(): cannot convert '" + args[0].str + "' to integer", callLine);
-                }
+
+        expect(TOKEN_LBRACE, "Expected '{' before function body");
+        int savedLoopDepth = loopDepth;
+        loopDepth = 0;
+        functionDepth++;
+        func->body = block();
+        functionDepth--;
+        loopDepth = savedLoopDepth;
+        return StmtPtr(func.release());
+    }
+
+    StmtPtr structDeclaration() {
+        int line = peekLine();
+        Atom name = expectIdentifier("Expected struct name after 'struct'");
+        std::unique_ptr<StructStmt> def(new StructStmt(name, line));
+        expect(TOKEN_LBRACE, "Expected '{' after struct name");
+
+        while (!match(TOKEN_RBRACE)) {
+            def->fields.push_back(expectIdentifier("Expected field name in struct"));
+            if (!match(TOKEN_COMMA)) {
+                expect(TOKEN_RBRACE, "Expected '}' or ',' in struct definition");
+                break;
             }
-            throw RuntimeError("int() requires number or string, got " + args[0].getType(), callLine);
         }
-        
-        if (name == "float") {
-            if (args.size() == 0) {
-                throw RuntimeError("float() expects 1 argument, got 0", callLine);
-            }
-            if (args[0].type == Value::STRING) {
-                try {
-                    return Value(std::stod(args[0].str));
-                } catch (...) {
-                    throw RuntimeError("float(): cannot convert '" + args[0].str + "' to float", callLine);
-                }
-            } else if (args[0].type == Value::NUMBER) {
-                return args[0];
-            }
-            throw RuntimeError("float() requires number or string, got " + args[0].getType(), callLine);
+
+        structNames.insert(def->name);
+        return StmtPtr(def.release());
+    }
+
+    StmtPtr importStatement() {
+        int line = peekLine();
+        Atom module = expectIdentifier("Expected module name after 'import'");
+        expect(TOKEN_SEMICOLON, "Expected ';' after import statement");
+        return StmtPtr(new ImportStmt(module, line));
+    }
+
+    StmtPtr fromImportStatement() {
+        int line = peekLine();
+        Atom module = expectIdentifier("Expected module name after 'from'");
+        std::unique_ptr<ImportStmt> stmt(new ImportStmt(module, line));
+        expect(TOKEN_IMPORT, "Expected 'import' after module name");
+        do {
+            stmt->names.push_back(expectIdentifier("Expected name to import"));
+        } while (match(TOKEN_COMMA));
+        expect(TOKEN_SEMICOLON, "Expected ';' after import statement");
+        return StmtPtr(stmt.release());
+    }
+
+    StmtPtr tryStatement() {
+        int line = previousLine();
+        std::unique_ptr<TryStmt> stmt(new TryStmt(line));
+        expect(TOKEN_LBRACE, "Expected '{' after 'try'");
+        stmt->tryBody = block();
+
+        expect(TOKEN_CATCH, "Expected 'catch' after try block");
+        stmt->errorVar = expectIdentifier("Expected error variable name after 'catch'");
+        expect(TOKEN_LBRACE, "Expected '{' after catch variable");
+        stmt->catchBody = block();
+        return StmtPtr(stmt.release());
+    }
+
+    StmtPtr ifStatement() {
+        int line = previousLine();
+        std::unique_ptr<IfStmt> stmt(new IfStmt(expression(), line));
+        expect(TOKEN_LBRACE, "Expected '{' after if condition");
+        stmt->thenBranch = block();
+
+        if (match(TOKEN_ELSE)) {
+            stmt->hasElse = true;
+            expect(TOKEN_LBRACE, "Expected '{' after 'else'");
+            stmt->elseBranch = block();
+        }
+        return StmtPtr(stmt.release());
+    }
+
+    StmtPtr whileStatement() {
+        int line = previousLine();
+        std::unique_ptr<WhileStmt> stmt(new WhileStmt(expression(), line));
+        expect(TOKEN_LBRACE, "Expected '{' after while condition");
+        loopDepth++;
+        stmt->body = block();
+        loopDepth--;
+        return StmtPtr(stmt.release());
+    }
+
+    StmtPtr forStatement() {
+        int line = peekLine();
+        Atom iterVar = expectIdentifier("Expected iterator variable name after 'for'");
+        std::unique_ptr<ForStmt> stmt(new ForStmt(iterVar, line));
+        expect(TOKEN_IN, "Expected 'in' after iterator variable");
+
+        stmt->start = expression();
+        expect(TOKEN_DOTDOT, "Expected '..' in for loop range");
+        stmt->end = expression();
+
+        expect(TOKEN_LBRACE, "Expected '{' after for range");
+        loopDepth++;
+        stmt->body = block();
+        loopDepth--;
+        return StmtPtr(stmt.release());
+    }
+
+    StmtPtr matchStatement() {
+        int line = previousLine();
+        std::unique_ptr<MatchStmt> stmt(new MatchStmt(expression(), line));
+        expect(TOKEN_LBRACE, "Expected '{' after match value");
+        size_t close = tokens.brace(current - 1);
+
+        while (current < close) {
+            if (match(TOKEN_CASE)) {
+                MatchCase c;
+                c.value = expression();
+                expect(TOKEN_ARROW_FAT, "Expected '=>' after case value");
+                expect(TOKEN_LBRACE, "Expected '{' after '=>'");
+                c.body = block();
+                stmt->cases.push_back(std::move(c));
+            } else if (match(TOKEN_DEFAULT)) {
+                if (stmt->hasDefault) {
+                    throw ParseError("Match statement can only have one 'default' case", previousLine());
+                }
+                expect(TOKEN_ARROW_FAT, "Expected '=>' after 'default'");
+                expect(TOKEN_LBRACE, "Expected '{' after '=>'");
+                stmt->hasDefault = true;
+                stmt->defaultBody = block();
+            } else if (!match(TOKEN_COMMA) && !match(TOKEN_SEMICOLON)) {
+                throw ParseError("Expected 'case' or 'default' in match statement", peekLine());
+            }
+        }
+
+        expect(TOKEN_RBRACE, "Expected '}' at end of match statement");
+        return StmtPtr(stmt.release());
+    }
+
+    ExprPtr expression() {
+        return logicalOr();
+    }
+
+    ExprPtr logicalOr() {
+        ExprPtr left = logicalAnd();
+        while (match(TOKEN_OR)) {
+            int line = previousLine();
+            ExprPtr right = logicalAnd();
+            left.reset(new BinaryExpr(Expr::LOGICAL, TOKEN_OR, std::move(left), std::move(right), line));
+        }
+        return left;
+    }
+
+    ExprPtr logicalAnd() {
+        ExprPtr left = comparison();
+        while (match(TOKEN_AND)) {
+            int line = previousLine();
+            ExprPtr right = comparison();
+            left.reset(new BinaryExpr(Expr::LOGICAL, TOKEN_AND, std::move(left), std::move(right), line));
+        }
+        return left;
+    }
+
+    ExprPtr comparison() {
+        ExprPtr left = term();
+        while (check(TOKEN_EQUAL_EQUAL) || check(TOKEN_BANG_EQUAL) ||
+               check(TOKEN_LESS) || check(TOKEN_GREATER) ||
+               check(TOKEN_LESS_EQUAL) || check(TOKEN_GREATER_EQUAL)) {
+            size_t op = advance();
+            ExprPtr right = term();
+            left.reset(new BinaryExpr(Expr::BINARY, tokens.type(op), std::move(left), std::move(right), tokens.line(op)));
+        }
+        return left;
+    }
+
+    ExprPtr term() {
+        ExprPtr left = factor();
+        while (check(TOKEN_PLUS) || check(TOKEN_MINUS)) {
+            size_t op = advance();
+            ExprPtr right = factor();
+            left.reset(new BinaryExpr(Expr::BINARY, tokens.type(op), std::move(left), std::move(right), tokens.line(op)));
+        }
+        return left;
+    }
+
+    ExprPtr factor() {
+        ExprPtr left = unary();
+        while (check(TOKEN_STAR) || check(TOKEN_SLASH) || check(TOKEN_PERCENT)) {
+            size_t op = advance();
+            ExprPtr right = unary();
+            left.reset(new BinaryExpr(Expr::BINARY, tokens.type(op), std::move(left), std::move(right), tokens.line(op)));
+        }
+        return left;
+    }
+
+    ExprPtr unary() {
+        if (check(TOKEN_BANG) || check(TOKEN_MINUS)) {
+            size_t op = advance();
+            ExprPtr operand = unary();
+            return ExprPtr(new UnaryExpr(tokens.type(op), std::move(operand), tokens.line(op)));
+        }
+        return call();
+    }
+
+    ExprPtr call() {
+        ExprPtr expr = primary();
+
+        while (true) {
+            if (match(TOKEN_LPAREN)) {
+                std::unique_ptr<CallExpr> callExpr(new CallExpr(std::move(expr), previousLine()));
+                while (!match(TOKEN_RPAREN)) {
+                    callExpr->args.push_back(expression());
+                    if (!match(TOKEN_COMMA)) {
+                        expect(TOKEN_RPAREN, "Expected ')' or ',' in function call");
+                        break;
+                    }
+                }
+                expr.reset(callExpr.release());
+            } else if (match(TOKEN_LBRACKET)) {
+                int line = previousLine();
+                ExprPtr index = expression();
+                expect(TOKEN_RBRACKET, "Expected ']' after array index");
+                expr.reset(new IndexExpr(std::move(expr), std::move(index), line));
+            } else if (match(TOKEN_DOT)) {
+                int line = previousLine();
+                if (!check(TOKEN_IDENTIFIER)) {
+                    throw ParseError("Expected field name after '.'", line);
+                }
+                expr.reset(new FieldExpr(std::move(expr), tokens.atom(advance()), line));
+            } else {
+                break;
+            }
+        }
+
+        return expr;
+    }
+
+    // `Name {` starts a struct literal when Name is a declared struct, or when the
+    // brace is followed by `field:` (which can never begin a statement block)
+    bool isStructLiteral(Atom name) const {
+        if (!check(TOKEN_LBRACE)) return false;
+        if (structNames.count(name)) return true;
+        return peekType(1) == TOKEN_IDENTIFIER && peekType(2) == TOKEN_COLON;
+    }
+
+    // Splits "a #{x + 1} b" into "a ", x + 1 and " b". Each embedded expression
+    // is lexed and parsed on its own, once, when the literal is parsed.
+    ExprPtr interpolation(std::string_view str, int line) {
+        std::unique_ptr<InterpolationExpr> result(new InterpolationExpr(line));
+        size_t pos = 0;
+        while (pos < str.size()) {
+            size_t open = str.find("#{", pos);
+            size_t close = open == std::string::npos ? open : Lexer::interpolationEnd(str, open + 2);
+            if (close == std::string::npos) {
+                result->parts.push_back(ExprPtr(new StringExpr(std::string(str.substr(pos)), line)));
+                break;
+            }
+            if (open > pos) {
+                result->parts.push_back(ExprPtr(new StringExpr(std::string(str.substr(pos, open - pos)), line)));
+            }
+            result->parts.push_back(embeddedExpression(str.substr(open + 2, close - open - 2), line));
+            pos = close + 1;
+        }
+        return ExprPtr(result.release());
+    }
+
+    ExprPtr embeddedExpression(std::string_view source, int line) {
+        Lexer lexer(source, line);
+        TokenStream embeddedTokens = lexer.tokenize();
+        Parser parser(embeddedTokens);
+        parser.structNames = structNames;
+        ExprPtr expr = parser.expression();
+        if (!parser.isAtEnd()) {
+            throw ParseError("Unexpected '" + parser.tokens.text(parser.ahead()) + "' in string interpolation", line);
+        }
+        return expr;
+    }
+
+    ExprPtr primary() {
+        int line = peekLine();
+
+        if (match(TOKEN_NUMBER)) {
+            return ExprPtr(new NumberExpr(tokens.number(current - 1), line));
+        }
+        if (match(TOKEN_STRING)) {
+            std::string_view str = tokens.string(current - 1);
+            if (str.find("#{") != std::string::npos) {
+                return interpolation(str, line);
+            }
+            return ExprPtr(new StringExpr(std::string(str), line));
+        }
+        if (match(TOKEN_TRUE)) return ExprPtr(new BoolExpr(true, line));
+        if (match(TOKEN_FALSE)) return ExprPtr(new BoolExpr(false, line));
+
+        // Lambda expression
+        if (match(TOKEN_PIPE)) {
+            std::unique_ptr<LambdaExpr> lambda(new LambdaExpr(line));
+
+            if (!match(TOKEN_PIPE)) {
+                while (!check(TOKEN_PIPE) && !isAtEnd()) {
+                    lambda->params.push_back(expectIdentifier("Expected parameter name in lambda"));
+                    if (!match(TOKEN_COMMA)) break;
+                }
+                expect(TOKEN_PIPE, "Expected '|' after lambda parameters");
+            }
+
+            expect(TOKEN_ARROW_FAT, "Expected '=>' after lambda parameters");
+            expect(TOKEN_LBRACE, "Expected '{' after '=>'");
+            int savedLoopDepth = loopDepth;
+            loopDepth = 0;
+            functionDepth++;
+            lambda->body = block();
+            functionDepth--;
+            loopDepth = savedLoopDepth;
+            return ExprPtr(lambda.release());
+        }
+
+        if (match(TOKEN_LBRACKET)) {
+            std::unique_ptr<ArrayExpr> arr(new ArrayExpr(line));
+            while (!match(TOKEN_RBRACKET)) {
+                arr->elements.push_back(expression());
+                if (!match(TOKEN_COMMA)) {
+                    expect(TOKEN_RBRACKET, "Expected ']' or ',' in array literal");
+                    break;
+                }
+            }
+            return ExprPtr(arr.release());
+        }
+
+        if (match(TOKEN_IDENTIFIER)) {
+            Atom name = tokens.atom(current - 1);
+
+            if (isStructLiteral(name)) {
+                std::unique_ptr<StructLiteralExpr> literal(new StructLiteralExpr(name, line));
+                advance();
+                while (!match(TOKEN_RBRACE)) {
+                    Atom fieldName = expectIdentifier("Expected field name in struct literal");
+                    expect(TOKEN_COLON, "Expected ':' after field name");
+                    literal->fields.push_back({fieldName, expression()});
+                    if (!match(TOKEN_COMMA)) {
+                        expect(TOKEN_RBRACE, "Expected '}' or ',' in struct literal");
+                        break;
+                    }
+                }
+                return ExprPtr(literal.release());
+            }
+
+            return ExprPtr(new VariableExpr(name, line));
+        }
+
+        if (match(TOKEN_LPAREN)) {
+            ExprPtr expr = expression();
+            expect(TOKEN_RPAREN, "Expected ')' after expression");
+            return expr;
+        }
+
+        throw ParseError("Unexpected token: '" + tokens.text(ahead()) + "'", peekLine());
+    }
+};
+
+// Forward declarations
+class Interpreter;
+struct FunctionProto;
+
+struct Function {
+    std::vector<Atom> params;
+    const FunctionProto* proto;
+};
+
+struct StructDef {
+    std::vector<Atom> fields;
+    const Shape* shape;
+};
+
+// A thrown value on its way to a handler in an outer run of the dispatch loop
+struct ChocoException {
+    Value value;
+    explicit ChocoException(const Value& v) : value(v) {}
+};
+
+// Bytecode
+//
+// Every instruction is a one byte opcode followed by its operands. Operands are
+// 16-bit big-endian unless noted otherwise:
+//   CONSTANT k            push chunk.constants[k]
+//   GET_LOCAL s / SET_LOCAL s    read / assign slot s of the current frame
+//   GET_GLOBAL g / SET_GLOBAL g  read / assign global slot g
+//   GET_UPVALUE u         read captured variable u of the running lambda
+//   APPEND_VAR g? s       x = push(x, top) for a local (g = 0) or global (g = 1) slot
+//   CONCAT_VAR g? s       x = x + top, appending in place when x is an unshared string
+//   ARRAY n               collect the top n values into an array
+//   STRUCT k              build chunk.structLiterals[k] from the values of its fields
+//   LAMBDA k              close over chunk.functions[k], copying the variables it captures
+//   INTERPOLATE n         concatenate the top n values as strings
+//   GET_FIELD k c         read field chunk.constants[k] through chunk.fieldCaches[c]
+//   CALL n (8-bit)        call the value below the top n arguments
+//   TAIL_CALL n (8-bit)   like CALL, but a function or lambda callee replaces the current frame
+//   CALL_NATIVE i n (8-bit n)  call NativeRegistry entry i with the top n arguments
+//   JUMP* / LOOP off      jump forward / backward by off bytes
+//   FOR_ITER off          advance the [counter, end] pair on the stack and push the
+//                         counter, or jump forward by off once the range is exhausted
+//   DEFINE_FUNCTION k g   register chunk.functions[k] and bind its name to global slot g
+//   IMPORT k d            load module chunk.constants[k] once, searching directory constant d first
+//   TRY_BEGIN off         install a handler whose catch block starts off bytes ahead
+#define CHOCO_OPCODES(X) \
+    X(CONSTANT) X(NIL) X(TRUE) X(FALSE) X(POP) X(DUP) \
+    X(GET_LOCAL) X(SET_LOCAL) X(GET_GLOBAL) X(SET_GLOBAL) X(GET_UPVALUE) X(APPEND_VAR) X(CONCAT_VAR) \
+    X(ADD) X(SUBTRACT) X(MULTIPLY) X(DIVIDE) X(MODULO) X(NEGATE) X(NOT) \
+    X(EQUAL) X(NOT_EQUAL) X(LESS) X(GREATER) X(LESS_EQUAL) X(GREATER_EQUAL) \
+    X(MATCH_EQUAL) X(TO_BOOL) \
+    X(JUMP) X(JUMP_IF_FALSE) X(JUMP_UNLESS_TRUE) X(JUMP_IF_FALSE_KEEP) X(JUMP_IF_TRUE_KEEP) X(LOOP) \
+    X(FOR_PREP) X(FOR_ITER) \
+    X(ARRAY) X(STRUCT) X(LAMBDA) X(INTERPOLATE) X(INDEX) X(GET_FIELD) \
+    X(CALL) X(TAIL_CALL) X(CALL_NATIVE) X(RETURN) X(PUTS) \
+    X(DEFINE_FUNCTION) X(DEFINE_STRUCT) X(IMPORT) \
+    X(TRY_BEGIN) X(TRY_END) X(THROW)
+
+enum OpCode : uint8_t {
+#define CHOCO_OPCODE_ENUM(name) OP_##name,
+    CHOCO_OPCODES(CHOCO_OPCODE_ENUM)
+#undef CHOCO_OPCODE_ENUM
+};
+
+// Size in bytes of the operands that follow op
+static size_t operandBytes(OpCode op) {
+    switch (op) {
+        case OP_CONSTANT: case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_GET_GLOBAL: case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE: case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_JUMP_UNLESS_TRUE:
+        case OP_JUMP_IF_FALSE_KEEP: case OP_JUMP_IF_TRUE_KEEP: case OP_LOOP: case OP_FOR_ITER:
+        case OP_ARRAY: case OP_STRUCT: case OP_LAMBDA: case OP_INTERPOLATE: case OP_DEFINE_STRUCT:
+        case OP_TRY_BEGIN:
+            return 2;
+        case OP_CALL: case OP_TAIL_CALL:
+            return 1;
+        case OP_APPEND_VAR: case OP_CONCAT_VAR: case OP_CALL_NATIVE:
+            return 3;
+        case OP_GET_FIELD: case OP_DEFINE_FUNCTION: case OP_IMPORT:
+            return 4;
+        case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_POP: case OP_DUP:
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE: case OP_MODULO: case OP_NEGATE: case OP_NOT:
+        case OP_EQUAL: case OP_NOT_EQUAL: case OP_LESS: case OP_GREATER: case OP_LESS_EQUAL: case OP_GREATER_EQUAL:
+        case OP_MATCH_EQUAL: case OP_TO_BOOL: case OP_FOR_PREP: case OP_INDEX: case OP_RETURN: case OP_PUTS:
+        case OP_TRY_END: case OP_THROW:
+            return 0;
+    }
+    return 0;
+}
+
+struct StructLiteralInfo {
+    Atom name;
+    std::vector<Atom> fields;
+    // Layout of a literal, worked out the first time it runs: the definition
+    // shape it was computed for, the instance shape and the slot of each field
+    mutable const Shape* defShape = nullptr;
+    mutable const Shape* shape = nullptr;
+    mutable std::vector<uint16_t> slots = {};
+};
+
+// Inline cache of one GET_FIELD: the slot the field had in the last shape seen
+struct FieldCache {
+    const Shape* shape;
+    uint16_t slot;
+};
+
+struct Chunk {
+    std::vector<uint8_t> code;
+    std::vector<int> lines;
+    std::vector<Value> constants;
+    std::vector<std::unique_ptr<FunctionProto>> functions;
+    std::vector<StructLiteralInfo> structLiterals;
+    std::vector<StructLiteralInfo> structDefs;
+    mutable std::vector<FieldCache> fieldCaches;
+};
+
+// A variable a lambda uses from an enclosing function. Its value is copied
+// into the lambda when the lambda is created, from slot `index` of the creating
+// frame or from upvalue `index` of the creating lambda, and read from there.
+struct Capture {
+    Atom name;
+    uint16_t index;
+    bool fromUpvalue;
+};
+
+// Parameters occupy the first slots of a frame, followed by the other locals
+struct FunctionProto {
+    Atom name;
+    std::vector<Atom> params;
+    std::vector<Atom> slotNames;
+    std::vector<Capture> captures;
+    Chunk chunk;
+};
+
+// Global variables live in one slot table shared by every compiled script, so
+// later REPL lines and imported modules see the globals defined before them
+struct GlobalTable {
+    std::vector<Atom> names;
+    std::unordered_map<Atom, uint16_t> slots;
+
+    bool has(Atom name) const {
+        return slots.find(name) != slots.end();
+    }
+
+    uint16_t slot(Atom name, int line) {
+        auto it = slots.find(name);
+        if (it != slots.end()) return it->second;
+        if (names.size() > UINT16_MAX) {
+            throw ParseError("Too many global variables", line);
+        }
+        uint16_t index = static_cast<uint16_t>(names.size());
+        names.push_back(name);
+        slots[name] = index;
+        return index;
+    }
+};
+
+// The global names one script sees. A module's own top-level names are
+// qualified with the module name ("utils.helper") so they never clobber the
+// globals of the scripts importing it; `import utils;` makes them reachable as
+// utils.helper and `from utils import helper;` copies utils.helper into a
+// global helper of the importer once the module has run.
+struct ModuleScope {
+    Atom module = NO_ATOM;              // NO_ATOM for the main script and the REPL
+    std::string directory;              // searched first for its imports
+    std::unordered_map<Atom, Atom> names;      // a module's own top-level names -> qualified globals
+    std::unordered_set<Atom> namespaces;
+    // What the last compile found out about globals: the ones it declared and,
+    // for names assigned in function bodies, whether a global already existed.
+    // A cached copy of the script is only valid where the answers still hold.
+    std::vector<Atom> declared;
+    std::vector<std::pair<Atom, bool>> globalChecks;
+
+    Atom global(Atom name) const {
+        auto it = names.find(name);
+        return it == names.end() ? name : it->second;
+    }
+
+    static Atom qualify(Atom module, Atom name) {
+        return AtomTable::intern(AtomTable::name(module) + "." + AtomTable::name(name));
+    }
+};
+
+// Compiler - lowers the AST into bytecode, one FunctionProto per function body
+class Compiler {
+    FunctionProto* proto;
+    Compiler* enclosing;
+    GlobalTable& globals;
+    ModuleScope& scope;
+    bool isLambda;
+    std::unordered_map<std::string, uint16_t> stringConstants;
+    std::unordered_map<Atom, uint16_t> nameConstants;
+    std::unordered_map<double, uint16_t> numberConstants;
+
+    struct Loop {
+        size_t start;
+        size_t unwindDepth;
+        std::vector<size_t> breakJumps;
+    };
+    std::vector<Loop> loops;
+    // Cleanup instructions (TRY_END) owed by break and continue
+    std::vector<OpCode> unwind;
+
+    // Names visible as slots of the frame being compiled, innermost last
+    struct Local {
+        Atom name;
+        uint16_t slot;
+    };
+    std::vector<Local> locals;
+
+    struct VarRef {
+        enum Kind { LOCAL, UPVALUE, GLOBAL } kind;
+        uint16_t index;
+    };
+
+    Compiler(FunctionProto* target, Compiler* parent, GlobalTable& table, ModuleScope& names, bool lambda)
+        : proto(target), enclosing(parent), globals(table), scope(names), isLambda(lambda) {}
+
+public:
+    // Top-level assignments define globals; everything a function assigns that
+    // is not already a global becomes one of its locals
+    static std::unique_ptr<FunctionProto> compileScript(const Block& program, const std::string& name,
+                                                        GlobalTable& globals, ModuleScope& scope) {
+        std::unique_ptr<FunctionProto> script(new FunctionProto());
+        script->name = AtomTable::intern(name);
+        Compiler compiler(script.get(), nullptr, globals, scope, false);
+        std::vector<std::pair<Atom, int>> assigned;
+        collectAssigned(program, assigned);
+        for (const StmtPtr& stmt : program) {
+            if (stmt->kind == Stmt::IMPORT) {
+                const ImportStmt* import = static_cast<const ImportStmt*>(stmt.get());
+                if (import->names.empty()) scope.namespaces.insert(import->module);
+                for (Atom imported : import->names) {
+                    assigned.push_back({imported, stmt->line});
+                }
+            } else if (stmt->kind == Stmt::FUNCTION) {
+                assigned.push_back({static_cast<const FunctionStmt*>(stmt.get())->name, stmt->line});
+            }
+        }
+        scope.declared.clear();
+        scope.globalChecks.clear();
+        for (const auto& var : assigned) {
+            if (scope.module != NO_ATOM) {
+                scope.names[var.first] = ModuleScope::qualify(scope.module, var.first);
+            }
+            globals.slot(scope.global(var.first), var.second);
+            scope.declared.push_back(scope.global(var.first));
+        }
+        compiler.block(program);
+        compiler.emitReturnNil(program.empty() ? 1 : program.back()->line);
+        return script;
+    }
+
+    static OpCode binaryOp(TokenType op) {
+        switch (op) {
+            case TOKEN_PLUS: return OP_ADD;
+            case TOKEN_MINUS: return OP_SUBTRACT;
+            case TOKEN_STAR: return OP_MULTIPLY;
+            case TOKEN_SLASH: return OP_DIVIDE;
+            case TOKEN_PERCENT: return OP_MODULO;
+            case TOKEN_EQUAL_EQUAL: return OP_EQUAL;
+            case TOKEN_BANG_EQUAL: return OP_NOT_EQUAL;
+            case TOKEN_LESS: return OP_LESS;
+            case TOKEN_GREATER: return OP_GREATER;
+            case TOKEN_LESS_EQUAL: return OP_LESS_EQUAL;
+            default: return OP_GREATER_EQUAL;
+        }
+    }
+
+private:
+    Chunk& chunk() { return proto->chunk; }
+
+    void emit(uint8_t byte, int line) {
+        chunk().code.push_back(byte);
+        chunk().lines.push_back(line);
+    }
+
+    void emitShort(uint16_t value, int line) {
+        emit(static_cast<uint8_t>(value >> 8), line);
+        emit(static_cast<uint8_t>(value & 0xff), line);
+    }
+
+    void emitOp(OpCode op, uint16_t operand, int line) {
+        emit(op, line);
+        emitShort(operand, line);
+    }
+
+    void emitReturnNil(int line) {
+        emit(OP_NIL, line);
+        emit(OP_RETURN, line);
+    }
+
+    static uint16_t checkIndex(size_t index, const char* what, int line) {
+        if (index > UINT16_MAX) {
+            throw ParseError(std::string("Too many ") + what + " in one function", line);
+        }
+        return static_cast<uint16_t>(index);
+    }
+
+    uint16_t stringConstant(const std::string& str, int line) {
+        auto it = stringConstants.find(str);
+        if (it != stringConstants.end()) return it->second;
+        uint16_t index = checkIndex(chunk().constants.size(), "constants", line);
+        chunk().constants.push_back(Value(str));
+        stringConstants[str] = index;
+        return index;
+    }
+
+    // Names are stored as strings that keep their atom, see Value::fromAtom
+    uint16_t nameConstant(Atom name, int line) {
+        auto it = nameConstants.find(name);
+        if (it != nameConstants.end()) return it->second;
+        uint16_t index = checkIndex(chunk().constants.size(), "constants", line);
+        chunk().constants.push_back(Value::fromAtom(name));
+        nameConstants[name] = index;
+        return index;
+    }
+
+    uint16_t numberConstant(double num, int line) {
+        auto it = numberConstants.find(num);
+        if (it != numberConstants.end()) return it->second;
+        uint16_t index = checkIndex(chunk().constants.size(), "constants", line);
+        chunk().constants.push_back(Value(num));
+        numberConstants[num] = index;
+        return index;
+    }
+
+    size_t emitJump(OpCode op, int line) {
+        emit(op, line);
+        emitShort(0xffff, line);
+        return chunk().code.size() - 2;
+    }
+
+    void patchJump(size_t offset, int line) {
+        size_t jump = chunk().code.size() - offset - 2;
+        checkIndex(jump, "instructions to jump over", line);
+        chunk().code[offset] = static_cast<uint8_t>(jump >> 8);
+        chunk().code[offset + 1] = static_cast<uint8_t>(jump & 0xff);
+    }
+
+    void emitLoop(size_t start, int line) {
+        emit(OP_LOOP, line);
+        emitShort(checkIndex(chunk().code.size() - start + 2, "instructions in loop body", line), line);
+    }
+
+    void emitUnwind(size_t depth, int line) {
+        for (size_t i = unwind.size(); i > depth; i--) {
+            emit(unwind[i - 1], line);
+        }
+    }
+
+    static bool isVariable(const Expr* expr, Atom name) {
+        return expr->kind == Expr::VARIABLE && static_cast<const VariableExpr*>(expr)->name == name;
+    }
+
+    // Only expressions without calls may be reordered after the variable read
+    static bool hasCalls(const Expr* expr) {
+        switch (expr->kind) {
+            case Expr::CALL:
+                return true;
+            case Expr::ARRAY:
+                for (const ExprPtr& element : static_cast<const ArrayExpr*>(expr)->elements) {
+                    if (hasCalls(element.get())) return true;
+                }
+                return false;
+            case Expr::STRUCT_LITERAL:
+                for (const auto& field : static_cast<const StructLiteralExpr*>(expr)->fields) {
+                    if (hasCalls(field.second.get())) return true;
+                }
+                return false;
+            case Expr::UNARY:
+                return hasCalls(static_cast<const UnaryExpr*>(expr)->operand.get());
+            case Expr::BINARY:
+            case Expr::LOGICAL: {
+                const BinaryExpr* binary = static_cast<const BinaryExpr*>(expr);
+                return hasCalls(binary->left.get()) || hasCalls(binary->right.get());
+            }
+            case Expr::INDEX: {
+                const IndexExpr* index = static_cast<const IndexExpr*>(expr);
+                return hasCalls(index->object.get()) || hasCalls(index->index.get());
+            }
+            case Expr::FIELD:
+                return hasCalls(static_cast<const FieldExpr*>(expr)->object.get());
+            case Expr::INTERPOLATION:
+                for (const ExprPtr& part : static_cast<const InterpolationExpr*>(expr)->parts) {
+                    if (hasCalls(part.get())) return true;
+                }
+                return false;
+            default:
+                return false;
+        }
+    }
+
+    // `x = push(x, e)` and `x = x + e` update the variable in place, so building
+    // an array or string in a loop no longer copies it on every iteration
+    bool selfUpdate(const AssignStmt* assign, int line) {
+        const Expr* value = assign->value.get();
+        const Expr* operand = nullptr;
+        OpCode op;
+        if (value->kind == Expr::CALL) {
+            const CallExpr* call = static_cast<const CallExpr*>(value);
+            static const Atom push = AtomTable::intern("push");
+            if (!isVariable(call->callee.get(), push) || call->args.size() != 2 ||
+                !isVariable(call->args[0].get(), assign->name) || nativeFor(push, line) < 0) {
+                return false;
+            }
+            operand = call->args[1].get();
+            op = OP_APPEND_VAR;
+        } else if (value->kind == Expr::BINARY) {
+            const BinaryExpr* binary = static_cast<const BinaryExpr*>(value);
+            if (binary->op != TOKEN_PLUS || !isVariable(binary->left.get(), assign->name)) {
+                return false;
+            }
+            operand = binary->right.get();
+            op = OP_CONCAT_VAR;
+        } else {
+            return false;
+        }
+        if (hasCalls(operand)) return false;
+
+        expression(operand);
+        VarRef var = resolve(assign->name, line);
+        emit(op, line);
+        emit(var.kind == VarRef::GLOBAL ? 1 : 0, line);
+        emitShort(var.index, line);
+        return true;
+    }
+
+    // Variable resolution
+    //
+    // Blocks do not open scopes: a name assigned anywhere in a function body is
+    // a local for the whole body unless it is already a global. A catch variable
+    // that does not name an existing variable is only visible inside its catch
+    // block. A lambda
+    // reading or assigning a local of an enclosing function gets its own copy,
+    // taken when the lambda is created.
+
+    // LET / ASSIGN targets and loop variables of a body, without descending
+    // into nested functions
+    static void collectAssigned(const Block& stmts, std::vector<std::pair<Atom, int>>& names) {
+        for (const StmtPtr& stmt : stmts) {
+            switch (stmt->kind) {
+                case Stmt::LET:
+                case Stmt::ASSIGN:
+                    names.push_back({static_cast<const AssignStmt*>(stmt.get())->name, stmt->line});
+                    break;
+                case Stmt::IF: {
+                    const IfStmt* ifStmt = static_cast<const IfStmt*>(stmt.get());
+                    collectAssigned(ifStmt->thenBranch, names);
+                    collectAssigned(ifStmt->elseBranch, names);
+                    break;
+                }
+                case Stmt::WHILE:
+                    collectAssigned(static_cast<const WhileStmt*>(stmt.get())->body, names);
+                    break;
+                case Stmt::FOR: {
+                    const ForStmt* forStmt = static_cast<const ForStmt*>(stmt.get());
+                    names.push_back({forStmt->var, stmt->line});
+                    collectAssigned(forStmt->body, names);
+                    break;
+                }
+                case Stmt::MATCH: {
+                    const MatchStmt* match = static_cast<const MatchStmt*>(stmt.get());
+                    for (const MatchCase& caseItem : match->cases) {
+                        collectAssigned(caseItem.body, names);
+                    }
+                    collectAssigned(match->defaultBody, names);
+                    break;
+                }
+                case Stmt::TRY: {
+                    const TryStmt* tryStmt = static_cast<const TryStmt*>(stmt.get());
+                    collectAssigned(tryStmt->tryBody, names);
+                    collectAssigned(tryStmt->catchBody, names);
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+
+    uint16_t addLocal(Atom name, int line) {
+        uint16_t slot = checkIndex(proto->slotNames.size(), "local variables", line);
+        proto->slotNames.push_back(name);
+        locals.push_back({name, slot});
+        return slot;
+    }
+
+    int resolveLocal(Atom name) const {
+        for (size_t i = locals.size(); i > 0; i--) {
+            if (locals[i - 1].name == name) return locals[i - 1].slot;
+        }
+        return -1;
+    }
+
+    // Finds name in an enclosing function and makes it an upvalue of this lambda.
+    // Only the variables a lambda actually uses are captured.
+    int resolveUpvalue(Atom name, int line) {
+        if (!isLambda) return -1;
+        for (size_t i = 0; i < proto->captures.size(); i++) {
+            if (proto->captures[i].name == name) return static_cast<int>(i);
+        }
+        bool fromUpvalue = false;
+        int from = enclosing->resolveLocal(name);
+        if (from < 0) {
+            from = enclosing->resolveUpvalue(name, line);
+            fromUpvalue = true;
+        }
+        if (from < 0) return -1;
+        uint16_t index = checkIndex(proto->captures.size(), "captured variables", line);
+        proto->captures.push_back({name, static_cast<uint16_t>(from), fromUpvalue});
+        return index;
+    }
+
+    VarRef resolve(Atom name, int line) {
+        int slot = resolveLocal(name);
+        if (slot >= 0) return {VarRef::LOCAL, static_cast<uint16_t>(slot)};
+        slot = resolveUpvalue(name, line);
+        if (slot >= 0) return {VarRef::UPVALUE, static_cast<uint16_t>(slot)};
+        return {VarRef::GLOBAL, globals.slot(scope.global(name), line)};
+    }
+
+    // The native a name refers to, or -1. A script's own binding of the name,
+    // as a local, a captured variable or a global, comes first, so scripts
+    // written before a native of that name existed keep working.
+    int nativeFor(Atom name, int line) {
+        int native = NativeRegistry::instance().find(name);
+        if (native < 0 || resolveLocal(name) >= 0 || resolveUpvalue(name, line) >= 0) return -1;
+        Atom global = scope.global(name);
+        bool bound = globals.has(global);
+        scope.globalChecks.push_back({global, bound});
+        return bound ? -1 : native;
+    }
+
+    // Whether assigning a name that is not a local writes a global. A module
+    // only writes its own top-level names, never those of its importers.
+    // The answer is kept in globalChecks, so a cached copy is only reused
+    // while it still holds.
+    bool assignsGlobal(Atom name) {
+        Atom global = scope.global(name);
+        if (scope.module != NO_ATOM && global == name) return false;
+        bool bound = globals.has(global);
+        scope.globalChecks.push_back({global, bound});
+        return bound;
+    }
+
+    void emitGet(Atom name, int line) {
+        VarRef var = resolve(name, line);
+        static const OpCode get[] = {OP_GET_LOCAL, OP_GET_UPVALUE, OP_GET_GLOBAL};
+        emitOp(get[var.kind], var.index, line);
+    }
+
+    // Upvalues are read-only; a lambda assigning a captured variable works on
+    // a local copy of it, so the assignment never outlives the call
+    void emitSet(Atom name, int line) {
+        VarRef var = resolve(name, line);
+        if (var.kind == VarRef::UPVALUE) {
+            var = {VarRef::LOCAL, addLocal(name, line)};
+        }
+        emitOp(var.kind == VarRef::GLOBAL ? OP_SET_GLOBAL : OP_SET_LOCAL, var.index, line);
+    }
+
+    uint16_t compileFunction(Atom name, const std::vector<Atom>& params,
+                             const Block& body, bool lambda, int line) {
+        std::unique_ptr<FunctionProto> fn(new FunctionProto());
+        fn->name = name;
+        fn->params = params;
+        Compiler compiler(fn.get(), this, globals, scope, lambda);
+        for (Atom param : params) {
+            compiler.addLocal(param, line);
+        }
+        std::vector<std::pair<Atom, int>> assigned;
+        collectAssigned(body, assigned);
+        for (const auto& var : assigned) {
+            if (compiler.resolveLocal(var.first) >= 0) continue;
+            int upvalue = compiler.resolveUpvalue(var.first, var.second);
+            if (upvalue >= 0) {
+                // Assigned captures start each call as a copy of the upvalue
+                compiler.emitOp(OP_GET_UPVALUE, static_cast<uint16_t>(upvalue), line);
+                compiler.emitOp(OP_SET_LOCAL, compiler.addLocal(var.first, var.second), line);
+                continue;
+            }
+            if (assignsGlobal(var.first)) continue;
+            compiler.addLocal(var.first, var.second);
+        }
+        compiler.block(body);
+        compiler.emitReturnNil(body.empty() ? line : body.back()->line);
+
+        uint16_t index = checkIndex(chunk().functions.size(), "functions", line);
+        chunk().functions.push_back(std::move(fn));
+        return index;
+    }
+
+    void block(const Block& stmts) {
+        for (const StmtPtr& stmt : stmts) {
+            statement(stmt.get());
+        }
+    }
+
+    void statement(const Stmt* stmt) {
+        int line = stmt->line;
+        switch (stmt->kind) {
+            case Stmt::LET:
+            case Stmt::ASSIGN: {
+                const AssignStmt* assign = static_cast<const AssignStmt*>(stmt);
+                if (selfUpdate(assign, line)) break;
+                expression(assign->value.get());
+                emitSet(assign->name, line);
+                break;
+            }
+            case Stmt::EXPRESSION:
+                expression(static_cast<const ExpressionStmt*>(stmt)->expr.get());
+                emit(OP_POP, line);
+                break;
+            case Stmt::PUTS:
+                expression(static_cast<const ExpressionStmt*>(stmt)->expr.get());
+                emit(OP_PUTS, line);
+                break;
+            case Stmt::THROW:
+                expression(static_cast<const ExpressionStmt*>(stmt)->expr.get());
+                emit(OP_THROW, line);
+                break;
+            case Stmt::RETURN: {
+                const Expr* value = static_cast<const ExpressionStmt*>(stmt)->expr.get();
+                // A call in tail position reuses this frame, unless a try block
+                // of this function still has to be unwound
+                if (value->kind == Expr::CALL && unwind.empty()) {
+                    call(static_cast<const CallExpr*>(value), true, line);
+                } else {
+                    expression(value);
+                }
+                emit(OP_RETURN, line);
+                break;
+            }
+            case Stmt::BREAK:
+                emitUnwind(loops.back().unwindDepth, line);
+                loops.back().breakJumps.push_back(emitJump(OP_JUMP, line));
+                break;
+            case Stmt::CONTINUE:
+                emitUnwind(loops.back().unwindDepth, line);
+                emitLoop(loops.back().start, line);
+                break;
+            case Stmt::IF: {
+                const IfStmt* ifStmt = static_cast<const IfStmt*>(stmt);
+                expression(ifStmt->condition.get());
+                size_t elseJump = emitJump(OP_JUMP_IF_FALSE, line);
+                block(ifStmt->thenBranch);
+                if (ifStmt->hasElse) {
+                    size_t endJump = emitJump(OP_JUMP, line);
+                    patchJump(elseJump, line);
+                    block(ifStmt->elseBranch);
+                    patchJump(endJump, line);
+                } else {
+                    patchJump(elseJump, line);
+                }
+                break;
+            }
+            case Stmt::WHILE: {
+                const WhileStmt* whileStmt = static_cast<const WhileStmt*>(stmt);
+                loops.push_back({chunk().code.size(), unwind.size(), {}});
+                expression(whileStmt->condition.get());
+                size_t exitJump = emitJump(OP_JUMP_UNLESS_TRUE, line);
+                block(whileStmt->body);
+                emitLoop(loops.back().start, line);
+                patchJump(exitJump, line);
+                for (size_t jump : loops.back().breakJumps) patchJump(jump, line);
+                loops.pop_back();
+                break;
+            }
+            case Stmt::FOR: {
+                const ForStmt* forStmt = static_cast<const ForStmt*>(stmt);
+                expression(forStmt->start.get());
+                expression(forStmt->end.get());
+                emit(OP_FOR_PREP, line);
+                loops.push_back({chunk().code.size(), unwind.size(), {}});
+                size_t exitJump = emitJump(OP_FOR_ITER, line);
+                emitSet(forStmt->var, line);
+                block(forStmt->body);
+                emitLoop(loops.back().start, line);
+                patchJump(exitJump, line);
+                for (size_t jump : loops.back().breakJumps) patchJump(jump, line);
+                loops.pop_back();
+                emit(OP_POP, line);
+                emit(OP_POP, line);
+                break;
+            }
+            case Stmt::MATCH:
+                matchStatement(static_cast<const MatchStmt*>(stmt));
+                break;
+            case Stmt::TRY: {
+                const TryStmt* tryStmt = static_cast<const TryStmt*>(stmt);
+                size_t handlerJump = emitJump(OP_TRY_BEGIN, line);
+                unwind.push_back(OP_TRY_END);
+                block(tryStmt->tryBody);
+                unwind.pop_back();
+                emit(OP_TRY_END, line);
+                size_t endJump = emitJump(OP_JUMP, line);
+
+                // The VM enters here with the thrown value on the stack
+                patchJump(handlerJump, line);
+                Atom name = tryStmt->errorVar;
+                if (resolveLocal(name) >= 0 || resolveUpvalue(name, line) >= 0 || assignsGlobal(name)) {
+                    emitSet(name, line);
+                    block(tryStmt->catchBody);
+                } else {
+                    size_t errorLocal = locals.size();
+                    emitOp(OP_SET_LOCAL, addLocal(name, line), line);
+                    block(tryStmt->catchBody);
+                    // Captures added while compiling the body stay visible
+                    locals.erase(locals.begin() + errorLocal);
+                }
+                patchJump(endJump, line);
+                break;
+            }
+            case Stmt::FUNCTION: {
+                const FunctionStmt* func = static_cast<const FunctionStmt*>(stmt);
+                Atom name = scope.global(func->name);
+                emitOp(OP_DEFINE_FUNCTION, compileFunction(name, func->params, func->body, false, line), line);
+                emitShort(globals.slot(name, line), line);
+                break;
+            }
+            case Stmt::STRUCT: {
+                const StructStmt* def = static_cast<const StructStmt*>(stmt);
+                uint16_t index = checkIndex(chunk().structDefs.size(), "structs", line);
+                chunk().structDefs.push_back({def->name, def->fields});
+                emitOp(OP_DEFINE_STRUCT, index, line);
+                break;
+            }
+            case Stmt::IMPORT: {
+                const ImportStmt* import = static_cast<const ImportStmt*>(stmt);
+                emitOp(OP_IMPORT, nameConstant(import->module, line), line);
+                emitShort(stringConstant(scope.directory, line), line);
+                for (Atom imported : import->names) {
+                    emitOp(OP_GET_GLOBAL, globals.slot(ModuleScope::qualify(import->module, imported), line), line);
+                    emitSet(imported, line);
+                }
+                break;
+            }
+        }
+    }
+
+    // The subject stays on the stack while cases are compared and is popped
+    // before any body runs, so break/return inside a case leave nothing behind.
+    void matchStatement(const MatchStmt* stmt) {
+        int line = stmt->line;
+        expression(stmt->value.get());
+
+        std::vector<size_t> endJumps;
+        for (const MatchCase& caseItem : stmt->cases) {
+            emit(OP_DUP, line);
+            expression(caseItem.value.get());
+            emit(OP_MATCH_EQUAL, line);
+            size_t nextCase = emitJump(OP_JUMP_IF_FALSE, line);
+            emit(OP_POP, line);
+            block(caseItem.body);
+            endJumps.push_back(emitJump(OP_JUMP, line));
+            patchJump(nextCase, line);
+        }
+
+        emit(OP_POP, line);
+        if (stmt->hasDefault) {
+            block(stmt->defaultBody);
+        }
+        for (size_t jump : endJumps) patchJump(jump, line);
+    }
+
+    void call(const CallExpr* call, bool tail, int line) {
+        if (call->args.size() > UINT8_MAX) {
+            throw ParseError("Too many arguments in function call", line);
+        }
+        // Natives named directly are bound to their registry entry here
+        int native = -1;
+        if (call->callee->kind == Expr::VARIABLE) {
+            native = nativeFor(static_cast<const VariableExpr*>(call->callee.get())->name, line);
+        }
+        if (native < 0) {
+            expression(call->callee.get());
+        }
+        for (const ExprPtr& arg : call->args) {
+            expression(arg.get());
+        }
+        if (native >= 0) {
+            emitOp(OP_CALL_NATIVE, static_cast<uint16_t>(native), line);
+        } else {
+            emit(tail ? OP_TAIL_CALL : OP_CALL, line);
+        }
+        emit(static_cast<uint8_t>(call->args.size()), line);
+    }
+
+    void expression(const Expr* expr) {
+        int line = expr->line;
+        switch (expr->kind) {
+            case Expr::NUMBER:
+                emitOp(OP_CONSTANT, numberConstant(static_cast<const NumberExpr*>(expr)->value, line), line);
+                break;
+            case Expr::STRING:
+                emitOp(OP_CONSTANT, stringConstant(static_cast<const StringExpr*>(expr)->value, line), line);
+                break;
+            case Expr::INTERPOLATION: {
+                // Pushes every part, then joins them with INTERPOLATE
+                const InterpolationExpr* interpolation = static_cast<const InterpolationExpr*>(expr);
+                for (const ExprPtr& part : interpolation->parts) {
+                    expression(part.get());
+                }
+                emitOp(OP_INTERPOLATE, checkIndex(interpolation->parts.size(), "interpolated segments", line), line);
+                break;
+            }
+            case Expr::BOOL:
+                emit(static_cast<const BoolExpr*>(expr)->value ? OP_TRUE : OP_FALSE, line);
+                break;
+            case Expr::VARIABLE: {
+                // A native not shadowed by the script is never redefined, so
+                // its name is resolved here instead of on every evaluation
+                Atom name = static_cast<const VariableExpr*>(expr)->name;
+                if (nativeFor(name, line) >= 0) {
+                    emitOp(OP_CONSTANT, nameConstant(name, line), line);
+                } else {
+                    emitGet(name, line);
+                }
+                break;
+            }
+            case Expr::ARRAY: {
+                const ArrayExpr* arr = static_cast<const ArrayExpr*>(expr);
+                for (const ExprPtr& element : arr->elements) {
+                    expression(element.get());
+                }
+                emitOp(OP_ARRAY, checkIndex(arr->elements.size(), "array elements", line), line);
+                break;
+            }
+            case Expr::STRUCT_LITERAL: {
+                const StructLiteralExpr* literal = static_cast<const StructLiteralExpr*>(expr);
+                StructLiteralInfo info;
+                info.name = literal->structName;
+                for (const auto& field : literal->fields) {
+                    expression(field.second.get());
+                    info.fields.push_back(field.first);
+                }
+                uint16_t index = checkIndex(chunk().structLiterals.size(), "struct literals", line);
+                chunk().structLiterals.push_back(std::move(info));
+                emitOp(OP_STRUCT, index, line);
+                break;
+            }
+            case Expr::LAMBDA: {
+                const LambdaExpr* lambda = static_cast<const LambdaExpr*>(expr);
+                static const Atom lambdaName = AtomTable::intern("<lambda>");
+                emitOp(OP_LAMBDA, compileFunction(lambdaName, lambda->params, lambda->body, true, line), line);
+                break;
+            }
+            case Expr::UNARY: {
+                const UnaryExpr* unary = static_cast<const UnaryExpr*>(expr);
+                expression(unary->operand.get());
+                emit(unary->op == TOKEN_BANG ? OP_NOT : OP_NEGATE, line);
+                break;
+            }
+            case Expr::BINARY: {
+                const BinaryExpr* binary = static_cast<const BinaryExpr*>(expr);
+                expression(binary->left.get());
+                expression(binary->right.get());
+                emit(binaryOp(binary->op), line);
+                break;
+            }
+            case Expr::LOGICAL: {
+                const BinaryExpr* logical = static_cast<const BinaryExpr*>(expr);
+                expression(logical->left.get());
+                emit(OP_TO_BOOL, line);
+                size_t shortCircuit = emitJump(logical->op == TOKEN_OR ? OP_JUMP_IF_TRUE_KEEP : OP_JUMP_IF_FALSE_KEEP, line);
+                emit(OP_POP, line);
+                expression(logical->right.get());
+                emit(OP_TO_BOOL, line);
+                patchJump(shortCircuit, line);
+                break;
+            }
+            case Expr::CALL:
+                call(static_cast<const CallExpr*>(expr), false, line);
+                break;
+            case Expr::INDEX: {
+                const IndexExpr* index = static_cast<const IndexExpr*>(expr);
+                expression(index->object.get());
+                expression(index->index.get());
+                emit(OP_INDEX, line);
+                break;
+            }
+            case Expr::FIELD: {
+                const FieldExpr* field = static_cast<const FieldExpr*>(expr);
+                Atom member;
+                if (moduleMember(field, member)) {
+                    emitOp(OP_GET_GLOBAL, globals.slot(member, line), line);
+                    break;
+                }
+                expression(field->object.get());
+                emitOp(OP_GET_FIELD, nameConstant(field->field, line), line);
+                emitShort(checkIndex(chunk().fieldCaches.size(), "field accesses", line), line);
+                chunk().fieldCaches.push_back({nullptr, 0});
+                break;
+            }
+        }
+    }
+
+    // utils.helper, where utils is a namespace imported by this script and
+    // not shadowed by a variable
+    bool moduleMember(const FieldExpr* field, Atom& member) {
+        if (field->object->kind != Expr::VARIABLE) return false;
+        Atom module = static_cast<const VariableExpr*>(field->object.get())->name;
+        if (!scope.namespaces.count(module) || resolveLocal(module) >= 0 || resolveUpvalue(module, field->line) >= 0) {
+            return false;
+        }
+        member = ModuleScope::qualify(module, field->field);
+        return true;
+    }
+
+};
+
+// CodeCache - compiled scripts saved next to their source as <file>.chococ, so
+// later runs skip lexing, parsing and compiling. A cache is used only while its
+// source keeps the size and modification time it was compiled from, and only
+// by the interpreter build that wrote it. Global slots and native indices are
+// assigned per run, so the cached code refers to them by name and is patched
+// when it is loaded.
+class CodeCache {
+public:
+    struct Stamp {
+        uint64_t size;
+        int64_t mtime;
+    };
+
+    static bool stamp(const std::string& path, Stamp& result) {
+        std::error_code error;
+        result.size = std::filesystem::file_size(path, error);
+        if (error) return false;
+        result.mtime = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+        return !error;
+    }
+
+    // Writes the cache through a temporary file, so concurrent runs never see
+    // half of one. Failing to write it is not an error.
+    static void save(const std::string& path, const FunctionProto& script, const Stamp& source,
+                     const GlobalTable& globals, const ModuleScope& scope) {
+        Links links;
+        Writer body;
+        try {
+            writeProto(body, script, globals, links);
+        } catch (const CacheError&) {
+            return;
+        }
+
+        Writer file;
+        file.bytes(MAGIC, sizeof(MAGIC));
+        file.u32(FORMAT_VERSION);
+        file.string(BUILD);
+        file.u64(source.size);
+        file.u64(static_cast<uint64_t>(source.mtime));
+        file.atoms(scope.declared);
+        file.u32(static_cast<uint32_t>(scope.globalChecks.size()));
+        for (const auto& check : scope.globalChecks) {
+            file.atom(check.first);
+            file.u8(check.second);
+        }
+        file.atoms(links.globals);
+        file.atoms(links.natives);
+        file.bytes(body.data.data(), body.data.size());
+
+        std::string temp = path + ".tmp" + std::to_string(std::random_device()());
+        std::error_code error;
+        {
+            std::ofstream out(temp, std::ios::binary);
+            if (!out.write(file.data.data(), file.data.size())) {
+                out.close();
+                std::filesystem::remove(temp, error);
+                return;
+            }
+        }
+        std::filesystem::rename(temp, path, error);
+        if (error) std::filesystem::remove(temp, error);
+    }
+
+    // The cached script, or null if there is no current cache for source
+    static std::unique_ptr<FunctionProto> load(const std::string& path, const Stamp& source, GlobalTable& globals) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return nullptr;
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        try {
+            Reader reader{data.data(), data.data() + data.size()};
+            char magic[sizeof(MAGIC)];
+            reader.bytes(magic, sizeof(magic));
+            if (memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || reader.u32() != FORMAT_VERSION ||
+                reader.string() != BUILD || reader.u64() != source.size ||
+                static_cast<int64_t>(reader.u64()) != source.mtime) {
+                return nullptr;
+            }
+
+            // The globals the script declares exist before its functions were
+            // compiled; every other name must still resolve the way it did then
+            for (Atom name : reader.atoms()) {
+                globals.slot(name, 0);
+            }
+            uint32_t checks = reader.u32();
+            for (uint32_t i = 0; i < checks; i++) {
+                Atom name = reader.atom();
+                if (globals.has(name) != (reader.u8() != 0)) return nullptr;
+            }
+
+            Links links;
+            for (Atom name : reader.atoms()) {
+                links.globalSlots.push_back(globals.slot(name, 0));
+            }
+            for (Atom name : reader.atoms()) {
+                int native = NativeRegistry::instance().find(name);
+                if (native < 0) return nullptr;
+                links.nativeSlots.push_back(static_cast<uint16_t>(native));
+            }
+            return readProto(reader, links);
+        } catch (const CacheError&) {
+            return nullptr;
+        } catch (const ParseError&) {
+            return nullptr;
+        }
+    }
+
+private:
+    static constexpr char MAGIC[8] = {'C', 'H', 'O', 'C', 'O', 'C', '\0', '\n'};
+    static const uint32_t FORMAT_VERSION = 1;
+    static constexpr const char* BUILD = __DATE__ " " __TIME__;
+
+    struct CacheError {};
+
+    // Globals and natives named by the cached code. Saving numbers them in
+    // order of first use; loading maps those numbers to this run's slots.
+    struct Links {
+        std::vector<Atom> globals;
+        std::unordered_map<uint16_t, uint16_t> globalIndex;
+        std::vector<Atom> natives;
+        std::unordered_map<uint16_t, uint16_t> nativeIndex;
+        std::vector<uint16_t> globalSlots;
+        std::vector<uint16_t> nativeSlots;
+    };
+
+    struct Writer {
+        std::string data;
+
+        void bytes(const void* src, size_t size) { data.append(static_cast<const char*>(src), size); }
+        void u8(uint8_t value) { data.push_back(static_cast<char>(value)); }
+        void u16(uint16_t value) { bytes(&value, sizeof(value)); }
+        void u32(uint32_t value) { bytes(&value, sizeof(value)); }
+        void u64(uint64_t value) { bytes(&value, sizeof(value)); }
+
+        void string(const std::string& str) {
+            u32(static_cast<uint32_t>(str.size()));
+            bytes(str.data(), str.size());
+        }
+
+        void atom(Atom name) { string(AtomTable::name(name)); }
+
+        void atoms(const std::vector<Atom>& names) {
+            u32(static_cast<uint32_t>(names.size()));
+            for (Atom name : names) atom(name);
+        }
+    };
+
+    struct Reader {
+        const char* pos;
+        const char* end;
+
+        void bytes(void* dst, size_t size) {
+            if (static_cast<size_t>(end - pos) < size) throw CacheError();
+            memcpy(dst, pos, size);
+            pos += size;
+        }
+
+        uint8_t u8() { uint8_t value; bytes(&value, sizeof(value)); return value; }
+        uint16_t u16() { uint16_t value; bytes(&value, sizeof(value)); return value; }
+        uint32_t u32() { uint32_t value; bytes(&value, sizeof(value)); return value; }
+        uint64_t u64() { uint64_t value; bytes(&value, sizeof(value)); return value; }
+
+        std::string string() {
+            uint32_t size = u32();
+            if (static_cast<size_t>(end - pos) < size) throw CacheError();
+            std::string str(pos, size);
+            pos += size;
+            return str;
+        }
+
+        Atom atom() { return AtomTable::intern(string()); }
+
+        std::vector<Atom> atoms() {
+            std::vector<Atom> names(u32());
+            for (Atom& name : names) name = atom();
+            return names;
+        }
+
+        // A count of items that each take at least one byte
+        uint32_t count() {
+            uint32_t n = u32();
+            if (n > static_cast<size_t>(end - pos)) throw CacheError();
+            return n;
+        }
+    };
+
+    // Calls onGlobal / onNative with the position of every global slot and
+    // native index operand in code
+    template <typename GlobalFn, typename NativeFn>
+    static void forEachLink(std::vector<uint8_t>& code, GlobalFn onGlobal, NativeFn onNative) {
+        for (size_t ip = 0; ip < code.size(); ip += 1 + operandBytes(static_cast<OpCode>(code[ip]))) {
+            if (ip + operandBytes(static_cast<OpCode>(code[ip])) >= code.size()) throw CacheError();
+            switch (code[ip]) {
+                case OP_GET_GLOBAL:
+                case OP_SET_GLOBAL:
+                    onGlobal(&code[ip + 1]);
+                    break;
+                case OP_APPEND_VAR:
+                case OP_CONCAT_VAR:
+                    if (code[ip + 1]) onGlobal(&code[ip + 2]);
+                    break;
+                case OP_DEFINE_FUNCTION:
+                    onGlobal(&code[ip + 3]);
+                    break;
+                case OP_CALL_NATIVE:
+                    onNative(&code[ip + 1]);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    static uint16_t readOperand(const uint8_t* operand) {
+        return static_cast<uint16_t>((operand[0] << 8) | operand[1]);
+    }
+
+    static void writeOperand(uint8_t* operand, uint16_t value) {
+        operand[0] = static_cast<uint8_t>(value >> 8);
+        operand[1] = static_cast<uint8_t>(value & 0xff);
+    }
+
+    static uint16_t link(uint16_t slot, Atom name, std::vector<Atom>& names,
+                         std::unordered_map<uint16_t, uint16_t>& index) {
+        auto it = index.find(slot);
+        if (it != index.end()) return it->second;
+        uint16_t number = static_cast<uint16_t>(names.size());
+        names.push_back(name);
+        index[slot] = number;
+        return number;
+    }
+
+    static void writeStructs(Writer& out, const std::vector<StructLiteralInfo>& structs) {
+        out.u32(static_cast<uint32_t>(structs.size()));
+        for (const StructLiteralInfo& info : structs) {
+            out.atom(info.name);
+            out.atoms(info.fields);
+        }
+    }
+
+    static void readStructs(Reader& in, std::vector<StructLiteralInfo>& structs) {
+        structs.resize(in.count());
+        for (StructLiteralInfo& info : structs) {
+            info.name = in.atom();
+            info.fields = in.atoms();
+        }
+    }
+
+    enum ConstantTag : uint8_t { NUMBER_CONSTANT, STRING_CONSTANT, NAME_CONSTANT };
+
+    static void writeProto(Writer& out, const FunctionProto& proto, const GlobalTable& globals, Links& links) {
+        out.atom(proto.name);
+        out.atoms(proto.params);
+        out.atoms(proto.slotNames);
+        out.u32(static_cast<uint32_t>(proto.captures.size()));
+        for (const Capture& capture : proto.captures) {
+            out.atom(capture.name);
+            out.u16(capture.index);
+            out.u8(capture.fromUpvalue);
+        }
+
+        const Chunk& chunk = proto.chunk;
+        std::vector<uint8_t> code = chunk.code;
+        forEachLink(code,
+            [&](uint8_t* operand) {
+                uint16_t slot = readOperand(operand);
+                writeOperand(operand, link(slot, globals.names[slot], links.globals, links.globalIndex));
+            },
+            [&](uint8_t* operand) {
+                uint16_t index = readOperand(operand);
+                Atom name = NativeRegistry::instance().get(index).name;
+                writeOperand(operand, link(index, name, links.natives, links.nativeIndex));
+            });
+        out.u32(static_cast<uint32_t>(code.size()));
+        out.bytes(code.data(), code.size());
+        out.bytes(chunk.lines.data(), chunk.lines.size() * sizeof(int));
+
+        out.u32(static_cast<uint32_t>(chunk.constants.size()));
+        for (const Value& constant : chunk.constants) {
+            if (constant.type == Value::NUMBER) {
+                out.u8(NUMBER_CONSTANT);
+                out.bytes(&constant.num, sizeof(constant.num));
+            } else if (constant.type == Value::STRING) {
+                bool name = constant.atom() != NO_ATOM;
+                out.u8(name ? NAME_CONSTANT : STRING_CONSTANT);
+                out.string(constant.str());
+            } else {
+                throw CacheError();
+            }
+        }
+        out.u32(static_cast<uint32_t>(chunk.functions.size()));
+        for (const auto& function : chunk.functions) {
+            writeProto(out, *function, globals, links);
+        }
+        writeStructs(out, chunk.structLiterals);
+        writeStructs(out, chunk.structDefs);
+        out.u32(static_cast<uint32_t>(chunk.fieldCaches.size()));
+    }
+
+    static std::unique_ptr<FunctionProto> readProto(Reader& in, const Links& links) {
+        std::unique_ptr<FunctionProto> proto(new FunctionProto());
+        proto->name = in.atom();
+        proto->params = in.atoms();
+        proto->slotNames = in.atoms();
+        proto->captures.resize(in.count());
+        for (Capture& capture : proto->captures) {
+            capture.name = in.atom();
+            capture.index = in.u16();
+            capture.fromUpvalue = in.u8() != 0;
+        }
+
+        Chunk& chunk = proto->chunk;
+        chunk.code.resize(in.count());
+        in.bytes(chunk.code.data(), chunk.code.size());
+        chunk.lines.resize(chunk.code.size());
+        in.bytes(chunk.lines.data(), chunk.lines.size() * sizeof(int));
+        forEachLink(chunk.code,
+            [&](uint8_t* operand) {
+                uint16_t number = readOperand(operand);
+                if (number >= links.globalSlots.size()) throw CacheError();
+                writeOperand(operand, links.globalSlots[number]);
+            },
+            [&](uint8_t* operand) {
+                uint16_t number = readOperand(operand);
+                if (number >= links.nativeSlots.size()) throw CacheError();
+                writeOperand(operand, links.nativeSlots[number]);
+            });
+
+        chunk.constants.resize(in.count());
+        for (Value& constant : chunk.constants) {
+            uint8_t tag = in.u8();
+            if (tag == NUMBER_CONSTANT) {
+                double num;
+                in.bytes(&num, sizeof(num));
+                constant = Value(num);
+            } else if (tag == STRING_CONSTANT) {
+                constant = Value(in.string());
+            } else if (tag == NAME_CONSTANT) {
+                constant = Value::fromAtom(in.atom());
+            } else {
+                throw CacheError();
+            }
+        }
+        chunk.functions.resize(in.count());
+        for (auto& function : chunk.functions) {
+            function = readProto(in, links);
+        }
+        readStructs(in, chunk.structLiterals);
+        readStructs(in, chunk.structDefs);
+        uint32_t fieldCaches = in.u32();
+        if (fieldCaches > chunk.code.size()) throw CacheError();
+        chunk.fieldCaches.assign(fieldCaches, {nullptr, 0});
+        return proto;
+    }
+};
+
+// One-character strings (s[i], split pieces) are shared instead of allocated
+// every time; copy-on-write keeps a script from changing the shared one
+static const Value& characterString(unsigned char c) {
+    static const std::vector<Value> characters = [] {
+        std::vector<Value> all;
+        all.reserve(256);
+        for (int i = 0; i < 256; i++) {
+            all.push_back(Value(std::string(1, static_cast<char>(i))));
+        }
+        return all;
+    }();
+    return characters[c];
+}
+
+// The text of a string or a builder, which file output takes alike; null for other values
+static const std::string* textOf(const Value& val) {
+    if (val.type == Value::STRING) return &val.str();
+    if (val.type == Value::BUILDER) return &val.builder();
+    return nullptr;
+}
+
+// A string value holding a copy of text
+static Value stringValue(std::string_view text) {
+    if (text.size() == 1) return characterString(static_cast<unsigned char>(text[0]));
+    return Value(std::string(text));
+}
+
+// Operator semantics shared by the VM and the Optimizer
+static bool isTruthy(const Value& val) {
+    if (val.type == Value::BOOL) return val.boolean;
+    if (val.type == Value::NUMBER) return val.num != 0;
+    if (val.type == Value::STRING) return !val.str().empty();
+    return false;
+}
+
+static bool toBool(const Value& val) {
+    if (val.type == Value::BOOL) return val.boolean;
+    if (val.type == Value::NUMBER) return val.num != 0;
+    return false;
+}
+
+static bool valuesMatch(const Value& a, const Value& b) {
+    if (a.type != b.type) return false;
+    if (a.type == Value::NUMBER) return a.num == b.num;
+    if (a.type == Value::STRING) return a.str() == b.str();
+    if (a.type == Value::BOOL) return a.boolean == b.boolean;
+    return false;
+}
+
+static bool compare(OpCode op, const Value& left, const Value& right) {
+    if (left.type == Value::NUMBER && right.type == Value::NUMBER) {
+        switch (op) {
+            case OP_EQUAL: return left.num == right.num;
+            case OP_NOT_EQUAL: return left.num != right.num;
+            case OP_LESS: return left.num < right.num;
+            case OP_GREATER: return left.num > right.num;
+            case OP_LESS_EQUAL: return left.num <= right.num;
+            default: return left.num >= right.num;
+        }
+    } else if (left.type == Value::BOOL && right.type == Value::BOOL) {
+        if (op == OP_EQUAL) return left.boolean == right.boolean;
+        if (op == OP_NOT_EQUAL) return left.boolean != right.boolean;
+    } else if (left.type == Value::STRING && right.type == Value::STRING) {
+        if (op == OP_EQUAL) return left.str() == right.str();
+        if (op == OP_NOT_EQUAL) return left.str() != right.str();
+    }
+    return false;
+}
+
+// Slow path for arithmetic on anything other than two numbers
+static void arithmetic(OpCode op, Value& left, const Value& right, int line) {
+    if (left.type == Value::STRING && right.type == Value::STRING && op == OP_ADD) {
+        left = Value(left.str() + right.str());
+        return;
+    }
+    switch (op) {
+        case OP_ADD:
+            throw RuntimeError("Cannot add " + left.getType() + " and " + right.getType(), line);
+        case OP_SUBTRACT:
+            throw RuntimeError("Cannot subtract " + right.getType() + " from " + left.getType(), line);
+        case OP_MULTIPLY:
+            throw RuntimeError("Cannot multiply " + left.getType() + " and " + right.getType(), line);
+        case OP_DIVIDE:
+            throw RuntimeError("Cannot divide " + left.getType() + " and " + right.getType(), line);
+        default:
+            throw RuntimeError("Cannot modulo " + left.getType() + " and " + right.getType(), line);
+    }
+}
+
+// Optimizer - folds constant expressions and prunes constant `if` branches
+// before the AST is compiled. Folding evaluates with the VM's own operator
+// semantics and the natives marked pure; an expression whose evaluation would
+// raise an error is left alone so the error still happens at run time.
+class Optimizer {
+    Interpreter& interp;
+    const GlobalTable& globals;
+
+public:
+    Optimizer(Interpreter& interpreter, const GlobalTable& table) : interp(interpreter), globals(table) {}
+
+    void program(Block& statements) {
+        bindings(statements);
+        block(statements);
+    }
+
+private:
+    // Names the program binds anywhere, and so may shadow a native with, see
+    // Compiler::nativeFor. Calls to them are never folded.
+    std::unordered_set<Atom> bound;
+
+    void block(Block& statements) {
+        Block result;
+        result.reserve(statements.size());
+        for (StmtPtr& stmt : statements) {
+            statement(stmt.get());
+            Value condition;
+            if (stmt->kind == Stmt::IF && constant(static_cast<IfStmt*>(stmt.get())->condition.get(), condition)) {
+                // Only the branch that is taken is kept, spliced in place of the if
+                IfStmt* ifStmt = static_cast<IfStmt*>(stmt.get());
+                Block& taken = isTruthy(condition) ? ifStmt->thenBranch : ifStmt->elseBranch;
+                for (StmtPtr& inner : taken) {
+                    result.push_back(std::move(inner));
+                }
+                continue;
+            }
+            result.push_back(std::move(stmt));
+        }
+        statements = std::move(result);
+    }
+
+    void bindings(const Block& statements) {
+        for (const StmtPtr& stmt : statements) {
+            switch (stmt->kind) {
+                case Stmt::LET:
+                case Stmt::ASSIGN: {
+                    const AssignStmt* assign = static_cast<const AssignStmt*>(stmt.get());
+                    bound.insert(assign->name);
+                    bindings(assign->value.get());
+                    break;
+                }
+                case Stmt::EXPRESSION:
+                case Stmt::PUTS:
+                case Stmt::THROW:
+                case Stmt::RETURN:
+                    bindings(static_cast<const ExpressionStmt*>(stmt.get())->expr.get());
+                    break;
+                case Stmt::IF: {
+                    const IfStmt* ifStmt = static_cast<const IfStmt*>(stmt.get());
+                    bindings(ifStmt->condition.get());
+                    bindings(ifStmt->thenBranch);
+                    bindings(ifStmt->elseBranch);
+                    break;
+                }
+                case Stmt::WHILE: {
+                    const WhileStmt* whileStmt = static_cast<const WhileStmt*>(stmt.get());
+                    bindings(whileStmt->condition.get());
+                    bindings(whileStmt->body);
+                    break;
+                }
+                case Stmt::FOR: {
+                    const ForStmt* forStmt = static_cast<const ForStmt*>(stmt.get());
+                    bound.insert(forStmt->var);
+                    bindings(forStmt->start.get());
+                    bindings(forStmt->end.get());
+                    bindings(forStmt->body);
+                    break;
+                }
+                case Stmt::MATCH: {
+                    const MatchStmt* match = static_cast<const MatchStmt*>(stmt.get());
+                    bindings(match->value.get());
+                    for (const MatchCase& caseItem : match->cases) {
+                        bindings(caseItem.value.get());
+                        bindings(caseItem.body);
+                    }
+                    bindings(match->defaultBody);
+                    break;
+                }
+                case Stmt::TRY: {
+                    const TryStmt* tryStmt = static_cast<const TryStmt*>(stmt.get());
+                    bound.insert(tryStmt->errorVar);
+                    bindings(tryStmt->tryBody);
+                    bindings(tryStmt->catchBody);
+                    break;
+                }
+                case Stmt::FUNCTION: {
+                    const FunctionStmt* func = static_cast<const FunctionStmt*>(stmt.get());
+                    bound.insert(func->name);
+                    bound.insert(func->params.begin(), func->params.end());
+                    bindings(func->body);
+                    break;
+                }
+                case Stmt::IMPORT: {
+                    const ImportStmt* import = static_cast<const ImportStmt*>(stmt.get());
+                    bound.insert(import->names.begin(), import->names.end());
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+
+    void bindings(const Expr* expr) {
+        switch (expr->kind) {
+            case Expr::ARRAY:
+                for (const ExprPtr& element : static_cast<const ArrayExpr*>(expr)->elements) {
+                    bindings(element.get());
+                }
+                break;
+            case Expr::STRUCT_LITERAL:
+                for (const auto& field : static_cast<const StructLiteralExpr*>(expr)->fields) {
+                    bindings(field.second.get());
+                }
+                break;
+            case Expr::LAMBDA: {
+                const LambdaExpr* lambda = static_cast<const LambdaExpr*>(expr);
+                bound.insert(lambda->params.begin(), lambda->params.end());
+                bindings(lambda->body);
+                break;
+            }
+            case Expr::UNARY:
+                bindings(static_cast<const UnaryExpr*>(expr)->operand.get());
+                break;
+            case Expr::BINARY:
+            case Expr::LOGICAL: {
+                const BinaryExpr* binary = static_cast<const BinaryExpr*>(expr);
+                bindings(binary->left.get());
+                bindings(binary->right.get());
+                break;
+            }
+            case Expr::CALL: {
+                const CallExpr* call = static_cast<const CallExpr*>(expr);
+                bindings(call->callee.get());
+                for (const ExprPtr& arg : call->args) {
+                    bindings(arg.get());
+                }
+                break;
+            }
+            case Expr::INDEX: {
+                const IndexExpr* index = static_cast<const IndexExpr*>(expr);
+                bindings(index->object.get());
+                bindings(index->index.get());
+                break;
+            }
+            case Expr::FIELD:
+                bindings(static_cast<const FieldExpr*>(expr)->object.get());
+                break;
+            case Expr::INTERPOLATION:
+                for (const ExprPtr& part : static_cast<const InterpolationExpr*>(expr)->parts) {
+                    bindings(part.get());
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void statement(Stmt* stmt) {
+        switch (stmt->kind) {
+            case Stmt::LET:
+            case Stmt::ASSIGN:
+                expression(static_cast<AssignStmt*>(stmt)->value);
+                break;
+            case Stmt::EXPRESSION:
+            case Stmt::PUTS:
+            case Stmt::THROW:
+            case Stmt::RETURN:
+                expression(static_cast<ExpressionStmt*>(stmt)->expr);
+                break;
+            case Stmt::IF: {
+                IfStmt* ifStmt = static_cast<IfStmt*>(stmt);
+                expression(ifStmt->condition);
+                block(ifStmt->thenBranch);
+                block(ifStmt->elseBranch);
+                break;
+            }
+            case Stmt::WHILE: {
+                WhileStmt* whileStmt = static_cast<WhileStmt*>(stmt);
+                expression(whileStmt->condition);
+                block(whileStmt->body);
+                break;
+            }
+            case Stmt::FOR: {
+                ForStmt* forStmt = static_cast<ForStmt*>(stmt);
+                expression(forStmt->start);
+                expression(forStmt->end);
+                block(forStmt->body);
+                break;
+            }
+            case Stmt::MATCH: {
+                MatchStmt* match = static_cast<MatchStmt*>(stmt);
+                expression(match->value);
+                for (MatchCase& caseItem : match->cases) {
+                    expression(caseItem.value);
+                    block(caseItem.body);
+                }
+                block(match->defaultBody);
+                break;
+            }
+            case Stmt::TRY: {
+                TryStmt* tryStmt = static_cast<TryStmt*>(stmt);
+                block(tryStmt->tryBody);
+                block(tryStmt->catchBody);
+                break;
+            }
+            case Stmt::FUNCTION:
+                block(static_cast<FunctionStmt*>(stmt)->body);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void expression(ExprPtr& expr) {
+        Value result;
+        bool folded = false;
+        switch (expr->kind) {
+            case Expr::ARRAY:
+                for (ExprPtr& element : static_cast<ArrayExpr*>(expr.get())->elements) {
+                    expression(element);
+                }
+                break;
+            case Expr::STRUCT_LITERAL:
+                for (auto& field : static_cast<StructLiteralExpr*>(expr.get())->fields) {
+                    expression(field.second);
+                }
+                break;
+            case Expr::LAMBDA:
+                block(static_cast<LambdaExpr*>(expr.get())->body);
+                break;
+            case Expr::UNARY: {
+                UnaryExpr* unary = static_cast<UnaryExpr*>(expr.get());
+                expression(unary->operand);
+                Value operand;
+                if (!constant(unary->operand.get(), operand)) break;
+                if (unary->op == TOKEN_BANG) {
+                    result = Value(operand.type == Value::BOOL ? !operand.boolean : false);
+                    folded = true;
+                } else if (operand.type == Value::NUMBER) {
+                    result = Value(-operand.num);
+                    folded = true;
+                }
+                break;
+            }
+            case Expr::BINARY: {
+                BinaryExpr* binary = static_cast<BinaryExpr*>(expr.get());
+                expression(binary->left);
+                expression(binary->right);
+                Value left, right;
+                if (constant(binary->left.get(), left) && constant(binary->right.get(), right)) {
+                    folded = foldBinary(Compiler::binaryOp(binary->op), left, right, result);
+                }
+                break;
+            }
+            case Expr::LOGICAL: {
+                BinaryExpr* logical = static_cast<BinaryExpr*>(expr.get());
+                expression(logical->left);
+                expression(logical->right);
+                Value left, right;
+                if (!constant(logical->left.get(), left)) break;
+                bool isOr = logical->op == TOKEN_OR;
+                if (toBool(left) == isOr) {
+                    // Short-circuits: the right operand is never evaluated
+                    result = Value(isOr);
+                    folded = true;
+                } else if (constant(logical->right.get(), right)) {
+                    result = Value(toBool(right));
+                    folded = true;
+                }
+                break;
+            }
+            case Expr::CALL: {
+                CallExpr* call = static_cast<CallExpr*>(expr.get());
+                expression(call->callee);
+                for (ExprPtr& arg : call->args) {
+                    expression(arg);
+                }
+                folded = foldCall(call, result);
+                break;
+            }
+            case Expr::INDEX: {
+                IndexExpr* index = static_cast<IndexExpr*>(expr.get());
+                expression(index->object);
+                expression(index->index);
+                break;
+            }
+            case Expr::FIELD:
+                expression(static_cast<FieldExpr*>(expr.get())->object);
+                break;
+            case Expr::INTERPOLATION:
+                folded = foldInterpolation(static_cast<InterpolationExpr*>(expr.get()), result);
+                break;
+            default:
+                break;
+        }
+        if (folded) {
+            ExprPtr replacement = literal(result, expr->line);
+            if (replacement) expr = std::move(replacement);
+        }
+    }
+
+    bool foldBinary(OpCode op, Value& left, const Value& right, Value& result) {
+        if (op >= OP_EQUAL) {
+            result = Value(compare(op, left, right));
+            return true;
+        }
+        if (left.type == Value::NUMBER && right.type == Value::NUMBER) {
+            switch (op) {
+                case OP_ADD: result = Value(left.num + right.num); return true;
+                case OP_SUBTRACT: result = Value(left.num - right.num); return true;
+                case OP_MULTIPLY: result = Value(left.num * right.num); return true;
+                case OP_DIVIDE:
+                    if (right.num == 0) return false;
+                    result = Value(left.num / right.num);
+                    return true;
+                default:
+                    if (right.num == 0) return false;
+                    result = Value(fmod(left.num, right.num));
+                    return true;
+            }
+        }
+        if (op == OP_ADD && left.type == Value::STRING && right.type == Value::STRING) {
+            arithmetic(op, left, right, 0);
+            result = left;
+            return true;
+        }
+        return false;
+    }
+
+    // Adjacent constant parts are joined into one; true if nothing else is left
+    bool foldInterpolation(InterpolationExpr* interpolation, Value& result) {
+        std::vector<ExprPtr> parts;
+        std::string text;
+        bool pending = false;
+        for (ExprPtr& part : interpolation->parts) {
+            expression(part);
+            Value value;
+            if (constant(part.get(), value)) {
+                text += value.toString();
+                pending = true;
+                continue;
+            }
+            if (pending) {
+                parts.push_back(ExprPtr(new StringExpr(text, part->line)));
+                text.clear();
+                pending = false;
+            }
+            parts.push_back(std::move(part));
+        }
+        if (parts.empty()) {
+            result = Value(text);
+            return true;
+        }
+        if (pending) {
+            parts.push_back(ExprPtr(new StringExpr(text, interpolation->line)));
+        }
+        interpolation->parts = std::move(parts);
+        return false;
+    }
+
+    // sqrt(2), len("abc"), ...: pure natives called with constant arguments
+    bool foldCall(const CallExpr* call, Value& result) {
+        if (call->callee->kind != Expr::VARIABLE) return false;
+        Atom name = static_cast<const VariableExpr*>(call->callee.get())->name;
+        if (bound.count(name) || globals.has(name)) return false;
+        int index = NativeRegistry::instance().find(name);
+        if (index < 0) return false;
+        const NativeFunction& native = NativeRegistry::instance().get(index);
+        if (!native.pure || call->args.size() < native.arity) return false;
+
+        std::vector<Value> args(call->args.size());
+        for (size_t i = 0; i < args.size(); i++) {
+            if (!constant(call->args[i].get(), args[i])) return false;
+        }
+        try {
+            result = native.fn(interp, NativeArgs{args.data(), args.size()}, call->line);
+        } catch (const RuntimeError&) {
+            return false;
+        }
+        return true;
+    }
+
+    static bool constant(const Expr* expr, Value& value) {
+        switch (expr->kind) {
+            case Expr::NUMBER:
+                value = Value(static_cast<const NumberExpr*>(expr)->value);
+                return true;
+            case Expr::BOOL:
+                value = Value(static_cast<const BoolExpr*>(expr)->value);
+                return true;
+            case Expr::STRING:
+                value = Value(static_cast<const StringExpr*>(expr)->value);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // The literal node for a folded value, or null if it has no literal form
+    static ExprPtr literal(const Value& value, int line) {
+        switch (value.type) {
+            case Value::NUMBER:
+                return ExprPtr(new NumberExpr(value.num, line));
+            case Value::BOOL:
+                return ExprPtr(new BoolExpr(value.boolean, line));
+            case Value::STRING:
+                return ExprPtr(new StringExpr(value.str(), line));
+            default:
+                return nullptr;
+        }
+    }
+};
+
+// Interpreter - a stack VM executing the bytecode produced by the Compiler
+class Interpreter {
+public:
+    struct CallFrame {
+        const FunctionProto* proto;
+        const uint8_t* ip;
+        size_t stackBase;
+        Value closure;      // the lambda running in this frame, kept alive until it returns
+    };
+
+    struct TryHandler {
+        size_t frameIndex;
+        size_t stackHeight;
+        const uint8_t* catchIp;
+    };
+
+    GlobalTable globalNames;
+    std::vector<Value> globals;
+    // Globals bound by `fn`; like the function table they win over later assignments
+    std::vector<uint8_t> functionGlobals;
+    std::unordered_map<Atom, Function> functions;
+    std::unordered_map<Atom, StructDef> structDefs;
+    std::vector<std::unique_ptr<FunctionProto>> scripts;
+    // Names seen by the main script and the REPL
+    ModuleScope scriptScope;
+    // Whether scripts and modules go through their .chococ cache
+    bool useCache = true;
+    // Modules loaded so far, by resolved path, and the path each module name was loaded from
+    std::unordered_map<std::string, Atom> modules;
+    std::unordered_map<Atom, std::string> modulePaths;
+    // Files opened by open_writer(), by handle; closed (and flushed) with the interpreter
+    std::unordered_map<std::string, std::unique_ptr<FileWriter>> writers;
+    size_t writersOpened = 0;
+    std::vector<Value> stack;
+    std::vector<CallFrame> frames;
+    std::vector<TryHandler> handlers;
+    // Calls run on the frames vector, so recursion depth is bounded by this
+    // limit (CHOCO_MAX_DEPTH) rather than by the C++ stack
+    size_t maxCallDepth = 200000;
+    // Natives calling back into the VM (map, GUI callbacks) do nest on the C++
+    // stack; this bounds how deep such callbacks may go
+    static const size_t MAX_NESTED_RUNS = 500;
+    size_t nestedRuns = 0;
+
+    // Calls a native or user function by name (GUI callbacks, natives passed by name)
+    Value callFunction(const std::string& name, const std::vector<Value>& args, int callLine) {
+        // The script's own functions come first, as they do in compiled calls
+        Atom atom = AtomTable::intern(name);
+        auto it = functions.find(atom);
+        if (it == functions.end()) {
+            int native = NativeRegistry::instance().find(atom);
+            if (native >= 0) {
+                return callNative(NativeRegistry::instance().get(native), NativeArgs{args.data(), args.size()}, callLine);
+            }
+            throw RuntimeError("Undefined function '" + name + "'", callLine);
         }
-        
-        if (name == "uppercase") {
-            if (args.size() == 0) {
-                throw RuntimeError("uppercase() expects 1 argument, got 0", callLine);
+
+        size_t base = stack.size();
+        stack.insert(stack.end(), args.begin(), args.end());
+        callUserFunction(it->second, name, args.size(), base, callLine);
+        return resume(frames.size() - 1);
+    }
+
+    Interpreter() {
+        stack.reserve(256);
+        frames.reserve(64);
+        srand(time(nullptr));
+        if (const char* depth = getenv("CHOCO_MAX_DEPTH")) {
+            size_t limit = strtoul(depth, nullptr, 10);
+            if (limit > 0) maxCallDepth = limit;
+        }
+        // Runtime errors are caught as Error values; scripts may build and throw their own
+        std::vector<Atom> errorFields = {AtomTable::intern("message"), AtomTable::intern("line"),
+                                         AtomTable::intern("trace")};
+        structDefs[errorAtom()] = {errorFields, Shape::get(errorAtom(), errorFields)};
+    }
+
+    void execute(const FunctionProto* script) {
+        try {
+            run(script);
+        } catch (const RuntimeError& e) {
+            // Output so far comes first when both streams go to the same place
+            Output::standard().flush();
+            std::cerr << "\n[Runtime Error] Line " << e.line << ": " << e.what() << std::endl;
+            printTrace(e);
+            throw;
+        } catch (const ParseError& e) {
+            Output::standard().flush();
+            std::cerr << "\n[Parse Error] Line " << e.line << ": " << e.what() << std::endl;
+            throw;
+        }
+    }
+
+    // Traces are only worth printing for errors raised inside a call
+    static void printTrace(const RuntimeError& e) {
+        if (std::count(e.trace.begin(), e.trace.end(), '\n') > 1) {
+            std::cerr << e.trace << std::endl;
+        }
+    }
+
+    // Compiles and runs a parsed program (a REPL line)
+    void run(Block program) {
+        run(compile(program, "<script>", scriptScope));
+    }
+
+    void run(const FunctionProto* script) {
+        size_t savedStack = stack.size();
+        size_t savedFrames = frames.size();
+        size_t savedHandlers = handlers.size();
+        try {
+            runScript(script);
+        } catch (...) {
+            // Leave the VM usable (REPL) after an error escapes mid-call
+            stack.resize(savedStack);
+            frames.resize(savedFrames);
+            handlers.resize(savedHandlers);
+            throw;
+        }
+    }
+
+    // Compiles the main script; its imports are searched for next to it
+    const FunctionProto* loadScript(const std::string& path) {
+        scriptScope.directory = std::filesystem::path(path).parent_path().string();
+        return compileFile(path, "<script>", scriptScope);
+    }
+
+    // Compiles, without running them, the modules script imports and the
+    // modules they import in turn, so their caches are written too
+    void compileImports(const FunctionProto* script, std::unordered_set<std::string>& seen) {
+        const Chunk& chunk = script->chunk;
+        for (size_t ip = 0; ip < chunk.code.size(); ip += 1 + operandBytes(static_cast<OpCode>(chunk.code[ip]))) {
+            if (chunk.code[ip] != OP_IMPORT) continue;
+            Atom name = chunk.constants[(chunk.code[ip + 1] << 8) | chunk.code[ip + 2]].atom();
+            const std::string& directory = chunk.constants[(chunk.code[ip + 3] << 8) | chunk.code[ip + 4]].str();
+            std::string path = findModule(AtomTable::name(name), directory);
+            if (path.empty() || !seen.insert(path).second) continue;
+            ModuleScope scope;
+            scope.module = name;
+            scope.directory = std::filesystem::path(path).parent_path().string();
+            compileImports(compileFile(path, AtomTable::name(name), scope), seen);
+        }
+        for (const auto& function : chunk.functions) {
+            compileImports(function.get(), seen);
+        }
+    }
+
+    // The compiled script at path. It is read from the .chococ file next to
+    // the source when that is current; otherwise the source is compiled and
+    // the cache written.
+    const FunctionProto* compileFile(const std::string& path, const std::string& name, ModuleScope& scope) {
+        CodeCache::Stamp stamp;
+        bool cacheable = useCache && CodeCache::stamp(path, stamp);
+        std::string cachePath = path + "c";
+        if (cacheable) {
+            std::unique_ptr<FunctionProto> cached = CodeCache::load(cachePath, stamp, globalNames);
+            if (cached) return addScript(std::move(cached));
+        }
+
+        // The mapping stays alive until the tokens pointing into it are parsed
+        SourceFile source(path);
+        if (!source.ok()) {
+            throw RuntimeError("Could not read file '" + path + "'", 0);
+        }
+
+        Lexer lexer(source.text());
+        TokenStream tokens = lexer.tokenize();
+        Parser parser(tokens);
+        declareStructs(parser);
+        Block program = parser.parse();
+        const FunctionProto* script = compile(program, name, scope);
+        if (cacheable) {
+            CodeCache::save(cachePath, *script, stamp, globalNames, scope);
+        }
+        return script;
+    }
+
+    // Struct names known to this interpreter, so new parses can recognise their literals
+    void declareStructs(Parser& parser) const {
+        for (const auto& def : structDefs) {
+            parser.declareStruct(def.first);
+        }
+    }
+
+    Value callNative(const NativeFunction& native, NativeArgs args, int callLine) {
+        if (args.size() < native.arity) {
+            throw RuntimeError(NativeRegistry::arityError(native, args.size()), callLine);
+        }
+        return native.fn(*this, args, callLine);
+    }
+
+    // Calls one lambda repeatedly (map, filter, reduce). The arity is checked
+    // and the frame set up once; each call only copies its arguments into the
+    // parameter slots and runs the body.
+    class LambdaCall {
+        Interpreter& interp;
+        CallFrame frame;
+        size_t paramCount;
+        size_t slotCount;
+
+    public:
+        LambdaCall(Interpreter& interpreter, const Value& lambda, size_t argCount, int callLine)
+            : interp(interpreter) {
+            interp.checkLambdaArity(lambda.asLambda()->proto, argCount, callLine);
+            const FunctionProto* proto = lambda.asLambda()->proto;
+            frame = {proto, proto->chunk.code.data(), 0, lambda};
+            paramCount = proto->params.size();
+            slotCount = proto->slotNames.size();
+        }
+
+        Value operator()(const Value* args) {
+            interp.checkCallDepth();
+            frame.stackBase = interp.stack.size();
+            interp.stack.insert(interp.stack.end(), args, args + paramCount);
+            return run();
+        }
+
+        // Moves the arguments in, so a value the caller gives up is not
+        // shared while the lambda runs and can be updated in place
+        Value operator()(Value* args) {
+            interp.checkCallDepth();
+            frame.stackBase = interp.stack.size();
+            interp.stack.insert(interp.stack.end(), std::make_move_iterator(args),
+                                std::make_move_iterator(args + paramCount));
+            return run();
+        }
+
+    private:
+        Value run() {
+            interp.stack.resize(frame.stackBase + slotCount, Value::undefined());
+            interp.frames.push_back(frame);
+            return interp.resume(interp.frames.size() - 1);
+        }
+    };
+
+    Value callLambda(const Value& lambda, const std::vector<Value>& args, int callLine) {
+        return LambdaCall(*this, lambda, args.size(), callLine)(args.data());
+    }
+
+private:
+    const FunctionProto* compile(Block& program, const std::string& name, ModuleScope& scope) {
+        Optimizer(*this, globalNames).program(program);
+        return addScript(Compiler::compileScript(program, name, globalNames, scope));
+    }
+
+    // Compiled scripts are kept alive because functions and lambdas declared
+    // in them point into their chunks
+    const FunctionProto* addScript(std::unique_ptr<FunctionProto> script) {
+        scripts.push_back(std::move(script));
+        globals.resize(globalNames.names.size(), Value::undefined());
+        functionGlobals.resize(globalNames.names.size(), 0);
+        return scripts.back().get();
+    }
+
+    void runScript(const FunctionProto* script) {
+        size_t base = stack.size();
+        stack.resize(base + script->slotNames.size(), Value::undefined());
+        frames.push_back({script, script->chunk.code.data(), base, Value()});
+        resume(frames.size() - 1);
+    }
+
+    // The argCount values above stack[base] become the parameter slots of a new
+    // frame; the caller's dispatch loop picks it up.
+    void callUserFunction(const Function& func, const std::string& name, size_t argCount, size_t base, int callLine) {
+        if (argCount < func.params.size()) {
+            throw RuntimeError("Function '" + name + "' expects " + std::to_string(func.params.size()) +
+                             " arguments, got " + std::to_string(argCount), callLine);
+        }
+
+        checkCallDepth();
+        stack.resize(base + func.params.size());
+        stack.resize(base + func.proto->slotNames.size(), Value::undefined());
+        frames.push_back({func.proto, func.proto->chunk.code.data(), base, Value()});
+    }
+
+    void checkCallDepth() {
+        if (frames.size() >= maxCallDepth) {
+            throw RuntimeError("Maximum call depth of " + std::to_string(maxCallDepth) + " exceeded",
+                               frameLine(frames.back()));
+        }
+    }
+
+    // Line a frame is currently executing; callers save ip before every call
+    static int frameLine(const CallFrame& frame) {
+        const Chunk& chunk = frame.proto->chunk;
+        size_t offset = frame.ip - chunk.code.data();
+        return chunk.lines[offset > 0 ? offset - 1 : 0];
+    }
+
+    // The active calls, innermost first, with the innermost one at line. Long
+    // traces keep their ten innermost and ten outermost calls.
+    std::string stackTrace(int line) const {
+        std::string trace = "Stack trace:";
+        size_t count = frames.size();
+        for (size_t depth = 0; depth < count; depth++) {
+            if (count > 20 && depth == 10) {
+                trace += "\n  ... " + std::to_string(count - 20) + " more calls";
+                depth = count - 10;
+            }
+            const CallFrame& frame = frames[count - 1 - depth];
+            int frameAt = depth == 0 ? line : frameLine(frame);
+            trace += "\n  at " + AtomTable::name(frame.proto->name) + " (line " + std::to_string(frameAt) + ")";
+        }
+        return trace;
+    }
+
+    void checkLambdaArity(const FunctionProto* proto, size_t argCount, int callLine) {
+        if (argCount < proto->params.size()) {
+            throw RuntimeError("Lambda expects " + std::to_string(proto->params.size()) +
+                             " arguments, got " + std::to_string(argCount), callLine);
+        }
+    }
+
+    // Captured variables stay in the lambda and are read from there, so a call
+    // only sets up the parameter and local slots
+    void callClosure(const Value& lambda, size_t argCount, size_t base, int callLine) {
+        const FunctionProto* proto = lambda.asLambda()->proto;
+        checkLambdaArity(proto, argCount, callLine);
+        checkCallDepth();
+        stack.resize(base + proto->params.size());
+        stack.resize(base + proto->slotNames.size(), Value::undefined());
+        frames.push_back({proto, proto->chunk.code.data(), base, lambda});
+    }
+
+    // Runs the dispatch loop until the frame at baseFrame returns. Throws that
+    // escape a nested run (a lambda called from map(), a GUI callback) reach
+    // their handler through ChocoException. Runtime errors unwind as C++
+    // exceptions too and become Error values when a handler catches them, so
+    // code that throws nothing pays nothing for try blocks.
+    Value resume(size_t baseFrame) {
+        NestedRun nested(nestedRuns);
+        if (nestedRuns > MAX_NESTED_RUNS) {
+            frames.resize(baseFrame);
+            throw RuntimeError("Maximum nesting of " + std::to_string(MAX_NESTED_RUNS) + " native callbacks exceeded",
+                               frames.empty() ? 0 : frameLine(frames.back()));
+        }
+        while (true) {
+            try {
+                return dispatch(baseFrame);
+            } catch (const ChocoException& e) {
+                if (handlers.empty() || handlers.back().frameIndex < baseFrame) throw;
+                enterHandler(e.value);
+            } catch (RuntimeError& e) {
+                // The frames are still intact here, whichever run catches first
+                if (e.trace.empty()) e.trace = stackTrace(e.line);
+                if (handlers.empty() || handlers.back().frameIndex < baseFrame) throw;
+                enterHandler(errorValue(e));
             }
-            if (args[0].type != Value::STRING) {
-                throw RuntimeError("uppercase() requires a string, got " + args[0].getType(), callLine);
+        }
+    }
+
+    // Error { message, line, trace }, the value a caught runtime error binds to
+    Value errorValue(const RuntimeError& e) {
+        ObjStruct* error = new ObjStruct(structDefs[errorAtom()].shape);
+        error->slots[0] = Value(std::string(e.what()));
+        error->slots[1] = Value(static_cast<double>(e.line));
+        error->slots[2] = Value(e.trace);
+        return Value(error);
+    }
+
+    static Atom errorAtom() {
+        static const Atom error = AtomTable::intern("Error");
+        return error;
+    }
+
+    struct NestedRun {
+        size_t& depth;
+        explicit NestedRun(size_t& counter) : depth(counter) { depth++; }
+        ~NestedRun() { depth--; }
+    };
+
+    // Calls stack[calleeSlot] with the argCount values above it. A function or
+    // lambda gets a new frame for the dispatch loop to pick up; a native runs
+    // right away and leaves its result in place of the callee. A name is looked
+    // up among the script's functions before the natives.
+    void callValue(size_t calleeSlot, size_t argCount, int line) {
+        Value callee = std::move(stack[calleeSlot]);
+        if (callee.type == Value::STRING) {
+            auto it = functions.find(calleeName(callee));
+            if (it == functions.end()) {
+                int native = NativeRegistry::instance().find(calleeName(callee));
+                if (native < 0) {
+                    throw RuntimeError("Undefined function '" + callee.str() + "'", line);
+                }
+                Value result = callNative(NativeRegistry::instance().get(native),
+                                          NativeArgs{stack.data() + calleeSlot + 1, argCount}, line);
+                stack.resize(calleeSlot);
+                stack.push_back(std::move(result));
+                return;
             }
-            std::string result = args[0].str;
-            std::transform(result.begin(), result.end(), result.begin(), ::toupper);
-            return Value(result);
+            // Shift the arguments down over the callee slot
+            stack.erase(stack.begin() + calleeSlot);
+            callUserFunction(it->second, callee.str(), argCount, calleeSlot, line);
+            return;
         }
-        
-        if (name == "lowercase") {
-            if (args.size() == 0) {
-                throw RuntimeError("lowercase() expects 1 argument, got 0", callLine);
+        if (callee.type == Value::LAMBDA) {
+            stack.erase(stack.begin() + calleeSlot);
+            callClosure(callee, argCount, calleeSlot, line);
+            return;
+        }
+        throw RuntimeError("Cannot call " + callee.getType(), line);
+    }
+
+    // Function values carry their atom; other strings are interned here
+    static Atom calleeName(const Value& callee) {
+        return callee.atom() != NO_ATOM ? callee.atom() : AtomTable::intern(callee.str());
+    }
+
+    bool callsNative(const Value& callee) const {
+        Atom name = calleeName(callee);
+        return !functions.count(name) && NativeRegistry::instance().find(name) >= 0;
+    }
+
+    // Moves the callee and its arguments down over the current frame and drops
+    // the frame, so a tail call takes its place. Returns the new callee slot.
+    size_t dropFrame(size_t calleeSlot) {
+        size_t frameIndex = frames.size() - 1;
+        while (!handlers.empty() && handlers.back().frameIndex >= frameIndex) {
+            handlers.pop_back();
+        }
+        size_t base = frames.back().stackBase;
+        std::move(stack.begin() + calleeSlot, stack.end(), stack.begin() + base);
+        stack.resize(base + (stack.size() - calleeSlot));
+        frames.pop_back();
+        return base;
+    }
+
+    void enterHandler(const Value& thrown) {
+        TryHandler handler = handlers.back();
+        handlers.pop_back();
+        frames.resize(handler.frameIndex + 1);
+        stack.resize(handler.stackHeight);
+        stack.push_back(thrown);
+        frames.back().ip = handler.catchIp;
+    }
+
+    Value index(const Value& val, const Value& index, int bracketLine) {
+        if (val.type == Value::ARRAY) {
+            if (index.type != Value::NUMBER) {
+                throw RuntimeError("Array index must be a number, got " + index.getType(), bracketLine);
+            }
+            int idx = static_cast<int>(index.num);
+            if (idx < 0 || idx >= static_cast<int>(val.array().size())) {
+                throw RuntimeError("Array index " + std::to_string(idx) + " out of bounds (size: " + std::to_string(val.array().size()) + ")", bracketLine);
+            }
+            return val.array()[idx];
+        } else if (val.type == Value::STRING) {
+            if (index.type != Value::NUMBER) {
+                throw RuntimeError("String index must be a number, got " + index.getType(), bracketLine);
+            }
+            int idx = static_cast<int>(index.num);
+            if (idx < 0 || idx >= static_cast<int>(val.str().length())) {
+                throw RuntimeError("String index " + std::to_string(idx) + " out of bounds (length: " + std::to_string(val.str().length()) + ")", bracketLine);
             }
-            if (args[0].type != Value::STRING) {
-                throw RuntimeError("lowercase() requires a string, got " + args[0].getType(), callLine);
+            return characterString(static_cast<unsigned char>(val.str()[idx]));
+        } else if (val.type == Value::FLOAT_ARRAY) {
+            if (index.type != Value::NUMBER) {
+                throw RuntimeError("Array index must be a number, got " + index.getType(), bracketLine);
             }
-            std::string result = args[0].str;
-            std::transform(result.begin(), result.end(), result.begin(), ::tolower);
-            return Value(result);
+            int idx = static_cast<int>(index.num);
+            if (idx < 0 || idx >= static_cast<int>(val.floats().size())) {
+                throw RuntimeError("Array index " + std::to_string(idx) + " out of bounds (size: " + std::to_string(val.floats().size()) + ")", bracketLine);
+            }
+            return Value(val.floats()[idx]);
         }
-        
-        if (name == "substr") {
-            if (args.size() < 3) {
-                throw RuntimeError("substr() expects 3 arguments (string, start, length), got " + std::to_string(args.size()), callLine);
+        throw RuntimeError("Cannot index " + val.getType(), bracketLine);
+    }
+
+    Value makeLambda(const FunctionProto* proto, const CallFrame& creator) {
+        ObjLambda* lambda = new ObjLambda(proto);
+        lambda->captures.reserve(proto->captures.size());
+        for (const Capture& capture : proto->captures) {
+            if (capture.fromUpvalue) {
+                lambda->captures.push_back(creator.closure.asLambda()->captures[capture.index]);
+            } else {
+                lambda->captures.push_back(stack[creator.stackBase + capture.index]);
             }
-            if (args[0].type != Value::STRING) {
-                throw RuntimeError("substr() first argument must be a string, got " + args[0].getType(), callLine);
+        }
+        return Value(lambda);
+    }
+
+    void noField(const ObjStruct* structObj, Atom field, int line) {
+        throw RuntimeError("Struct '" + AtomTable::name(structObj->shape->type) + "' has no field '" +
+                           AtomTable::name(field) + "'", line);
+    }
+
+    // Instances of a literal get the definition's fields in declaration order,
+    // followed by any extra fields the literal sets
+    static void layoutLiteral(const StructLiteralInfo& info, const Shape* defShape) {
+        std::vector<Atom> fields = defShape->fields;
+        info.slots.clear();
+        for (Atom field : info.fields) {
+            int slot = -1;
+            for (size_t i = 0; i < fields.size() && slot < 0; i++) {
+                if (fields[i] == field) slot = static_cast<int>(i);
             }
-            if (args[1].type != Value::NUMBER || args[2].type != Value::NUMBER) {
-                throw RuntimeError("substr() start and length must be numbers", callLine);
+            if (slot < 0) {
+                slot = static_cast<int>(fields.size());
+                fields.push_back(field);
             }
-            int start = static_cast<int>(args[1].num);
-            int length = static_cast<int>(args[2].num);
-            if (start < 0 || start >= static_cast<int>(args[0].str.length())) {
-                throw RuntimeError("substr(): start index out of bounds", callLine);
+            info.slots.push_back(static_cast<uint16_t>(slot));
+        }
+        info.defShape = defShape;
+        info.shape = Shape::get(info.name, fields);
+    }
+
+    void undefinedVariable(Atom name, int line) {
+        throw RuntimeError("Undefined variable '" + AtomTable::name(name) + "'", line);
+    }
+
+    // Slot operand of APPEND_VAR / CONCAT_VAR
+    Value& variable(bool global, uint16_t index, size_t base) {
+        return global ? globals[index] : stack[base + index];
+    }
+
+    // The file a module name resolves to: the importing script's directory
+    // first, then the main script's, then each directory of CHOCO_PATH. Empty
+    // if there is none.
+    std::string findModule(const std::string& module, const std::string& directory) const {
+        std::vector<std::string> searchPath = {directory, scriptScope.directory};
+        if (const char* path = getenv("CHOCO_PATH")) {
+#ifdef _WIN32
+            const char separator = ';';
+#else
+            const char separator = ':';
+#endif
+            std::stringstream entries(path);
+            std::string entry;
+            while (std::getline(entries, entry, separator)) {
+                if (!entry.empty()) searchPath.push_back(entry);
             }
-            return Value(args[0].str.substr(start, length));
         }
-        
-        if (name == "split") {
-            if (args.size() < 2) {
-                throw RuntimeError("split() expects 2 arguments (string, delimiter), got " + std::to_string(args.size()), callLine);
+        for (const std::string& dir : searchPath) {
+            std::filesystem::path file = std::filesystem::path(dir) / (module + ".choco");
+            std::error_code error;
+            if (std::filesystem::is_regular_file(file, error)) {
+                return std::filesystem::canonical(file, error).string();
             }
-            if (args[0].type != Value::STRING || args[1].type != Value::STRING) {
-                throw RuntimeError("split() requires two strings", callLine);
+        }
+        return "";
+    }
+
+    // Runs a module the first time it is imported; later imports, from any
+    // script, only bind its names. A module is marked loaded before it runs,
+    // so import cycles end instead of recursing.
+    void importModule(Atom name, const std::string& directory, int line) {
+        const std::string& module = AtomTable::name(name);
+        std::string path = findModule(module, directory);
+        if (path.empty()) {
+            throw RuntimeError("Could not import module '" + module + "'. File '" + module +
+                               ".choco' not found", line);
+        }
+        if (modules.count(path)) return;
+        auto loaded = modulePaths.find(name);
+        if (loaded != modulePaths.end()) {
+            throw RuntimeError("Could not import module '" + module + "' from '" + path +
+                               "', a module of that name was already loaded from '" + loaded->second + "'", line);
+        }
+
+        modules[path] = name;
+        modulePaths[name] = path;
+        size_t savedStack = stack.size();
+        size_t savedFrames = frames.size();
+        size_t savedHandlers = handlers.size();
+        try {
+            ModuleScope scope;
+            scope.module = name;
+            scope.directory = std::filesystem::path(path).parent_path().string();
+            runScript(compileFile(path, module, scope));
+        } catch (const std::exception& e) {
+            forgetModule(path, savedStack, savedFrames, savedHandlers);
+            throw RuntimeError("Error while importing module '" + module + "': " + e.what(), line);
+        } catch (...) {
+            forgetModule(path, savedStack, savedFrames, savedHandlers);
+            throw RuntimeError("Error while importing module '" + module + "'", line);
+        }
+    }
+
+    // A module that failed to load can be imported again; the error is
+    // reported at the import, so the module's frames are dropped first
+    void forgetModule(const std::string& path, size_t savedStack, size_t savedFrames, size_t savedHandlers) {
+        modulePaths.erase(modules[path]);
+        modules.erase(path);
+        stack.resize(savedStack);
+        frames.resize(savedFrames);
+        handlers.resize(savedHandlers);
+    }
+
+    Value dispatch(size_t baseFrame) {
+        CallFrame* frame = &frames.back();
+        const uint8_t* ip = frame->ip;
+        const Chunk* chunk = &frame->proto->chunk;
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, static_cast<uint16_t>((ip[-2] << 8) | ip[-1]))
+#define READ_STRING() (chunk->constants[READ_SHORT()].str())
+#define READ_ATOM() (chunk->constants[READ_SHORT()].atom())
+#define LINE() (chunk->lines[ip - chunk->code.data() - 1])
+#define SAVE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() \
+        do { \
+            frame = &frames.back(); \
+            ip = frame->ip; \
+            chunk = &frame->proto->chunk; \
+        } while (0)
+
+#if defined(__GNUC__) || defined(__clang__)
+        // Threaded dispatch: every handler jumps straight to the next one
+        static void* dispatchTable[] = {
+#define CHOCO_OPCODE_LABEL(name) &&op_##name,
+            CHOCO_OPCODES(CHOCO_OPCODE_LABEL)
+#undef CHOCO_OPCODE_LABEL
+        };
+#define DISPATCH() goto *dispatchTable[*ip++]
+#define CASE(name) op_##name:
+        DISPATCH();
+#else
+#define DISPATCH() break
+#define CASE(name) case OP_##name:
+        while (true) switch (*ip++) {
+#endif
+
+        CASE(CONSTANT) {
+            const Value& constant = chunk->constants[READ_SHORT()];
+            if (constant.type == Value::NUMBER) {
+                stack.emplace_back(constant.num);
+            } else {
+                stack.push_back(constant);
             }
-            std::vector<Value> result;
-            std::string str = args[0].str;
-            std::string delim = args[1].str;
-            if (delim.empty()) {
-                throw RuntimeError("split(): delimiter cannot be empty", callLine);
+            DISPATCH();
+        }
+        CASE(NIL) {
+            stack.push_back(Value());
+            DISPATCH();
+        }
+        CASE(TRUE) {
+            stack.push_back(Value(true));
+            DISPATCH();
+        }
+        CASE(FALSE) {
+            stack.push_back(Value(false));
+            DISPATCH();
+        }
+        CASE(POP) {
+            stack.pop_back();
+            DISPATCH();
+        }
+        CASE(DUP) {
+            stack.push_back(stack.back());
+            DISPATCH();
+        }
+        CASE(GET_LOCAL) {
+            uint16_t slot = READ_SHORT();
+            const Value& value = stack[frame->stackBase + slot];
+            if (value.type == Value::UNDEFINED) {
+                undefinedVariable(frame->proto->slotNames[slot], LINE());
             }
-            size_t pos = 0;
-            while ((pos = str.find(delim)) != std::string::npos) {
-                result.push_back(Value(str.substr(0, pos)));
-                str.erase(0, pos + delim.length());
+            stack.push_back(value);
+            DISPATCH();
+        }
+        CASE(GET_UPVALUE) {
+            uint16_t index = READ_SHORT();
+            const Value& value = frame->closure.asLambda()->captures[index];
+            if (value.type == Value::UNDEFINED) {
+                undefinedVariable(frame->proto->captures[index].name, LINE());
             }
-            result.push_back(Value(str));
-            return Value(result);
+            stack.push_back(value);
+            DISPATCH();
         }
-        
-        if (name == "join") {
-            if (args.size() < 2) {
-                throw RuntimeError("join() expects 2 arguments (array, separator), got " + std::to_string(args.size()), callLine);
+        CASE(SET_LOCAL) {
+            stack[frame->stackBase + READ_SHORT()] = std::move(stack.back());
+            stack.pop_back();
+            DISPATCH();
+        }
+        CASE(GET_GLOBAL) {
+            uint16_t slot = READ_SHORT();
+            const Value& value = globals[slot];
+            if (value.type == Value::UNDEFINED) {
+                undefinedVariable(globalNames.names[slot], LINE());
             }
-            if (args[0].type != Value::ARRAY) {
-                throw RuntimeError("join() first argument must be an array, got " + args[0].getType(), callLine);
+            stack.push_back(value);
+            DISPATCH();
+        }
+        CASE(SET_GLOBAL) {
+            uint16_t slot = READ_SHORT();
+            if (!functionGlobals[slot]) {
+                globals[slot] = std::move(stack.back());
             }
-            if (args[1].type != Value::STRING) {
-                throw RuntimeError("join() second argument must be a string, got " + args[1].getType(), callLine);
+            stack.pop_back();
+            DISPATCH();
+        }
+        CASE(APPEND_VAR) {
+            bool global = READ_BYTE();
+            uint16_t slot = READ_SHORT();
+            Value& var = variable(global, slot, frame->stackBase);
+            if (var.type == Value::ARRAY) {
+                var.mutableArray().push_back(std::move(stack.back()));
+            } else {
+                if (var.type == Value::UNDEFINED) {
+                    undefinedVariable(global ? globalNames.names[slot] : frame->proto->slotNames[slot], LINE());
+                }
+                std::vector<Value> args;
+                args.push_back(var);
+                args.push_back(std::move(stack.back()));
+                // push() only throws here: its first argument is not an array
+                callFunction("push", args, LINE());
             }
-            std::string result;
-            for (size_t i = 0; i < args[0].array.size(); i++) {
-                result += args[0].array[i].toString();
-                if (i < args[0].array.size() - 1) {
-                    result += args[1].str;
+            stack.pop_back();
+            DISPATCH();
+        }
+        CASE(CONCAT_VAR) {
+            bool global = READ_BYTE();
+            uint16_t slot = READ_SHORT();
+            Value& var = variable(global, slot, frame->stackBase);
+            const Value& right = stack.back();
+            if (var.type == Value::NUMBER && right.type == Value::NUMBER) {
+                var.num += right.num;
+            } else if (var.type == Value::STRING && right.type == Value::STRING) {
+                if (!global || !functionGlobals[slot]) {
+                    var.mutableStr() += right.str();
                 }
+            } else {
+                if (var.type == Value::UNDEFINED) {
+                    undefinedVariable(global ? globalNames.names[slot] : frame->proto->slotNames[slot], LINE());
+                }
+                arithmetic(OP_ADD, var, right, LINE());
             }
-            return Value(result);
+            stack.pop_back();
+            DISPATCH();
         }
-        
-        if (name == "read_file") {
-            if (args.size() == 0) {
-                throw RuntimeError("read_file() expects 1 argument (filename), got 0", callLine);
+        CASE(ADD) CASE(SUBTRACT) CASE(MULTIPLY) CASE(DIVIDE) CASE(MODULO) {
+            OpCode op = static_cast<OpCode>(ip[-1]);
+            Value& left = stack[stack.size() - 2];
+            const Value& right = stack.back();
+            if (left.type == Value::NUMBER && right.type == Value::NUMBER) {
+                switch (op) {
+                    case OP_ADD: left.num += right.num; break;
+                    case OP_SUBTRACT: left.num -= right.num; break;
+                    case OP_MULTIPLY: left.num *= right.num; break;
+                    case OP_DIVIDE:
+                        if (right.num == 0) throw RuntimeError("Division by zero", LINE());
+                        left.num /= right.num;
+                        break;
+                    default:
+                        if (right.num == 0) throw RuntimeError("Modulo by zero", LINE());
+                        left.num = fmod(left.num, right.num);
+                        break;
+                }
+            } else {
+                arithmetic(op, left, right, LINE());
             }
-            if (args[0].type != Value::STRING) {
-                throw RuntimeError("read_file() requires a string filename, got " + args[0].getType(), callLine);
+            stack.pop_back();
+            DISPATCH();
+        }
+        CASE(NEGATE) {
+            Value& val = stack.back();
+            if (val.type != Value::NUMBER) {
+                throw RuntimeError("Cannot negate " + val.getType(), LINE());
             }
-            std::ifstream file(args[0].str);
-            if (!file) {
-                throw RuntimeError("read_file(): cannot open file '" + args[0].str + "'", callLine);
+            val.num = -val.num;
+            DISPATCH();
+        }
+        CASE(NOT) {
+            Value& val = stack.back();
+            val = Value(val.type == Value::BOOL ? !val.boolean : false);
+            DISPATCH();
+        }
+        CASE(EQUAL) CASE(NOT_EQUAL) CASE(LESS) CASE(GREATER) CASE(LESS_EQUAL) CASE(GREATER_EQUAL) {
+            Value& left = stack[stack.size() - 2];
+            bool result = compare(static_cast<OpCode>(ip[-1]), left, stack.back());
+            stack.pop_back();
+            if (left.type == Value::NUMBER || left.type == Value::BOOL) {
+                left.type = Value::BOOL;
+                left.boolean = result;
+            } else {
+                left = Value(result);
             }
-            std::stringstream buffer;
-            buffer << file.rdbuf();
-            return Value(buffer.str());
+            DISPATCH();
         }
-        
-        if (name == "write_file") {
-            if (args.size() < 2) {
-                throw RuntimeError("write_file() expects 2 arguments (filename, content), got " + std::to_string(args.size()), callLine);
+        CASE(MATCH_EQUAL) {
+            bool result = valuesMatch(stack[stack.size() - 2], stack.back());
+            stack.pop_back();
+            stack.push_back(Value(result));
+            DISPATCH();
+        }
+        CASE(TO_BOOL) {
+            Value& val = stack.back();
+            if (val.type != Value::BOOL) val = Value(toBool(val));
+            DISPATCH();
+        }
+        CASE(JUMP) {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(JUMP_IF_FALSE) {
+            uint16_t offset = READ_SHORT();
+            if (!isTruthy(stack.back())) ip += offset;
+            stack.pop_back();
+            DISPATCH();
+        }
+        CASE(JUMP_UNLESS_TRUE) {
+            uint16_t offset = READ_SHORT();
+            const Value& cond = stack.back();
+            if (!(cond.type == Value::BOOL && cond.boolean)) ip += offset;
+            stack.pop_back();
+            DISPATCH();
+        }
+        CASE(JUMP_IF_FALSE_KEEP) {
+            uint16_t offset = READ_SHORT();
+            if (!stack.back().boolean) ip += offset;
+            DISPATCH();
+        }
+        CASE(JUMP_IF_TRUE_KEEP) {
+            uint16_t offset = READ_SHORT();
+            if (stack.back().boolean) ip += offset;
+            DISPATCH();
+        }
+        CASE(LOOP) {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            DISPATCH();
+        }
+        CASE(FOR_PREP) {
+            Value& start = stack[stack.size() - 2];
+            Value& end = stack.back();
+            if (start.type != Value::NUMBER || end.type != Value::NUMBER) {
+                throw RuntimeError("For loop range must be numbers", LINE());
+            }
+            start.num = static_cast<int>(start.num);
+            end.num = static_cast<int>(end.num);
+            DISPATCH();
+        }
+        CASE(FOR_ITER) {
+            uint16_t offset = READ_SHORT();
+            Value& counter = stack[stack.size() - 2];
+            if (counter.num < stack.back().num) {
+                double value = counter.num;
+                counter.num += 1;
+                stack.emplace_back(value);
+            } else {
+                ip += offset;
             }
-            if (args[0].type != Value::STRING || args[1].type != Value::STRING) {
-                throw RuntimeError("write_file() requires two strings", callLine);
+            DISPATCH();
+        }
+        CASE(ARRAY) {
+            uint16_t count = READ_SHORT();
+            std::vector<Value> arr(std::make_move_iterator(stack.end() - count), std::make_move_iterator(stack.end()));
+            stack.resize(stack.size() - count);
+            stack.push_back(Value(arr));
+            DISPATCH();
+        }
+        CASE(STRUCT) {
+            const StructLiteralInfo& info = chunk->structLiterals[READ_SHORT()];
+            auto def = structDefs.find(info.name);
+            if (def == structDefs.end()) {
+                throw RuntimeError("Undefined struct '" + AtomTable::name(info.name) + "'", LINE());
             }
-            std::ofstream file(args[0].str);
-            if (!file) {
-                throw RuntimeError("write_file(): cannot open file '" + args[0].str + "' for writing", callLine);
+            if (info.defShape != def->second.shape) {
+                layoutLiteral(info, def->second.shape);
             }
-            file << args[1].str;
-            return Value(true);
+            ObjStruct* structObj = new ObjStruct(info.shape);
+            size_t first = stack.size() - info.fields.size();
+            for (size_t i = 0; i < info.fields.size(); i++) {
+                structObj->slots[info.slots[i]] = std::move(stack[first + i]);
+            }
+            stack.resize(first);
+            stack.push_back(Value(structObj));
+            DISPATCH();
         }
-        
-        if (name == "append_file") {
-            if (args.size() < 2) {
-                throw RuntimeError("append_file() expects 2 arguments (filename, content), got " + std::to_string(args.size()), callLine);
+        CASE(LAMBDA) {
+            stack.push_back(makeLambda(chunk->functions[READ_SHORT()].get(), *frame));
+            DISPATCH();
+        }
+        CASE(INTERPOLATE) {
+            // Sized up front from the string parts; other values are written
+            // into the result directly
+            uint16_t count = READ_SHORT();
+            size_t first = stack.size() - count;
+            size_t length = 0;
+            for (size_t i = first; i < stack.size(); i++) {
+                length += stack[i].type == Value::STRING ? stack[i].str().size() : NumberText::MAX_LENGTH;
+            }
+            std::string result;
+            result.reserve(length);
+            for (size_t i = first; i < stack.size(); i++) {
+                stack[i].appendTo(result);
+            }
+            stack.resize(first);
+            stack.push_back(Value(std::move(result)));
+            DISPATCH();
+        }
+        CASE(INDEX) {
+            Value result = index(stack[stack.size() - 2], stack.back(), LINE());
+            stack.pop_back();
+            stack.back() = std::move(result);
+            DISPATCH();
+        }
+        CASE(GET_FIELD) {
+            Atom field = READ_ATOM();
+            FieldCache& cache = chunk->fieldCaches[READ_SHORT()];
+            Value& val = stack.back();
+            if (val.type != Value::STRUCT) {
+                throw RuntimeError("Cannot access field on " + val.getType(), LINE());
             }
-            if (args[0].type != Value::STRING || args[1].type != Value::STRING) {
-                throw RuntimeError("append_file() requires two strings", callLine);
+            const ObjStruct* structObj = val.asStruct();
+            if (structObj->shape != cache.shape) {
+                int slot = structObj->shape->slot(field);
+                if (slot < 0) noField(structObj, field, LINE());
+                cache = {structObj->shape, static_cast<uint16_t>(slot)};
             }
-            std::ofstream file(args[0].str, std::ios::app);
-            if (!file) {
-                throw RuntimeError("append_file(): cannot open file '" + args[0].str + "' for appending", callLine);
+            const Value& fieldValue = structObj->slots[cache.slot];
+            if (fieldValue.type == Value::UNDEFINED) noField(structObj, field, LINE());
+            Value result = fieldValue;
+            val = std::move(result);
+            DISPATCH();
+        }
+        CASE(CALL) {
+            uint8_t argCount = READ_BYTE();
+            SAVE_FRAME();
+            callValue(stack.size() - argCount - 1, argCount, LINE());
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(TAIL_CALL) {
+            // Natives have no frame to reuse; their result is returned by the
+            // RETURN that follows
+            uint8_t argCount = READ_BYTE();
+            int line = LINE();
+            size_t calleeSlot = stack.size() - argCount - 1;
+            const Value& callee = stack[calleeSlot];
+            SAVE_FRAME();
+            if (callee.type == Value::LAMBDA || (callee.type == Value::STRING && !callsNative(callee))) {
+                calleeSlot = dropFrame(calleeSlot);
             }
-            file << args[1].str;
-            return Value(true);
+            callValue(calleeSlot, argCount, line);
+            LOAD_FRAME();
+            DISPATCH();
         }
-        
-        if (name == "file_exists") {
-            if (args.size() == 0) {
-                throw RuntimeError("file_exists() expects 1 argument (filename), got 0", callLine);
+        CASE(CALL_NATIVE) {
+            const NativeFunction& native = NativeRegistry::instance().get(READ_SHORT());
+            uint8_t argCount = READ_BYTE();
+            size_t base = stack.size() - argCount;
+            SAVE_FRAME();
+            Value result = callNative(native, NativeArgs{stack.data() + base, argCount}, LINE());
+            LOAD_FRAME();
+            stack.resize(base);
+            stack.push_back(std::move(result));
+            DISPATCH();
+        }
+        CASE(RETURN) {
+            Value result = std::move(stack.back());
+            size_t frameIndex = frames.size() - 1;
+            while (!handlers.empty() && handlers.back().frameIndex >= frameIndex) {
+                handlers.pop_back();
             }
-            if (args[0].type != Value::STRING) {
-                throw RuntimeError("file_exists() requires a string filename, got " + args[0].getType(), callLine);
+            stack.resize(frame->stackBase);
+            frames.pop_back();
+            if (frameIndex == baseFrame) {
+                return result;
             }
-            std::ifstream file(args[0].str);
-            return Value(file.good());
+            stack.push_back(std::move(result));
+            LOAD_FRAME();
+            DISPATCH();
         }
-        
-        if (name == "input") {
-            // input() - read a line from stdin
-            // input(prompt) - print prompt then read a line
-            std::string prompt = "";
-            if (args.size() > 0) {
-                if (args[0].type != Value::STRING) {
-                    throw RuntimeError("input() prompt must be a string, got " + args[0].getType(), callLine);
-                }
-                prompt = args[0].str;
+        CASE(PUTS) {
+            Output& out = Output::standard();
+            out.write(stack.back());
+            out.write('\n');
+            out.done();
+            stack.pop_back();
+            DISPATCH();
+        }
+        CASE(DEFINE_FUNCTION) {
+            const FunctionProto* proto = chunk->functions[READ_SHORT()].get();
+            uint16_t slot = READ_SHORT();
+            functions[proto->name] = {proto->params, proto};
+            // The name is stored as a global so the function can be referenced
+            globals[slot] = Value::fromAtom(proto->name);
+            functionGlobals[slot] = 1;
+            DISPATCH();
+        }
+        CASE(DEFINE_STRUCT) {
+            const StructLiteralInfo& def = chunk->structDefs[READ_SHORT()];
+            structDefs[def.name] = {def.fields, Shape::get(def.name, def.fields)};
+            DISPATCH();
+        }
+        CASE(IMPORT) {
+            Atom module = chunk->constants[READ_SHORT()].atom();
+            const std::string& directory = READ_STRING();
+            SAVE_FRAME();
+            importModule(module, directory, LINE());
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(TRY_BEGIN) {
+            uint16_t offset = READ_SHORT();
+            handlers.push_back({frames.size() - 1, stack.size(), ip + offset});
+            DISPATCH();
+        }
+        CASE(TRY_END) {
+            handlers.pop_back();
+            DISPATCH();
+        }
+        CASE(THROW) {
+            // Any value can be thrown and is caught unchanged
+            Value thrown = std::move(stack.back());
+            stack.pop_back();
+            if (handlers.empty()) {
+                throw RuntimeError("Uncaught exception: " + thrown.toString(), LINE());
             }
-            
-            if (!prompt.empty()) {
-                std::cout << prompt;
-                std::cout.flush();
+            if (handlers.back().frameIndex < baseFrame) {
+                SAVE_FRAME();
+                throw ChocoException(thrown);
             }
-            
-            std::string line;
-            if (std::getline(std::cin, line)) {
-                return Value(line);
-            } else {
-                return Value("");
-            }
-        }
-
-        ChocoGUI* gui = ChocoGUI::getInstance(0, nullptr);
-        gui->setInterpreter(this);
-
-        if (name == "gui_init") return gui->gui_init(args, callLine);
-        if (name == "gui_window") return gui->gui_window(args, callLine);
-        if (name == "gui_button") return gui->gui_button(args, callLine);
-        if (name == "gui_label") return gui->gui_label(args, callLine);
-        if (name == "gui_entry") return gui->gui_entry(args, callLine);
-        if (name == "gui_box") return gui->gui_box(args, callLine);
-        if (name == "gui_add") return gui->gui_add(args, callLine);
-        if (name == "gui_set_text") return gui->gui_set_text(args, callLine);
-        if (name == "gui_get_text") return gui->gui_get_text(args, callLine);
-        if (name == "gui_on") return gui->gui_on(args, callLine);
-        if (name == "gui_show") return gui->gui_show(args, callLine);
-        if (name == "gui_run") return gui->gui_run(args, callLine);
-        if (name == "gui_quit") return gui->gui_quit(args, callLine);
-        if (name == "gui_checkbox") return gui->gui_checkbox(args, callLine);
-        if (name == "gui_textview") return gui->gui_textview(args, callLine);
-        if (name == "gui_frame") return gui->gui_frame(args, callLine);
-        if (name == "gui_separator") return gui->gui_separator(args, callLine);
-        if (name == "gui_set_sensitive") return gui->gui_set_sensitive(args, callLine);
-        if (name == "gui_get_checked") return gui->gui_get_checked(args, callLine);
-        if (name == "gui_set_checked") return gui->gui_set_checked(args, callLine);
-        // User-defined functions
-        auto it = functions.find(name);
-        if (it == functions.end()) {
-            throw RuntimeError("Undefined function '" + name + "'", callLine);
+            enterHandler(thrown);
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+#if !defined(__GNUC__) && !defined(__clang__)
+        }
+#endif
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_STRING
+#undef READ_ATOM
+#undef LINE
+#undef SAVE_FRAME
+#undef LOAD_FRAME
+#undef DISPATCH
+#undef CASE
+        return Value();
+    }
+};
+
+//////////////////////////////////////
+// Builtin natives
+//////////////////////////////////////
+
+// Higher-order functions
+// The arguments live on the interpreter stack, which a lambda call may grow,
+// so they are copied before calling back.
+static Value native_map(Interpreter& interp, NativeArgs args, int callLine) {
+    if (args[0].type != Value::ARRAY) {
+        throw RuntimeError("map() first argument must be an array, got " + args[0].getType(), callLine);
+    }
+    if (args[1].type != Value::LAMBDA) {
+        throw RuntimeError("map() second argument must be a lambda, got " + args[1].getType(), callLine);
+    }
+    Value array = args[0];
+    Value fn = args[1];
+    std::vector<Value> result;
+    result.reserve(array.array().size());
+    Interpreter::LambdaCall call(interp, fn, 1, callLine);
+    for (const auto& item : array.array()) {
+        result.push_back(call(&item));
+    }
+    return Value(result);
+}
+
+static Value native_filter(Interpreter& interp, NativeArgs args, int callLine) {
+    if (args[0].type != Value::ARRAY) {
+        throw RuntimeError("filter() first argument must be an array, got " + args[0].getType(), callLine);
+    }
+    if (args[1].type != Value::LAMBDA) {
+        throw RuntimeError("filter() second argument must be a lambda, got " + args[1].getType(), callLine);
+    }
+    Value array = args[0];
+    Value fn = args[1];
+    std::vector<Value> result;
+    Interpreter::LambdaCall call(interp, fn, 1, callLine);
+    for (const auto& item : array.array()) {
+        Value condition = call(&item);
+        if (condition.type == Value::BOOL && condition.boolean) {
+            result.push_back(item);
         }
+    }
+    return Value(result);
+}
+
+static Value native_reduce(Interpreter& interp, NativeArgs args, int callLine) {
+    if (args[0].type != Value::ARRAY) {
+        throw RuntimeError("reduce() first argument must be an array, got " + args[0].getType(), callLine);
+    }
+    if (args[2].type != Value::LAMBDA) {
+        throw RuntimeError("reduce() third argument must be a lambda, got " + args[2].getType(), callLine);
+    }
+    Value array = args[0];
+    Value fn = args[2];
+    Value accumulator = args[1];
+    Interpreter::LambdaCall call(interp, fn, 2, callLine);
+    for (const auto& item : array.array()) {
+        Value lambdaArgs[] = {std::move(accumulator), item};
+        accumulator = call(lambdaArgs);
+    }
+    return accumulator;
+}
+
+static Value native_typeof(Interpreter&, NativeArgs args, int) {
+    return Value(args[0].getType());
+}
+
+// Standard library functions
+static Value native_len(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type == Value::ARRAY) {
+        return Value(static_cast<double>(args[0].array().size()));
+    } else if (args[0].type == Value::FLOAT_ARRAY) {
+        return Value(static_cast<double>(args[0].floats().size()));
+    } else if (const std::string* text = textOf(args[0])) {
+        return Value(static_cast<double>(text->length()));
+    }
+    throw RuntimeError("len() requires array or string, got " + args[0].getType(), callLine);
+}
 
-        Function& func = it->second;
-        
-        if (args.size() < func.params.size()) {
-            throw RuntimeError("Function '" + name + "' expects " + std::to_string(func.params.size()) + 
-                             " arguments, got " + std::to_string(args.size()), callLine);
-        }
-        
-        scopes.push_back(std::unordered_map<std::string, Value>());
-        
-        for (size_t i = 0; i < func.params.size() && i < args.size(); i++) {
-            scopes.back()[func.params[i]] = args[i];
-        }
+static Value native_push(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::ARRAY) {
+        throw RuntimeError("push() first argument must be an array, got " + args[0].getType(), callLine);
+    }
+    std::vector<Value> items = args[0].array();
+    items.push_back(args[1]);
+    return Value(std::move(items));
+}
 
-        size_t savedCurrent = current;
-        current = func.bodyStart;
-        bool wasInFunction = inFunction;
-        inFunction = true;
-        hasReturned = false;
-        returnValue = Value();
+static Value native_pop(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::ARRAY) {
+        throw RuntimeError("pop() requires an array, got " + args[0].getType(), callLine);
+    }
+    if (args[0].array().empty()) {
+        throw RuntimeError("Cannot pop from empty array", callLine);
+    }
+    return args[0].array().back();
+}
 
-        while (current < func.bodyEnd && !isAtEnd() && !hasReturned) {
-            statement();
-        }
+static Value native_sqrt(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::NUMBER) {
+        throw RuntimeError("sqrt() requires a number, got " + args[0].getType(), callLine);
+    }
+    if (args[0].num < 0) {
+        throw RuntimeError("sqrt() of negative number", callLine);
+    }
+    return Value(sqrt(args[0].num));
+}
 
-        Value result = returnValue;
-        hasReturned = false;
-        inFunction = wasInFunction;
-        
-        scopes.pop_back();
-        
-        current = savedCurrent;
-        return result;
+static Value native_pow(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
+        throw RuntimeError("pow() requires two numbers", callLine);
     }
+    return Value(pow(args[0].num, args[1].num));
+}
 
-    Interpreter(const std::vector<Token>& toks) : tokens(toks), current(0), 
-        inFunction(false), inLoop(false), hasReturned(false), shouldBreak(false), 
-        shouldContinue(false), inTryCatch(false) {
-        scopes.push_back(std::unordered_map<std::string, Value>());
-        scopes.reserve(16);
-        srand(time(nullptr));
+static Value native_abs(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::NUMBER) {
+        throw RuntimeError("abs() requires a number, got " + args[0].getType(), callLine);
     }
+    return Value(fabs(args[0].num));
+}
 
-    void execute() {
-        try {
-            while (!isAtEnd()) {
-                statement();
-            }
-        } catch (const RuntimeError& e) {
-            std::cerr << "\n[Runtime Error] Line " << e.line << ": " << e.what() << std::endl;
-            throw;
-        } catch (const ParseError& e) {
-            std::cerr << "\n[Parse Error] Line " << e.line << ": " << e.what() << std::endl;
-            throw;
-        }
+static Value native_floor(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::NUMBER) {
+        throw RuntimeError("floor() requires a number, got " + args[0].getType(), callLine);
     }
-    
-    inline bool isAtEnd() const { 
-        return tokens.empty() || current >= tokens.size() || tokens[current].type == TOKEN_EOF; 
+    return Value(floor(args[0].num));
+}
+
+static Value native_ceil(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::NUMBER) {
+        throw RuntimeError("ceil() requires a number, got " + args[0].getType(), callLine);
     }
+    return Value(ceil(args[0].num));
+}
 
-    inline Token peek() const { 
-        if (current >= tokens.size()) {
-            return {TOKEN_EOF, "", tokens.empty() ? 1 : tokens.back().line};
-        }
-        return tokens[current]; 
+static Value native_round(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::NUMBER) {
+        throw RuntimeError("round() requires a number, got " + args[0].getType(), callLine);
     }
-    
-    inline Token advance() { 
-        if (current >= tokens.size()) {
-            throw ParseError("Unexpected end of file", tokens.empty() ? 1 : tokens.back().line);
-        }
-        return tokens[current++]; 
+    return Value(round(args[0].num));
+}
+
+static Value native_min(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
+        throw RuntimeError("min() requires two numbers", callLine);
     }
-    
-    inline bool match(TokenType type) {
-        if (peek().type == type) {
-            advance();
-            return true;
-        }
-        return false;
+    return Value(std::min(args[0].num, args[1].num));
+}
+
+static Value native_max(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
+        throw RuntimeError("max() requires two numbers", callLine);
     }
-    
-    void expect(TokenType type, const std::string& message) {
-        if (!match(type)) {
-            throw ParseError(message, peek().line);
-        }
+    return Value(std::max(args[0].num, args[1].num));
+}
+
+static Value native_random(Interpreter&, NativeArgs, int) {
+    return Value(static_cast<double>(rand()) / RAND_MAX);
+}
+
+static Value native_random_int(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
+        throw RuntimeError("random_int() requires two numbers", callLine);
     }
+    int min = static_cast<int>(args[0].num);
+    int max = static_cast<int>(args[1].num);
+    if (min > max) {
+        throw RuntimeError("random_int(): min cannot be greater than max", callLine);
+    }
+    return Value(static_cast<double>(min + rand() % (max - min + 1)));
+}
 
-    inline bool isBuiltinFunction(const std::string& name) const {
-        return builtinFunctions.find(name) != builtinFunctions.end();
+static Value native_str(Interpreter&, NativeArgs args, int) {
+    if (args.size() == 0) {
+        return Value("");
     }
+    return Value(args[0].toString());
+}
 
-    void setVariable(const std::string& name, const Value& val) {
-        for (int i = scopes.size() - 1; i >= 0; i--) {
-            if (scopes[i].find(name) != scopes[i].end()) {
-                scopes[i][name] = val;
-                return;
-            }
+static Value native_int(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type == Value::NUMBER) {
+        return Value(std::trunc(args[0].num));
+    } else if (args[0].type == Value::STRING) {
+        double value;
+        if (!NumberText::parseInteger(args[0].str(), value)) {
+            throw RuntimeError("int(): cannot convert '" + args[0].str() + "' to integer", callLine);
         }
-        scopes.back()[name] = val;
+        return Value(value);
     }
+    throw RuntimeError("int() requires number or string, got " + args[0].getType(), callLine);
+}
 
-    Value getVariable(const std::string& name) {
-        for (int i = scopes.size() - 1; i >= 0; i--) {
-            auto it = scopes[i].find(name);
-            if (it != scopes[i].end()) {
-                return it->second;
-            }
-        }
-        auto it = globalVars.find(name);
-        if (it != globalVars.end()) {
-            return it->second;
+static Value native_float(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type == Value::STRING) {
+        double value;
+        if (!NumberText::parse(args[0].str(), value)) {
+            throw RuntimeError("float(): cannot convert '" + args[0].str() + "' to float", callLine);
         }
-        throw RuntimeError("Undefined variable '" + name + "'", peek().line);
+        return Value(value);
+    } else if (args[0].type == Value::NUMBER) {
+        return args[0];
     }
+    throw RuntimeError("float() requires number or string, got " + args[0].getType(), callLine);
+}
 
-    void statement() {
-        if (hasReturned || shouldBreak || shouldContinue) return;
-
-        if (match(TOKEN_LET)) {
-            letStatement();
-        } else if (match(TOKEN_FN)) {
-            functionDeclaration();
-        } else if (match(TOKEN_STRUCT)) {
-            structDeclaration();
-        } else if (match(TOKEN_IMPORT)) {
-            importStatement();
-        } else if (match(TOKEN_TRY)) {
-            tryStatement();
-        } else if (match(TOKEN_THROW)) {
-            throwStatement();
-        } else if (match(TOKEN_BREAK)) {
-            if (!inLoop) {
-                throw RuntimeError("'break' can only be used inside loops", tokens[current - 1].line);
-            }
-            shouldBreak = true;
-            match(TOKEN_SEMICOLON);
-        } else if (match(TOKEN_CONTINUE)) {
-            if (!inLoop) {
-                throw RuntimeError("'continue' can only be used inside loops", tokens[current - 1].line);
-            }
-            shouldContinue = true;
-            match(TOKEN_SEMICOLON);
-        } else if (match(TOKEN_PUTS)) {
-            putsStatement();
-        } else if (match(TOKEN_IF)) {
-            ifStatement();
-        } else if (match(TOKEN_WHILE)) {
-            whileStatement();
-        } else if (match(TOKEN_FOR)) {
-            forStatement();
-        } else if (match(TOKEN_MATCH)) {
-            matchStatement();
-        } else if (match(TOKEN_RETURN)) {
-            if (!inFunction) {
-                throw RuntimeError("'return' can only be used inside functions", tokens[current - 1].line);
-            }
-            returnStatement();
-        } else if (peek().type == TOKEN_IDENTIFIER && current + 1 < tokens.size() && tokens[current + 1].type == TOKEN_EQUAL) {
-            Token name = advance();
-            match(TOKEN_EQUAL);
-            Value val = expression();
-            setVariable(name.value, val);
-            expect(TOKEN_SEMICOLON, "Expected ';' after assignment");
+// parse_numbers(array, fallback) reads every string in the array as float()
+// would. Numbers are kept; anything that does not parse becomes fallback (nil
+// if not given) instead of raising an error.
+static Value native_parse_numbers(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::ARRAY) {
+        throw RuntimeError("parse_numbers() requires an array, got " + args[0].getType(), callLine);
+    }
+    Value fallback = args.size() > 1 ? args[1] : Value();
+    const std::vector<Value>& items = args[0].array();
+    std::vector<Value> result;
+    result.reserve(items.size());
+    for (const Value& item : items) {
+        double value;
+        if (item.type == Value::NUMBER) {
+            result.push_back(item);
+        } else if (item.type == Value::STRING && NumberText::parse(item.str(), value)) {
+            result.push_back(Value(value));
         } else {
-            expression();
-            expect(TOKEN_SEMICOLON, "Expected ';' after expression");
+            result.push_back(fallback);
         }
     }
+    return Value(std::move(result));
+}
 
-    void letStatement() {
-        if (peek().type != TOKEN_IDENTIFIER) {
-            throw ParseError("Expected variable name after 'let'", peek().line);
-        }
-        Token name = advance();
-        expect(TOKEN_EQUAL, "Expected '=' after variable name");
-        Value val = expression();
-        setVariable(name.value, val);
-        expect(TOKEN_SEMICOLON, "Expected ';' after variable declaration");
+static Value native_uppercase(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING) {
+        throw RuntimeError("uppercase() requires a string, got " + args[0].getType(), callLine);
     }
+    std::string result = args[0].str();
+    std::transform(result.begin(), result.end(), result.begin(), ::toupper);
+    return Value(result);
+}
 
-    void functionDeclaration() {
-        if (peek().type != TOKEN_IDENTIFIER) {
-            throw ParseError("Expected function name after 'fn'", peek().line);
-        }
-        Token name = advance();
-        expect(TOKEN_LPAREN, "Expected '(' after function name");
-        
-        std::vector<std::string> params;
-        while (!match(TOKEN_RPAREN)) {
-            if (peek().type != TOKEN_IDENTIFIER) {
-                throw ParseError("Expected parameter name", peek().line);
-            }
-            Token param = advance();
-            params.push_back(std::move(param.value));
-            if (!match(TOKEN_COMMA)) {
-                expect(TOKEN_RPAREN, "Expected ')' or ',' in parameter list");
-                break;
-            }
-        }
+static Value native_lowercase(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING) {
+        throw RuntimeError("lowercase() requires a string, got " + args[0].getType(), callLine);
+    }
+    std::string result = args[0].str();
+    std::transform(result.begin(), result.end(), result.begin(), ::tolower);
+    return Value(result);
+}
 
-        expect(TOKEN_LBRACE, "Expected '{' before function body");
-        size_t bodyStart = current;
-        
-        int braceCount = 1;
-        while (braceCount > 0 && !isAtEnd()) {
-            if (tokens[current].type == TOKEN_LBRACE) braceCount++;
-            if (tokens[current].type == TOKEN_RBRACE) braceCount--;
-            current++;
-        }
-        
-        if (braceCount != 0) {
-            throw ParseError("Unclosed function body", name.line);
-        }
-        
-        size_t bodyEnd = current - 1;
-        functions[name.value] = {std::move(params), bodyStart, bodyEnd};
-        
-        // Store function name as a variable so it can be referenced
-        setVariable(name.value, Value(name.value));
+static Value native_substr(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING) {
+        throw RuntimeError("substr() first argument must be a string, got " + args[0].getType(), callLine);
     }
+    if (args[1].type != Value::NUMBER || args[2].type != Value::NUMBER) {
+        throw RuntimeError("substr() start and length must be numbers", callLine);
+    }
+    int start = static_cast<int>(args[1].num);
+    int length = static_cast<int>(args[2].num);
+    if (start < 0 || start >= static_cast<int>(args[0].str().length())) {
+        throw RuntimeError("substr(): start index out of bounds", callLine);
+    }
+    std::string_view text = std::string_view(args[0].str()).substr(start, length);
+    // The whole string is the same value, not a copy
+    if (text.size() == args[0].str().size()) return args[0];
+    return stringValue(text);
+}
 
-    void structDeclaration() {
-        if (peek().type != TOKEN_IDENTIFIER) {
-            throw ParseError("Expected struct name after 'struct'", peek().line);
-        }
-        Token name = advance();
-        expect(TOKEN_LBRACE, "Expected '{' after struct name");
-        
-        std::vector<std::string> fields;
-        while (!match(TOKEN_RBRACE)) {
-            if (peek().type != TOKEN_IDENTIFIER) {
-                throw ParseError("Expected field name in struct", peek().line);
-            }
-            Token field = advance();
-            fields.push_back(std::move(field.value));
-            if (!match(TOKEN_COMMA)) {
-                expect(TOKEN_RBRACE, "Expected '}' or ',' in struct definition");
-                break;
-            }
-        }
-        
-        structDefs[name.value] = {std::move(fields)};
+// The string is scanned once, and each piece is copied straight out of it
+static Value native_split(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING || args[1].type != Value::STRING) {
+        throw RuntimeError("split() requires two strings", callLine);
+    }
+    std::string_view str = args[0].str();
+    std::string_view delim = args[1].str();
+    if (delim.empty()) {
+        throw RuntimeError("split(): delimiter cannot be empty", callLine);
+    }
+    std::vector<Value> result;
+    size_t start = 0;
+    size_t pos;
+    while ((pos = str.find(delim, start)) != std::string_view::npos) {
+        result.push_back(stringValue(str.substr(start, pos - start)));
+        start = pos + delim.size();
     }
+    result.push_back(stringValue(str.substr(start)));
+    return Value(std::move(result));
+}
 
-    void importStatement() {
-        if (peek().type != TOKEN_IDENTIFIER) {
-            throw ParseError("Expected module name after 'import'", peek().line);
+// find(string, text, start) is the index of the first text at or after start, or -1
+static Value native_find(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING || args[1].type != Value::STRING) {
+        throw RuntimeError("find() requires two strings", callLine);
+    }
+    size_t start = 0;
+    if (args.size() > 2) {
+        if (args[2].type != Value::NUMBER || args[2].num < 0) {
+            throw RuntimeError("find() start must be a number of at least 0", callLine);
         }
-        Token module = advance();
-        expect(TOKEN_SEMICOLON, "Expected ';' after import statement");
-        
-        std::string filename = module.value + ".choco";
-        std::ifstream file(filename);
-        if (!file) {
-            throw RuntimeError("Could not import module '" + module.value + "'. File '" + filename + "' not found", module.line);
+        start = static_cast<size_t>(args[2].num);
+    }
+    size_t pos = std::string_view(args[0].str()).find(args[1].str(), start);
+    return Value(pos == std::string_view::npos ? -1.0 : static_cast<double>(pos));
+}
+
+// contains(string, text), or contains(array, value)
+static Value native_contains(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type == Value::ARRAY) {
+        for (const Value& item : args[0].array()) {
+            if (valuesMatch(item, args[1])) return Value(true);
         }
+        return Value(false);
+    }
+    if (args[0].type != Value::STRING || args[1].type != Value::STRING) {
+        throw RuntimeError("contains() requires two strings, or an array and a value", callLine);
+    }
+    return Value(std::string_view(args[0].str()).find(args[1].str()) != std::string_view::npos);
+}
 
-        std::stringstream buffer;
-        buffer << file.rdbuf();
-        std::string source = buffer.str();
+static Value native_starts_with(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING || args[1].type != Value::STRING) {
+        throw RuntimeError("starts_with() requires two strings", callLine);
+    }
+    const std::string& str = args[0].str();
+    const std::string& prefix = args[1].str();
+    return Value(str.size() >= prefix.size() && str.compare(0, prefix.size(), prefix) == 0);
+}
 
-        try {
-            Lexer lexer(source);
-            std::vector<Token> moduleTokens = lexer.tokenize();
-            
-            size_t savedCurrent = current;
-            std::vector<Token> savedTokens = std::move(tokens);
-            
-            tokens = std::move(moduleTokens);
-            current = 0;
-            
-            while (!isAtEnd()) {
-                statement();
-            }
-            
-            tokens = std::move(savedTokens);
-            current = savedCurrent;
-        } catch (...) {
-            throw RuntimeError("Error while importing module '" + module.value + "'", module.line);
-        }
+static Value native_ends_with(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING || args[1].type != Value::STRING) {
+        throw RuntimeError("ends_with() requires two strings", callLine);
     }
+    const std::string& str = args[0].str();
+    const std::string& suffix = args[1].str();
+    return Value(str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
 
-    void tryStatement() {
-        expect(TOKEN_LBRACE, "Expected '{' after 'try'");
-        size_t tryStart = current;
-        
-        int braceCount = 1;
-        size_t tryEnd = current;
-        while (braceCount > 0 && tryEnd < tokens.size()) {
-            if (tokens[tryEnd].type == TOKEN_LBRACE) braceCount++;
-            if (tokens[tryEnd].type == TOKEN_RBRACE) braceCount--;
-            if (braceCount > 0) tryEnd++;
-        }
-        
-        current = tryEnd + 1;
-        expect(TOKEN_CATCH, "Expected 'catch' after try block");
-        
-        if (peek().type != TOKEN_IDENTIFIER) {
-            throw ParseError("Expected error variable name after 'catch'", peek().line);
-        }
-        Token errorVar = advance();
-        expect(TOKEN_LBRACE, "Expected '{' after catch variable");
-        size_t catchStart = current;
-        
-        braceCount = 1;
-        size_t catchEnd = current;
-        while (braceCount > 0 && catchEnd < tokens.size()) {
-            if (tokens[catchEnd].type == TOKEN_LBRACE) braceCount++;
-            if (tokens[catchEnd].type == TOKEN_RBRACE) braceCount--;
-            if (braceCount > 0) catchEnd++;
-        }
-        
-        current = tryStart;
-        inTryCatch = true;
-        currentException.clear();
-        
-        while (current < tryEnd && !hasReturned && currentException.empty()) {
-            statement();
-        }
-        
-        inTryCatch = false;
-        
-        if (!currentException.empty()) {
-            scopes.push_back(std::unordered_map<std::string, Value>());
-            setVariable(errorVar.value, Value(currentException));
-            current = catchStart;
-            
-            while (current < catchEnd && !hasReturned) {
-                statement();
-            }
-            
-            scopes.pop_back();
-            currentException.clear();
-        }
-        
-        current = catchEnd + 1;
+// replace(string, from, to) replaces every from, in one pass
+static Value native_replace(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING || args[1].type != Value::STRING || args[2].type != Value::STRING) {
+        throw RuntimeError("replace() requires three strings", callLine);
+    }
+    std::string_view str = args[0].str();
+    std::string_view from = args[1].str();
+    std::string_view to = args[2].str();
+    if (from.empty()) {
+        throw RuntimeError("replace(): text to replace cannot be empty", callLine);
     }
+    size_t pos = str.find(from);
+    if (pos == std::string_view::npos) return args[0];
+    std::string result;
+    result.reserve(str.size());
+    size_t start = 0;
+    for (; pos != std::string_view::npos; pos = str.find(from, start)) {
+        result.append(str.data() + start, pos - start);
+        result.append(to.data(), to.size());
+        start = pos + from.size();
+    }
+    result.append(str.data() + start, str.size() - start);
+    return Value(std::move(result));
+}
 
-    void throwStatement() {
-        Value msg = expression();
-        expect(TOKEN_SEMICOLON, "Expected ';' after throw statement");
-        
-        if (inTryCatch) {
-            currentException = msg.toString();
-        } else {
-            throw RuntimeError("Uncaught exception: " + msg.toString(), tokens[current - 2].line);
-        }
+// trim(string) without whitespace at either end
+static Value native_trim(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING) {
+        throw RuntimeError("trim() requires a string, got " + args[0].getType(), callLine);
     }
+    std::string_view str = args[0].str();
+    size_t start = 0;
+    size_t end = str.size();
+    while (start < end && CharScan::isSpace(str[start])) start++;
+    while (end > start && CharScan::isSpace(str[end - 1])) end--;
+    if (end - start == str.size()) return args[0];
+    return stringValue(str.substr(start, end - start));
+}
 
-    void matchStatement() {
-        Value matchValue = expression();
-        expect(TOKEN_LBRACE, "Expected '{' after match value");
-        
-        bool matched = false;
-        std::vector<std::pair<Value, std::pair<size_t, size_t>>> cases;
-        cases.reserve(8);
-        size_t defaultStart = 0, defaultEnd = 0;
-        bool hasDefault = false;
-        
-        while (peek().type != TOKEN_RBRACE && !isAtEnd()) {
-            if (match(TOKEN_CASE)) {
-                Value caseValue = expression();
-                expect(TOKEN_ARROW_FAT, "Expected '=>' after case value");
-                expect(TOKEN_LBRACE, "Expected '{' after '=>'");
-                size_t caseBodyStart = current;
-                
-                int braceCount = 1;
-                size_t caseBodyEnd = current;
-                while (braceCount > 0 && caseBodyEnd < tokens.size()) {
-                    if (tokens[caseBodyEnd].type == TOKEN_LBRACE) braceCount++;
-                    if (tokens[caseBodyEnd].type == TOKEN_RBRACE) braceCount--;
-                    if (braceCount > 0) caseBodyEnd++;
-                }
-                
-                cases.push_back({std::move(caseValue), {caseBodyStart, caseBodyEnd}});
-                current = caseBodyEnd + 1;
-                
-            } else if (match(TOKEN_DEFAULT)) {
-                if (hasDefault) {
-                    throw ParseError("Match statement can only have one 'default' case", tokens[current - 1].line);
-                }
-                expect(TOKEN_ARROW_FAT, "Expected '=>' after 'default'");
-                expect(TOKEN_LBRACE, "Expected '{' after '=>'");
-                hasDefault = true;
-                defaultStart = current;
-                
-                int braceCount = 1;
-                defaultEnd = current;
-                while (braceCount > 0 && defaultEnd < tokens.size()) {
-                    if (tokens[defaultEnd].type == TOKEN_LBRACE) braceCount++;
-                    if (tokens[defaultEnd].type == TOKEN_RBRACE) braceCount--;
-                    if (braceCount > 0) defaultEnd++;
-                }
-                
-                current = defaultEnd + 1;
-            } else {
-                advance();
-            }
-        }
-        
-        expect(TOKEN_RBRACE, "Expected '}' at end of match statement");
-        size_t afterMatch = current;
-        
-        for (const auto& caseItem : cases) {
-            const Value& caseValue = caseItem.first;
-            size_t caseBodyStart = caseItem.second.first;
-            size_t caseBodyEnd = caseItem.second.second;
-            
-            bool isMatch = false;
-            if (matchValue.type == caseValue.type) {
-                if (matchValue.type == Value::NUMBER) isMatch = matchValue.num == caseValue.num;
-                else if (matchValue.type == Value::STRING) isMatch = matchValue.str == caseValue.str;
-                else if (matchValue.type == Value::BOOL) isMatch = matchValue.boolean == caseValue.boolean;
-            }
-            
-            if (isMatch) {
-                matched = true;
-                size_t savedCurrent = current;
-                current = caseBodyStart;
-                while (current < caseBodyEnd && !isAtEnd() && !hasReturned) {
-                    statement();
-                }
-                current = savedCurrent;
-                break;
-            }
-        }
-        
-        if (!matched && hasDefault) {
-            size_t savedCurrent = current;
-            current = defaultStart;
-            while (current < defaultEnd && !isAtEnd() && !hasReturned) {
-                statement();
-            }
-            current = savedCurrent;
+static Value native_join(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::ARRAY) {
+        throw RuntimeError("join() first argument must be an array, got " + args[0].getType(), callLine);
+    }
+    if (args[1].type != Value::STRING) {
+        throw RuntimeError("join() second argument must be a string, got " + args[1].getType(), callLine);
+    }
+    std::string result;
+    for (size_t i = 0; i < args[0].array().size(); i++) {
+        args[0].array()[i].appendTo(result);
+        if (i < args[0].array().size() - 1) {
+            result += args[1].str();
         }
     }
+    return Value(result);
+}
 
-    void returnStatement() {
-        returnValue = expression();
-        hasReturned = true;
-        expect(TOKEN_SEMICOLON, "Expected ';' after return statement");
+// builder(values...) starts a string builder holding the text of the values.
+// append(builder, values...) adds to it in place, in amortized constant time,
+// and returns it; str(builder) makes the finished string. puts, print, join,
+// format, interpolation and file output take a builder as it is.
+static Value native_builder(Interpreter&, NativeArgs args, int) {
+    ObjBuilder* builder = new ObjBuilder();
+    Value result(builder);
+    for (size_t i = 0; i < args.size(); i++) {
+        args[i].appendTo(builder->text);
     }
+    return result;
+}
 
-    void putsStatement() {
-        Value val = expression();
-        std::cout << val.toString() << std::endl;
-        expect(TOKEN_SEMICOLON, "Expected ';' after puts statement");
+static Value native_append(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::BUILDER) {
+        throw RuntimeError("append() first argument must be a builder, got " + args[0].getType(), callLine);
+    }
+    std::string& text = args[0].builder();
+    for (size_t i = 1; i < args.size(); i++) {
+        args[i].appendTo(text);
     }
+    return args[0];
+}
 
-    void ifStatement() {
-        Value condition = expression();
-        expect(TOKEN_LBRACE, "Expected '{' after if condition");
-        
-        size_t thenStart = current;
-        int braceCount = 1;
-        size_t thenEnd = current;
-        
-        while (braceCount > 0 && thenEnd < tokens.size()) {
-            if (tokens[thenEnd].type == TOKEN_LBRACE) braceCount++;
-            else if (tokens[thenEnd].type == TOKEN_RBRACE) braceCount--;
-            if (braceCount > 0) thenEnd++;
-        }
+// Float arrays
+// float_array(values) or float_array(count, fill) packs numbers into one block
+// of doubles, and to_array(floats) unpacks them again. The vec_ functions run
+// the kernels in choco_kernels.h over it; they also take a plain array of
+// numbers, which is packed first, and return new float arrays.
+static Value floatArray(std::vector<double>&& items) {
+    return Value(new ObjFloatArray(std::move(items)));
+}
 
-        size_t elseStart = 0, elseEnd = 0;
-        bool hasElse = false;
-        
-        size_t afterThen = thenEnd + 1;
-        if (afterThen < tokens.size() && tokens[afterThen].type == TOKEN_ELSE) {
-            hasElse = true;
-            current = afterThen;
-            match(TOKEN_ELSE);
-            expect(TOKEN_LBRACE, "Expected '{' after 'else'");
-            elseStart = current;
-            
-            braceCount = 1;
-            elseEnd = current;
-            while (braceCount > 0 && elseEnd < tokens.size()) {
-                if (tokens[elseEnd].type == TOKEN_LBRACE) braceCount++;
-                else if (tokens[elseEnd].type == TOKEN_RBRACE) braceCount--;
-                if (braceCount > 0) elseEnd++;
+// The numbers of a float array, or of a plain array packed into scratch
+static const std::vector<double>& numbersOf(const Value& val, std::vector<double>& scratch,
+                                            const char* name, int callLine) {
+    if (val.type == Value::FLOAT_ARRAY) return val.floats();
+    if (val.type == Value::ARRAY) {
+        scratch.clear();
+        scratch.reserve(val.array().size());
+        for (const Value& item : val.array()) {
+            if (item.type != Value::NUMBER) {
+                throw RuntimeError(std::string(name) + "() requires an array of numbers, found " + item.getType(), callLine);
             }
+            scratch.push_back(item.num);
         }
+        return scratch;
+    }
+    throw RuntimeError(std::string(name) + "() requires a float array or an array of numbers, got " + val.getType(), callLine);
+}
 
-        bool shouldExecute = false;
-        if (condition.type == Value::BOOL) {
-            shouldExecute = condition.boolean;
-        } else if (condition.type == Value::NUMBER) {
-            shouldExecute = condition.num != 0;
-        } else if (condition.type == Value::STRING) {
-            shouldExecute = !condition.str.empty();
-        }
+static const std::vector<double>& nonEmptyNumbersOf(const Value& val, std::vector<double>& scratch,
+                                                    const char* name, int callLine) {
+    const std::vector<double>& x = numbersOf(val, scratch, name, callLine);
+    if (x.empty()) {
+        throw RuntimeError(std::string(name) + "() of an empty array", callLine);
+    }
+    return x;
+}
 
-        if (shouldExecute) {
-            current = thenStart;
-            while (current < thenEnd && !isAtEnd() && !hasReturned && !shouldBreak && !shouldContinue) {
-                statement();
-            }
-        } else if (hasElse) {
-            current = elseStart;
-            while (current < elseEnd && !isAtEnd() && !hasReturned && !shouldBreak && !shouldContinue) {
-                statement();
-            }
-        }
-        
-        current = hasElse ? (elseEnd + 1) : (thenEnd + 1);
+static void requireSameLength(const std::vector<double>& x, const std::vector<double>& y,
+                              const char* name, int callLine) {
+    if (x.size() != y.size()) {
+        throw RuntimeError(std::string(name) + "() arrays differ in length (" + std::to_string(x.size()) +
+                           " and " + std::to_string(y.size()) + ")", callLine);
     }
+}
 
-    void whileStatement() {
-        size_t conditionStart = current;
-        
-        Value condition = expression();
-        expect(TOKEN_LBRACE, "Expected '{' after while condition");
-        size_t bodyStart = current;
-        
-        int braceCount = 1;
-        size_t bodyEnd = bodyStart;
-        while (braceCount > 0 && bodyEnd < tokens.size()) {
-            if (tokens[bodyEnd].type == TOKEN_LBRACE) braceCount++;
-            if (tokens[bodyEnd].type == TOKEN_RBRACE) braceCount--;
-            if (braceCount > 0) bodyEnd++;
+static Value native_float_array(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type == Value::FLOAT_ARRAY) return args[0];
+    if (args[0].type == Value::NUMBER) {
+        if (args[0].num < 0 || args[0].num != floor(args[0].num)) {
+            throw RuntimeError("float_array() count must be a non-negative integer", callLine);
         }
-        
-        bool wasInLoop = inLoop;
-        inLoop = true;
-        
-        while (condition.type == Value::BOOL && condition.boolean && !hasReturned) {
-            current = bodyStart;
-            shouldBreak = false;
-            shouldContinue = false;
-            
-            while (current < bodyEnd && !isAtEnd() && !hasReturned && !shouldBreak) {
-                statement();
-                if (shouldContinue) {
-                    shouldContinue = false;
-                    break;
-                }
-            }
-            
-            if (shouldBreak) {
-                shouldBreak = false;
-                break;
+        double fill = 0;
+        if (args.size() > 1) {
+            if (args[1].type != Value::NUMBER) {
+                throw RuntimeError("float_array() fill must be a number, got " + args[1].getType(), callLine);
             }
-            
-            current = conditionStart;
-            condition = expression();
-            expect(TOKEN_LBRACE, "Expected '{' after while condition");
+            fill = args[1].num;
         }
-        
-        inLoop = wasInLoop;
-        current = bodyEnd + 1;
+        return floatArray(std::vector<double>(static_cast<size_t>(args[0].num), fill));
+    }
+    std::vector<double> items;
+    numbersOf(args[0], items, "float_array", callLine);
+    return floatArray(std::move(items));
+}
+
+static Value native_to_array(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::FLOAT_ARRAY) {
+        throw RuntimeError("to_array() requires a float array, got " + args[0].getType(), callLine);
+    }
+    const std::vector<double>& x = args[0].floats();
+    std::vector<Value> items;
+    items.reserve(x.size());
+    for (double number : x) {
+        items.push_back(Value(number));
+    }
+    return Value(std::move(items));
+}
+
+static Value native_vec_sum(Interpreter&, NativeArgs args, int callLine) {
+    std::vector<double> scratch;
+    const std::vector<double>& x = numbersOf(args[0], scratch, "vec_sum", callLine);
+    return Value(Kernels::sum(x.data(), x.size()));
+}
+
+static Value native_vec_mean(Interpreter&, NativeArgs args, int callLine) {
+    std::vector<double> scratch;
+    const std::vector<double>& x = nonEmptyNumbersOf(args[0], scratch, "vec_mean", callLine);
+    return Value(Kernels::sum(x.data(), x.size()) / static_cast<double>(x.size()));
+}
+
+static Value native_vec_min(Interpreter&, NativeArgs args, int callLine) {
+    std::vector<double> scratch;
+    const std::vector<double>& x = nonEmptyNumbersOf(args[0], scratch, "vec_min", callLine);
+    return Value(Kernels::min(x.data(), x.size()));
+}
+
+static Value native_vec_max(Interpreter&, NativeArgs args, int callLine) {
+    std::vector<double> scratch;
+    const std::vector<double>& x = nonEmptyNumbersOf(args[0], scratch, "vec_max", callLine);
+    return Value(Kernels::max(x.data(), x.size()));
+}
+
+static Value native_vec_dot(Interpreter&, NativeArgs args, int callLine) {
+    std::vector<double> scratchX, scratchY;
+    const std::vector<double>& x = numbersOf(args[0], scratchX, "vec_dot", callLine);
+    const std::vector<double>& y = numbersOf(args[1], scratchY, "vec_dot", callLine);
+    requireSameLength(x, y, "vec_dot", callLine);
+    return Value(Kernels::dot(x.data(), y.data(), x.size()));
+}
+
+static Value native_vec_scale(Interpreter&, NativeArgs args, int callLine) {
+    std::vector<double> scratch;
+    const std::vector<double>& x = numbersOf(args[0], scratch, "vec_scale", callLine);
+    if (args[1].type != Value::NUMBER) {
+        throw RuntimeError("vec_scale() factor must be a number, got " + args[1].getType(), callLine);
+    }
+    std::vector<double> result(x.size());
+    Kernels::scale(x.data(), args[1].num, result.data(), x.size());
+    return floatArray(std::move(result));
+}
+
+// vec_add(a, b) adds element by element; vec_add(a, k) adds k to every element
+static Value native_vec_add(Interpreter&, NativeArgs args, int callLine) {
+    std::vector<double> scratchX, scratchY;
+    const std::vector<double>& x = numbersOf(args[0], scratchX, "vec_add", callLine);
+    std::vector<double> result(x.size());
+    if (args[1].type == Value::NUMBER) {
+        Kernels::add(x.data(), args[1].num, result.data(), x.size());
+    } else {
+        const std::vector<double>& y = numbersOf(args[1], scratchY, "vec_add", callLine);
+        requireSameLength(x, y, "vec_add", callLine);
+        Kernels::add(x.data(), y.data(), result.data(), x.size());
+    }
+    return floatArray(std::move(result));
+}
+
+static Value native_vec_cumsum(Interpreter&, NativeArgs args, int callLine) {
+    std::vector<double> scratch;
+    const std::vector<double>& x = numbersOf(args[0], scratch, "vec_cumsum", callLine);
+    std::vector<double> result(x.size());
+    Kernels::cumsum(x.data(), result.data(), x.size());
+    return floatArray(std::move(result));
+}
+
+// vec_compare(a, "<", b) is 1 where a[i] < b[i] and 0 elsewhere, so vec_sum
+// of it counts the matches. b may be a number; the operators are those of the language.
+static Value native_vec_compare(Interpreter&, NativeArgs args, int callLine) {
+    static const std::pair<const char*, Kernels::Comparison> operators[] = {
+        {"<", Kernels::LESS}, {"<=", Kernels::LESS_EQUAL}, {">", Kernels::GREATER},
+        {">=", Kernels::GREATER_EQUAL}, {"==", Kernels::EQUAL}, {"!=", Kernels::NOT_EQUAL},
+    };
+    std::vector<double> scratchX, scratchY;
+    const std::vector<double>& x = numbersOf(args[0], scratchX, "vec_compare", callLine);
+    if (args[1].type != Value::STRING) {
+        throw RuntimeError("vec_compare() operator must be a string, got " + args[1].getType(), callLine);
+    }
+    const Kernels::Comparison* op = nullptr;
+    for (const auto& entry : operators) {
+        if (args[1].str() == entry.first) op = &entry.second;
     }
+    if (!op) {
+        throw RuntimeError("vec_compare() unknown operator '" + args[1].str() + "'", callLine);
+    }
+    std::vector<double> result(x.size());
+    if (args[2].type == Value::NUMBER) {
+        Kernels::compare(x.data(), nullptr, args[2].num, *op, result.data(), x.size());
+    } else {
+        const std::vector<double>& y = numbersOf(args[2], scratchY, "vec_compare", callLine);
+        requireSameLength(x, y, "vec_compare", callLine);
+        Kernels::compare(x.data(), y.data(), 0, *op, result.data(), x.size());
+    }
+    return floatArray(std::move(result));
+}
 
-    void forStatement() {
-        if (peek().type != TOKEN_IDENTIFIER) {
-            throw ParseError("Expected iterator variable name after 'for'", peek().line);
-        }
-        Token iterVar = advance();
-        expect(TOKEN_IN, "Expected 'in' after iterator variable");
-        
-        Value start = expression();
-        expect(TOKEN_DOTDOT, "Expected '..' in for loop range");
-        Value end = expression();
-        
-        if (start.type != Value::NUMBER || end.type != Value::NUMBER) {
-            throw RuntimeError("For loop range must be numbers", iterVar.line);
+// print(values...) writes the values like puts, without a newline
+static Value native_print(Interpreter&, NativeArgs args, int) {
+    Output& out = Output::standard();
+    for (size_t i = 0; i < args.size(); i++) {
+        out.write(args[i]);
+    }
+    out.done();
+    return Value();
+}
+
+// format(fmt, values...) fills the {} in fmt with the values in order. {2}
+// takes a value by position, {:.2} (or {2:.2}) writes a number with that many
+// decimals, and {{ and }} are literal braces.
+struct FormatPiece {
+    size_t start, length;   // literal text before the field, in the format string
+    int arg;                // -1 after the last field
+    int precision;          // -1 for the usual number text
+};
+
+struct CompiledFormat {
+    std::string text;
+    std::vector<FormatPiece> pieces;
+    size_t argsNeeded = 0;
+};
+
+static std::string compileFormat(const std::string& text, CompiledFormat& format) {
+    format.text = text;
+    format.pieces.clear();
+    format.argsNeeded = 0;
+    FormatPiece piece = {0, 0, -1, -1};
+    int nextArg = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if ((c == '{' || c == '}') && i + 1 < text.size() && text[i + 1] == c) {
+            // An escaped brace ends the piece; the second one starts the next
+            piece.length = i + 1 - piece.start;
+            format.pieces.push_back(piece);
+            i++;
+            piece = {i + 1, 0, -1, -1};
+            continue;
         }
-        
-        expect(TOKEN_LBRACE, "Expected '{' after for range");
-        size_t loopBodyStart = current;
-        
-        int depth = 1;
-        size_t loopBodyEnd = current;
-        
-        while (depth > 0 && loopBodyEnd < tokens.size()) {
-            if (tokens[loopBodyEnd].type == TOKEN_LBRACE) depth++;
-            else if (tokens[loopBodyEnd].type == TOKEN_RBRACE) depth--;
-            if (depth > 0) loopBodyEnd++;
+        if (c == '}') return "unmatched '}' at " + std::to_string(i);
+        if (c != '{') continue;
+
+        size_t close = text.find('}', i);
+        if (close == std::string::npos) return "unclosed '{' at " + std::to_string(i);
+        piece.length = i - piece.start;
+        std::string spec = text.substr(i + 1, close - i - 1);
+        size_t colon = spec.find(':');
+        std::string index = spec.substr(0, colon);
+        if (index.empty()) {
+            piece.arg = nextArg++;
+        } else if (index.find_first_not_of("0123456789") == std::string::npos && index.size() < 6) {
+            piece.arg = std::stoi(index);
+        } else {
+            return "bad field '{" + spec + "}'";
         }
-        
-        int iStart = static_cast<int>(start.num);
-        int iEnd = static_cast<int>(end.num);
-        
-        bool wasInLoop = inLoop;
-        inLoop = true;
-        
-        for (int i = iStart; i < iEnd; i++) {
-            if (hasReturned || shouldBreak) break;
-            
-            setVariable(iterVar.value, Value(static_cast<double>(i)));
-            
-            size_t savedCurrent = current;
-            current = loopBodyStart;
-            shouldContinue = false;
-            
-            while (current < loopBodyEnd) {
-                if (hasReturned || isAtEnd() || shouldBreak) break;
-                statement();
-                if (shouldContinue) {
-                    shouldContinue = false;
-                    break;
-                }
-            }
-            
-            if (shouldBreak) {
-                shouldBreak = false;
-                break;
+        if (colon != std::string::npos) {
+            std::string digits = spec.substr(colon + 1);
+            if (digits.size() < 2 || digits.size() > 3 || digits[0] != '.' ||
+                digits.find_first_not_of("0123456789", 1) != std::string::npos) {
+                return "bad field '{" + spec + "}'";
             }
-            
-            current = savedCurrent;
+            piece.precision = std::stoi(digits.substr(1));
         }
-        
-        inLoop = wasInLoop;
-        current = loopBodyEnd + 1;
+        format.argsNeeded = std::max(format.argsNeeded, static_cast<size_t>(piece.arg) + 1);
+        format.pieces.push_back(piece);
+        piece = {close + 1, 0, -1, -1};
+        i = close;
     }
+    piece.length = text.size() - piece.start;
+    format.pieces.push_back(piece);
+    return "";
+}
 
-    Value expression() {
-        return logicalOr();
+// Format strings are parsed once. A literal format string is the same object
+// on every call, so the cache is keyed by the string object; the text is
+// compared too, since a freed string's address can be reused.
+static Value native_format(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING) {
+        throw RuntimeError("format() requires a string format, got " + args[0].getType(), callLine);
     }
-
-    Value logicalOr() {
-        Value left = logicalAnd();
-        
-        while (match(TOKEN_OR)) {
-            Value right = logicalAnd();
-            
-            bool leftBool = false;
-            if (left.type == Value::BOOL) leftBool = left.boolean;
-            else if (left.type == Value::NUMBER) leftBool = left.num != 0;
-            
-            bool rightBool = false;
-            if (right.type == Value::BOOL) rightBool = right.boolean;
-            else if (right.type == Value::NUMBER) rightBool = right.num != 0;
-            
-            left = Value(leftBool || rightBool);
+    static std::unordered_map<const Obj*, CompiledFormat> cache;
+    const std::string& text = args[0].str();
+    auto it = cache.find(args[0].obj);
+    if (it == cache.end() || it->second.text != text) {
+        if (cache.size() >= 1024) cache.clear();
+        CompiledFormat format;
+        std::string error = compileFormat(text, format);
+        if (!error.empty()) {
+            throw RuntimeError("format(): " + error, callLine);
         }
-        return left;
+        it = cache.insert_or_assign(args[0].obj, std::move(format)).first;
     }
 
-    Value logicalAnd() {
-        Value left = comparison();
-        
-        while (match(TOKEN_AND)) {
-            Value right = comparison();
-            
-            bool leftBool = false;
-            if (left.type == Value::BOOL) leftBool = left.boolean;
-            else if (left.type == Value::NUMBER) leftBool = left.num != 0;
-            
-            bool rightBool = false;
-            if (right.type == Value::BOOL) rightBool = right.boolean;
-            else if (right.type == Value::NUMBER) rightBool = right.num != 0;
-            
-            left = Value(leftBool && rightBool);
+    const CompiledFormat& format = it->second;
+    if (args.size() - 1 < format.argsNeeded) {
+        throw RuntimeError("format() needs " + std::to_string(format.argsNeeded) + " values, got " +
+                           std::to_string(args.size() - 1), callLine);
+    }
+    std::string result;
+    result.reserve(text.size() + 8 * format.argsNeeded);
+    for (const FormatPiece& piece : format.pieces) {
+        result.append(text, piece.start, piece.length);
+        if (piece.arg < 0) continue;
+        const Value& value = args[piece.arg + 1];
+        if (piece.precision < 0) {
+            value.appendTo(result);
+        } else if (value.type == Value::NUMBER) {
+            // 309 integer digits at most, and at most 99 decimals
+            char digits[420];
+            int length = std::snprintf(digits, sizeof(digits), "%.*f", piece.precision, value.num);
+            result.append(digits, length);
+        } else {
+            throw RuntimeError("format(): decimals given for a " + value.getType() + " value", callLine);
         }
-        return left;
     }
+    return Value(std::move(result));
+}
 
-    Value comparison() {
-        Value left = term();
-        
-        while (peek().type == TOKEN_EQUAL_EQUAL || peek().type == TOKEN_BANG_EQUAL ||
-               peek().type == TOKEN_LESS || peek().type == TOKEN_GREATER ||
-               peek().type == TOKEN_LESS_EQUAL || peek().type == TOKEN_GREATER_EQUAL) {
-            TokenType op = advance().type;
-            Value right = term();
-            
-            bool result = false;
-            if (left.type == Value::NUMBER && right.type == Value::NUMBER) {
-                if (op == TOKEN_EQUAL_EQUAL) result = left.num == right.num;
-                else if (op == TOKEN_BANG_EQUAL) result = left.num != right.num;
-                else if (op == TOKEN_LESS) result = left.num < right.num;
-                else if (op == TOKEN_GREATER) result = left.num > right.num;
-                else if (op == TOKEN_LESS_EQUAL) result = left.num <= right.num;
-                else if (op == TOKEN_GREATER_EQUAL) result = left.num >= right.num;
-            } else if (left.type == Value::BOOL && right.type == Value::BOOL) {
-                if (op == TOKEN_EQUAL_EQUAL) result = left.boolean == right.boolean;
-                else if (op == TOKEN_BANG_EQUAL) result = left.boolean != right.boolean;
-            } else if (left.type == Value::STRING && right.type == Value::STRING) {
-                if (op == TOKEN_EQUAL_EQUAL) result = left.str == right.str;
-                else if (op == TOKEN_BANG_EQUAL) result = left.str != right.str;
-            }
-            left = Value(result);
-        }
-        return left;
+// The file is mapped, so its bytes are copied once, straight into the string
+static Value native_read_file(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING) {
+        throw RuntimeError("read_file() requires a string filename, got " + args[0].getType(), callLine);
+    }
+    SourceFile file(args[0].str());
+    if (!file.ok()) {
+        throw RuntimeError("read_file(): cannot open file '" + args[0].str() + "'", callLine);
     }
+    return Value(std::string(file.text()));
+}
 
-    Value term() {
-        Value left = factor();
-        
-        while (match(TOKEN_PLUS) || match(TOKEN_MINUS)) {
-            TokenType op = tokens[current - 1].type;
-            Value right = factor();
-            
-            if (left.type == Value::NUMBER && right.type == Value::NUMBER) {
-                if (op == TOKEN_PLUS) left.num += right.num;
-                else left.num -= right.num;
-            } else if (left.type == Value::STRING && right.type == Value::STRING && op == TOKEN_PLUS) {
-                left.str += right.str;
-            } else if (op == TOKEN_PLUS) {
-                throw RuntimeError("Cannot add " + left.getType() + " and " + right.getType(), tokens[current - 1].line);
-            } else {
-                throw RuntimeError("Cannot subtract " + right.getType() + " from " + left.getType(), tokens[current - 1].line);
-            }
-        }
-        return left;
+// lines(filename, fn) calls fn with each line of the file, without its line
+// ending. The file is read in chunks, so memory stays bounded however large it
+// is. fn returning false stops the loop. Returns the number of lines passed to fn.
+static Value native_lines(Interpreter& interp, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING) {
+        throw RuntimeError("lines() first argument must be a string filename, got " + args[0].getType(), callLine);
+    }
+    if (args[1].type != Value::LAMBDA) {
+        throw RuntimeError("lines() second argument must be a lambda, got " + args[1].getType(), callLine);
+    }
+    std::string path = args[0].str();
+    Value fn = args[1];
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw RuntimeError("lines(): cannot open file '" + path + "'", callLine);
     }
 
-    Value factor() {
-        Value left = unary();
-        
-        while (match(TOKEN_STAR) || match(TOKEN_SLASH) || match(TOKEN_PERCENT)) {
-            TokenType op = tokens[current - 1].type;
-            int opLine = tokens[current - 1].line;
-            Value right = unary();
-            
-            if (left.type == Value::NUMBER && right.type == Value::NUMBER) {
-                if (op == TOKEN_STAR) {
-                    left.num *= right.num;
-                } else if (op == TOKEN_SLASH) {
-                    if (right.num == 0) {
-                        throw RuntimeError("Division by zero", opLine);
-                    }
-                    left.num /= right.num;
-                } else if (op == TOKEN_PERCENT) {
-                    if (right.num == 0) {
-                        throw RuntimeError("Modulo by zero", opLine);
-                    }
-                    left.num = fmod(left.num, right.num);
-                }
-            } else {
-                std::string opStr = (op == TOKEN_STAR) ? "multiply" : (op == TOKEN_SLASH) ? "divide" : "modulo";
-                throw RuntimeError("Cannot " + opStr + " " + left.getType() + " and " + right.getType(), opLine);
-            }
+    Interpreter::LambdaCall call(interp, fn, 1, callLine);
+    std::vector<char> chunk(64 * 1024);
+    std::string pending;    // the start of a line that runs past the chunk
+    double count = 0;
+    // Passes pending plus [begin, end) to fn; false once fn asked to stop
+    auto emit = [&](const char* begin, const char* end) {
+        pending.append(begin, end);
+        if (!pending.empty() && pending.back() == '\r') pending.pop_back();
+        Value line(std::move(pending));
+        pending.clear();
+        count++;
+        Value result = call(&line);
+        return result.type != Value::BOOL || result.boolean;
+    };
+
+    while (file) {
+        file.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+        const char* p = chunk.data();
+        const char* end = p + file.gcount();
+        while (const char* newline = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end - p)))) {
+            if (!emit(p, newline)) return Value(count);
+            p = newline + 1;
         }
-        return left;
+        pending.append(p, end);
     }
+    if (!pending.empty()) emit(pending.data(), pending.data());
+    return Value(count);
+}
 
-    Value unary() {
-        if (match(TOKEN_BANG)) {
-            Value val = unary();
-            if (val.type == Value::BOOL) {
-                return Value(!val.boolean);
-            }
-            return Value(false);
-        }
-        if (match(TOKEN_MINUS)) {
-            int opLine = tokens[current - 1].line;
-            Value val = unary();
-            if (val.type == Value::NUMBER) {
-                val.num = -val.num;
-                return val;
-            }
-            throw RuntimeError("Cannot negate " + val.getType(), opLine);
-        }
-        return call();
+// read_bytes(filename, offset, length) reads up to length bytes from offset:
+// fewer at the end of the file, none past it
+static Value native_read_bytes(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING) {
+        throw RuntimeError("read_bytes() requires a string filename, got " + args[0].getType(), callLine);
+    }
+    if (args[1].type != Value::NUMBER || args[2].type != Value::NUMBER) {
+        throw RuntimeError("read_bytes() offset and length must be numbers", callLine);
+    }
+    if (args[1].num < 0 || args[2].num < 0) {
+        throw RuntimeError("read_bytes() offset and length cannot be negative", callLine);
+    }
+    std::ifstream file(args[0].str(), std::ios::binary | std::ios::ate);
+    if (!file) {
+        throw RuntimeError("read_bytes(): cannot open file '" + args[0].str() + "'", callLine);
     }
+    double size = static_cast<double>(file.tellg());
+    double offset = std::floor(args[1].num);
+    if (offset >= size) return Value("");
+    std::string bytes(static_cast<size_t>(std::min(std::floor(args[2].num), size - offset)), '\0');
+    file.seekg(static_cast<std::streamoff>(offset));
+    file.read(&bytes[0], static_cast<std::streamsize>(bytes.size()));
+    bytes.resize(static_cast<size_t>(file.gcount()));
+    return Value(std::move(bytes));
+}
 
-    Value call() {
-        Value val = primary();
-        
-        while (true) {
-            if (match(TOKEN_LPAREN)) {
-                int callLine = tokens[current - 1].line;
-                std::vector<Value> args;
-                while (!match(TOKEN_RPAREN)) {
-                    args.push_back(expression());
-                    if (!match(TOKEN_COMMA)) {
-                        expect(TOKEN_RPAREN, "Expected ')' or ',' in function call");
-                        break;
-                    }
-                }
-                
-                if (val.type == Value::STRING) {
-                    val = callFunction(val.str, args, callLine);
-                } else if (val.type == Value::LAMBDA) {
-                    val = callLambda(val, args);
-                } else {
-                    throw RuntimeError("Cannot call " + val.getType(), callLine);
-                }
-            } else if (match(TOKEN_LBRACKET)) {
-                int bracketLine = tokens[current - 1].line;
-                Value index = expression();
-                expect(TOKEN_RBRACKET, "Expected ']' after array index");
-                
-                if (val.type == Value::ARRAY) {
-                    if (index.type != Value::NUMBER) {
-                        throw RuntimeError("Array index must be a number, got " + index.getType(), bracketLine);
-                    }
-                    int idx = static_cast<int>(index.num);
-                    if (idx < 0 || idx >= static_cast<int>(val.array.size())) {
-                        throw RuntimeError("Array index " + std::to_string(idx) + " out of bounds (size: " + std::to_string(val.array.size()) + ")", bracketLine);
-                    }
-                    val = val.array[idx];
-                } else if (val.type == Value::STRING) {
-                    if (index.type != Value::NUMBER) {
-                        throw RuntimeError("String index must be a number, got " + index.getType(), bracketLine);
-                    }
-                    int idx = static_cast<int>(index.num);
-                    if (idx < 0 || idx >= static_cast<int>(val.str.length())) {
-                        throw RuntimeError("String index " + std::to_string(idx) + " out of bounds (length: " + std::to_string(val.str.length()) + ")", bracketLine);
-                    }
-                    val = Value(std::string(1, val.str[idx]));
-                } else {
-                    throw RuntimeError("Cannot index " + val.getType(), bracketLine);
-                }
-            } else if (match(TOKEN_DOT)) {
-                int dotLine = tokens[current - 1].line;
-                if (peek().type != TOKEN_IDENTIFIER) {
-                    throw ParseError("Expected field name after '.'", dotLine);
-                }
-                Token field = advance();
-                if (val.type == Value::STRUCT) {
-                    auto it = val.structFields.find(field.value);
-                    if (it != val.structFields.end()) {
-                        val = it->second;
-                    } else {
-                        throw RuntimeError("Struct '" + val.structType + "' has no field '" + field.value + "'", dotLine);
-                    }
-                } else {
-                    throw RuntimeError("Cannot access field on " + val.getType(), dotLine);
-                }
-            } else {
-                break;
-            }
-        }
-        
-        return val;
+static Value native_write_file(Interpreter&, NativeArgs args, int callLine) {
+    const std::string* content = textOf(args[1]);
+    if (args[0].type != Value::STRING || !content) {
+        throw RuntimeError("write_file() requires two strings", callLine);
+    }
+    std::ofstream file(args[0].str());
+    if (!file) {
+        throw RuntimeError("write_file(): cannot open file '" + args[0].str() + "' for writing", callLine);
+    }
+    file << *content;
+    return Value(true);
+}
+
+static Value native_append_file(Interpreter&, NativeArgs args, int callLine) {
+    const std::string* content = textOf(args[1]);
+    if (args[0].type != Value::STRING || !content) {
+        throw RuntimeError("append_file() requires two strings", callLine);
+    }
+    std::ofstream file(args[0].str(), std::ios::app);
+    if (!file) {
+        throw RuntimeError("append_file(): cannot open file '" + args[0].str() + "' for appending", callLine);
     }
+    file << *content;
+    return Value(true);
+}
 
-    Value callLambda(const Value& lambda, const std::vector<Value>& args) {
-        if (args.size() < lambda.lambdaParams.size()) {
-            throw RuntimeError("Lambda expects " + std::to_string(lambda.lambdaParams.size()) + 
-                             " arguments, got " + std::to_string(args.size()), peek().line);
+// open_writer(filename, mode, buffer_size, sync) opens a buffered output file
+// and returns its handle. mode is "w" to truncate (the default) or "a" to
+// append; buffer_size defaults to 64 KB; sync makes each block go to disk
+// (fsync) before the next is written. A handle is a plain string such as
+// "writer_1"; the writer_ functions accept only handles that are still open.
+static Value native_open_writer(Interpreter& interp, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING) {
+        throw RuntimeError("open_writer() requires a string filename, got " + args[0].getType(), callLine);
+    }
+    bool append = false;
+    if (args.size() > 1) {
+        if (args[1].type != Value::STRING || (args[1].str() != "w" && args[1].str() != "a")) {
+            throw RuntimeError("open_writer() mode must be \"w\" or \"a\"", callLine);
         }
-        
-        scopes.push_back(lambda.closureCaptures);
-        
-        for (size_t i = 0; i < lambda.lambdaParams.size() && i < args.size(); i++) {
-            scopes.back()[lambda.lambdaParams[i]] = args[i];
+        append = args[1].str() == "a";
+    }
+    size_t capacity = 64 * 1024;
+    if (args.size() > 2) {
+        if (args[2].type != Value::NUMBER || args[2].num < 1) {
+            throw RuntimeError("open_writer() buffer size must be a positive number", callLine);
         }
+        capacity = static_cast<size_t>(args[2].num);
+    }
+    bool sync = args.size() > 3 && isTruthy(args[3]);
 
-        size_t savedCurrent = current;
-        current = lambda.lambdaBodyStart;
-        bool wasInFunction = inFunction;
-        inFunction = true;
-        hasReturned = false;
-        returnValue = Value();
+    std::unique_ptr<FileWriter> writer(new FileWriter(args[0].str(), append, capacity, sync));
+    if (!writer->ok()) {
+        throw RuntimeError("open_writer(): cannot open file '" + args[0].str() + "' for writing", callLine);
+    }
+    std::string handle = "writer_" + std::to_string(++interp.writersOpened);
+    interp.writers[handle] = std::move(writer);
+    return Value(handle);
+}
 
-        while (current < lambda.lambdaBodyEnd && !isAtEnd() && !hasReturned) {
-            statement();
-        }
+static FileWriter& writerArg(Interpreter& interp, const Value& handle, const char* native, int callLine) {
+    auto it = handle.type == Value::STRING ? interp.writers.find(handle.str()) : interp.writers.end();
+    if (it == interp.writers.end()) {
+        // Handles are numbered from 1 in the order the writers were opened
+        double number = 0;
+        bool issued = handle.type == Value::STRING && handle.str().compare(0, 7, "writer_") == 0 &&
+                      NumberText::parseInteger(std::string_view(handle.str()).substr(7), number) &&
+                      number >= 1 && number <= static_cast<double>(interp.writersOpened);
+        throw RuntimeError(std::string(native) + "(): '" + handle.toString() + "' " +
+                           (issued ? "was already closed" : "is not a writer handle from open_writer()"), callLine);
+    }
+    return *it->second;
+}
 
-        Value result = returnValue;
-        hasReturned = false;
-        inFunction = wasInFunction;
-        
-        scopes.pop_back();
-        
-        current = savedCurrent;
-        return result;
+static Value native_writer_write(Interpreter& interp, NativeArgs args, int callLine) {
+    FileWriter& writer = writerArg(interp, args[0], "writer_write", callLine);
+    const std::string* content = textOf(args[1]);
+    if (!content) {
+        throw RuntimeError("writer_write() requires a string, got " + args[1].getType(), callLine);
     }
+    if (!writer.write(*content)) {
+        throw RuntimeError("writer_write(): " + writer.error(), callLine);
+    }
+    return Value(true);
+}
 
-    Value primary() {
-        if (match(TOKEN_NUMBER)) {
-            return Value(std::stod(tokens[current - 1].value));
-        }
-        if (match(TOKEN_STRING)) {
-            std::string str = tokens[current - 1].value;
-            
-            size_t pos = 0;
-            while ((pos = str.find("#{", pos)) != std::string::npos) {
-                size_t end = str.find("}", pos);
-                if (end != std::string::npos) {
-                    std::string varName = str.substr(pos + 2, end - pos - 2);
-                    Value val = getVariable(varName);
-                    str.replace(pos, end - pos + 1, val.toString());
-                }
-                pos++;
-            }
-            
-            return Value(str);
-        }
-        if (match(TOKEN_TRUE)) return Value(true);
-        if (match(TOKEN_FALSE)) return Value(false);
-        
-        // Lambda expression
-        if (match(TOKEN_PIPE)) {
-            Value lambda;
-            lambda.type = Value::LAMBDA;
-            
-            if (peek().type == TOKEN_PIPE) {
-                advance();
-            } else {
-                while (peek().type != TOKEN_PIPE && !isAtEnd()) {
-                    if (peek().type != TOKEN_IDENTIFIER) {
-                        throw ParseError("Expected parameter name in lambda", peek().line);
-                    }
-                    Token param = advance();
-                    lambda.lambdaParams.push_back(std::move(param.value));
-                    if (match(TOKEN_COMMA)) {
-                        continue;
-                    } else {
-                        break;
-                    }
-                }
-                expect(TOKEN_PIPE, "Expected '|' after lambda parameters");
-            }
-            
-            expect(TOKEN_ARROW_FAT, "Expected '=>' after lambda parameters");
-            expect(TOKEN_LBRACE, "Expected '{' after '=>'");
-            lambda.lambdaBodyStart = current;
-            
-            int braceCount = 1;
-            size_t bodyEnd = current;
-            while (braceCount > 0 && bodyEnd < tokens.size()) {
-                if (tokens[bodyEnd].type == TOKEN_LBRACE) braceCount++;
-                if (tokens[bodyEnd].type == TOKEN_RBRACE) braceCount--;
-                if (braceCount > 0) bodyEnd++;
-            }
-            lambda.lambdaBodyEnd = bodyEnd;
-            
-            for (int i = scopes.size() - 1; i >= 0; i--) {
-                for (const auto& var : scopes[i]) {
-                    if (lambda.closureCaptures.find(var.first) == lambda.closureCaptures.end()) {
-                        lambda.closureCaptures[var.first] = var.second;
-                    }
-                }
-            }
-            
-            current = bodyEnd + 1;
-            return lambda;
-        }
-        
-        if (match(TOKEN_LBRACKET)) {
-            std::vector<Value> arr;
-            while (!match(TOKEN_RBRACKET)) {
-                arr.push_back(expression());
-                if (!match(TOKEN_COMMA)) {
-                    expect(TOKEN_RBRACKET, "Expected ']' or ',' in array literal");
-                    break;
-                }
-            }
-            return Value(arr);
-        }
-        
-        if (match(TOKEN_IDENTIFIER)) {
-            std::string name = tokens[current - 1].value;
-            
-            auto structIt = structDefs.find(name);
-            if (structIt != structDefs.end() && peek().type == TOKEN_LBRACE) {
-                match(TOKEN_LBRACE);
-                Value structVal;
-                structVal.type = Value::STRUCT;
-                structVal.structType = name;
-                
-                while (!match(TOKEN_RBRACE)) {
-                    if (peek().type != TOKEN_IDENTIFIER) {
-                        throw ParseError("Expected field name in struct literal", peek().line);
-                    }
-                    Token fieldName = advance();
-                    expect(TOKEN_COLON, "Expected ':' after field name");
-                    Value fieldValue = expression();
-                    structVal.structFields[fieldName.value] = std::move(fieldValue);
-                    
-                    if (!match(TOKEN_COMMA)) {
-                        expect(TOKEN_RBRACE, "Expected '}' or ',' in struct literal");
-                        break;
-                    }
-                }
-                
-                return structVal;
-            }
-            
-            if (functions.find(name) != functions.end() || isBuiltinFunction(name)) {
-                return Value(name);
-            }
-            
-            return getVariable(name);
-        }
-        
-        if (match(TOKEN_LPAREN)) {
-            Value val = expression();
-            expect(TOKEN_RPAREN, "Expected ')' after expression");
-            return val;
+static Value native_writer_flush(Interpreter& interp, NativeArgs args, int callLine) {
+    FileWriter& writer = writerArg(interp, args[0], "writer_flush", callLine);
+    if (!writer.flush()) {
+        throw RuntimeError("writer_flush(): " + writer.error(), callLine);
+    }
+    return Value(true);
+}
+
+static Value native_writer_close(Interpreter& interp, NativeArgs args, int callLine) {
+    FileWriter& writer = writerArg(interp, args[0], "writer_close", callLine);
+    bool closed = writer.close();
+    std::string error = writer.error();
+    interp.writers.erase(args[0].str());
+    if (!closed) {
+        throw RuntimeError("writer_close(): " + error, callLine);
+    }
+    return Value(true);
+}
+
+static Value native_file_exists(Interpreter&, NativeArgs args, int callLine) {
+    if (args[0].type != Value::STRING) {
+        throw RuntimeError("file_exists() requires a string filename, got " + args[0].getType(), callLine);
+    }
+    std::ifstream file(args[0].str());
+    return Value(file.good());
+}
+
+static Value native_input(Interpreter&, NativeArgs args, int callLine) {
+    // input() - read a line from stdin
+    // input(prompt) - print prompt then read a line
+    std::string prompt = "";
+    if (args.size() > 0) {
+        if (args[0].type != Value::STRING) {
+            throw RuntimeError("input() prompt must be a string, got " + args[0].getType(), callLine);
         }
-        
-        throw ParseError("Unexpected token: '" + peek().value + "'", peek().line);
+        prompt = args[0].str();
     }
-};
+    
+    Output::standard().flush();
+    if (!prompt.empty()) {
+        std::cout << prompt;
+        std::cout.flush();
+    }
+    
+    std::string line;
+    if (std::getline(std::cin, line)) {
+        return Value(line);
+    } else {
+        return Value("");
+    }
+}
 
-const std::unordered_map<std::string, bool> Interpreter::builtinFunctions = {
-    {"len", true}, {"push", true}, {"pop", true},
-    {"sqrt", true}, {"pow", true}, {"abs", true},
-    {"floor", true}, {"ceil", true}, {"round", true},
-    {"min", true}, {"max", true}, {"random", true}, {"random_int", true},
-    {"str", true}, {"int", true}, {"float", true},
-    {"uppercase", true}, {"lowercase", true}, {"substr", true},
-    {"split", true}, {"join", true},
-    {"read_file", true}, {"write_file", true}, {"append_file", true}, {"file_exists", true},
-    {"map", true}, {"filter", true}, {"reduce", true}, {"typeof", true},
-    {"input", true}, {"gui_init", true}, {"gui_window", true}, {"gui_button", true},
-    {"gui_label", true}, {"gui_entry", true}, {"gui_box", true},
-    {"gui_add", true}, {"gui_set_text", true}, {"gui_get_text", true},
-    {"gui_on", true}, {"gui_show", true}, {"gui_run", true},
-    {"gui_quit", true}, {"gui_checkbox", true}, {"gui_textview", true},
-    {"gui_frame", true}, {"gui_separator", true}, {"gui_set_sensitive", true},
-    {"gui_get_checked", true}, {"gui_set_checked", true}
-};
+// GUI bindings take their arguments as a vector and check them themselves
+#define CHOCO_GUI_NATIVE(method) \
+    static Value native_##method(Interpreter& interp, NativeArgs args, int callLine) { \
+        ChocoGUI* gui = ChocoGUI::getInstance(0, nullptr); \
+        gui->setInterpreter(&interp); \
+        return gui->method(args.toVector(), callLine); \
+    }
+
+CHOCO_GUI_NATIVE(gui_init)
+CHOCO_GUI_NATIVE(gui_window)
+CHOCO_GUI_NATIVE(gui_button)
+CHOCO_GUI_NATIVE(gui_label)
+CHOCO_GUI_NATIVE(gui_entry)
+CHOCO_GUI_NATIVE(gui_box)
+CHOCO_GUI_NATIVE(gui_add)
+CHOCO_GUI_NATIVE(gui_set_text)
+CHOCO_GUI_NATIVE(gui_get_text)
+CHOCO_GUI_NATIVE(gui_on)
+CHOCO_GUI_NATIVE(gui_show)
+CHOCO_GUI_NATIVE(gui_run)
+CHOCO_GUI_NATIVE(gui_quit)
+CHOCO_GUI_NATIVE(gui_checkbox)
+CHOCO_GUI_NATIVE(gui_textview)
+CHOCO_GUI_NATIVE(gui_frame)
+CHOCO_GUI_NATIVE(gui_separator)
+CHOCO_GUI_NATIVE(gui_set_sensitive)
+CHOCO_GUI_NATIVE(gui_get_checked)
+CHOCO_GUI_NATIVE(gui_set_checked)
+
+#undef CHOCO_GUI_NATIVE
+
+// The natives every interpreter starts with. Further natives are registered
+// the same way, see choco_natives.h.
+static void registerBuiltins(NativeRegistry& natives) {
+    // Higher-order functions
+    natives.add("map", native_map, 2, "array, lambda");
+    natives.add("filter", native_filter, 2, "array, lambda");
+    natives.add("reduce", native_reduce, 3, "array, initial, lambda");
+    natives.add("typeof", native_typeof, 1, "", true);
+
+    // Standard library functions
+    natives.add("len", native_len, 1, "", true);
+    natives.add("push", native_push, 2, "array, value", true);
+    natives.add("pop", native_pop, 1, "array", true);
+    natives.add("sqrt", native_sqrt, 1, "", true);
+    natives.add("pow", native_pow, 2, "base, exponent", true);
+    natives.add("abs", native_abs, 1, "", true);
+    natives.add("floor", native_floor, 1, "", true);
+    natives.add("ceil", native_ceil, 1, "", true);
+    natives.add("round", native_round, 1, "", true);
+    natives.add("min", native_min, 2, "", true);
+    natives.add("max", native_max, 2, "", true);
+    natives.add("float_array", native_float_array, 1, "values", true);
+    natives.add("to_array", native_to_array, 1, "floats", true);
+    natives.add("vec_sum", native_vec_sum, 1, "", true);
+    natives.add("vec_mean", native_vec_mean, 1, "", true);
+    natives.add("vec_min", native_vec_min, 1, "", true);
+    natives.add("vec_max", native_vec_max, 1, "", true);
+    natives.add("vec_dot", native_vec_dot, 2, "a, b", true);
+    natives.add("vec_scale", native_vec_scale, 2, "floats, factor", true);
+    natives.add("vec_add", native_vec_add, 2, "a, b", true);
+    natives.add("vec_cumsum", native_vec_cumsum, 1, "", true);
+    natives.add("vec_compare", native_vec_compare, 3, "a, operator, b", true);
+    natives.add("random", native_random);
+    natives.add("random_int", native_random_int, 2, "min, max");
+    natives.add("str", native_str, 0, "", true);
+    natives.add("int", native_int, 1, "", true);
+    natives.add("float", native_float, 1, "", true);
+    natives.add("parse_numbers", native_parse_numbers, 1, "array", true);
+    natives.add("uppercase", native_uppercase, 1, "", true);
+    natives.add("lowercase", native_lowercase, 1, "", true);
+    natives.add("substr", native_substr, 3, "string, start, length", true);
+    natives.add("split", native_split, 2, "string, delimiter", true);
+    natives.add("join", native_join, 2, "array, separator", true);
+    natives.add("find", native_find, 2, "string, text", true);
+    natives.add("contains", native_contains, 2, "string, text", true);
+    natives.add("starts_with", native_starts_with, 2, "string, prefix", true);
+    natives.add("ends_with", native_ends_with, 2, "string, suffix", true);
+    natives.add("replace", native_replace, 3, "string, from, to", true);
+    natives.add("trim", native_trim, 1, "", true);
+    natives.add("print", native_print);
+    natives.add("builder", native_builder);
+    natives.add("append", native_append, 2, "builder, value");
+    natives.add("format", native_format, 1, "format, values...", true);
+    natives.add("read_file", native_read_file, 1, "filename");
+    natives.add("lines", native_lines, 2, "filename, lambda");
+    natives.add("read_bytes", native_read_bytes, 3, "filename, offset, length");
+    natives.add("write_file", native_write_file, 2, "filename, content");
+    natives.add("append_file", native_append_file, 2, "filename, content");
+    natives.add("file_exists", native_file_exists, 1, "filename");
+    natives.add("open_writer", native_open_writer, 1, "filename");
+    natives.add("writer_write", native_writer_write, 2, "writer, string");
+    natives.add("writer_flush", native_writer_flush, 1, "writer");
+    natives.add("writer_close", native_writer_close, 1, "writer");
+    natives.add("input", native_input);
+
+    // GUI
+    natives.add("gui_init", native_gui_init);
+    natives.add("gui_window", native_gui_window);
+    natives.add("gui_button", native_gui_button);
+    natives.add("gui_label", native_gui_label);
+    natives.add("gui_entry", native_gui_entry);
+    natives.add("gui_box", native_gui_box);
+    natives.add("gui_add", native_gui_add);
+    natives.add("gui_set_text", native_gui_set_text);
+    natives.add("gui_get_text", native_gui_get_text);
+    natives.add("gui_on", native_gui_on);
+    natives.add("gui_show", native_gui_show);
+    natives.add("gui_run", native_gui_run);
+    natives.add("gui_quit", native_gui_quit);
+    natives.add("gui_checkbox", native_gui_checkbox);
+    natives.add("gui_textview", native_gui_textview);
+    natives.add("gui_frame", native_gui_frame);
+    natives.add("gui_separator", native_gui_separator);
+    natives.add("gui_set_sensitive", native_gui_set_sensitive);
+    natives.add("gui_get_checked", native_gui_get_checked);
+    natives.add("gui_set_checked", native_gui_set_checked);
+}
 
 static Value interpreterCallbackWrapper(Interpreter* interp, const std::string& funcName, 
                                        const std::vector<Value>& args, int line) {
     return interp->callFunction(funcName, args, line);
 }
 
+// Lexes the file repeatedly for about a second and reports the throughput
+static int benchmarkLexer(const std::string& path) {
+    SourceFile file(path);
+    if (!file.ok()) {
+        std::cerr << "Error: Could not open file '" << path << "'" << std::endl;
+        return 1;
+    }
+    size_t tokens = 0;
+    int runs = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed(0);
+    try {
+        while (runs < 3 || elapsed.count() < 1.0) {
+            Lexer lexer(file.text());
+            tokens = lexer.tokenize().size();
+            runs++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        }
+    } catch (const LexerError&) {
+        return 1;
+    }
+    double megabytes = static_cast<double>(file.text().size()) * runs / (1024.0 * 1024.0);
+    std::cout << path << ": " << file.text().size() << " bytes, " << tokens << " tokens, "
+              << runs << " runs, " << megabytes / elapsed.count() << " MB/s" << std::endl;
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
+    registerBuiltins(NativeRegistry::instance());
     ChocoGUI* gui = ChocoGUI::getInstance(argc, argv);
     gui->setCallbackFunction(interpreterCallbackWrapper);
     if (argc == 1) {
@@ -1868,12 +5017,12 @@ int main(int argc, char* argv[]) {
         std::cout << "======================================" << std::endl;
         std::cout << std::endl;
         
-        std::vector<Token> emptyTokens;
-        Interpreter repl(emptyTokens);
+        Interpreter repl;
         std::string line;
         int lineNumber = 1;
         
         while (true) {
+            Output::standard().flush();
             std::cout << "choco:" << lineNumber << "> ";
             
             if (!std::getline(std::cin, line)) {
@@ -1911,8 +5060,7 @@ int main(int argc, char* argv[]) {
             }
             
             if (line == "clear") {
-                std::vector<Token> emptyTokens2;
-                repl = Interpreter(emptyTokens2);
+                repl = Interpreter();
                 std::cout << "Environment cleared." << std::endl;
                 lineNumber = 1;
                 continue;
@@ -1920,12 +5068,14 @@ int main(int argc, char* argv[]) {
             
             if (line == "vars") {
                 std::cout << "Defined variables:" << std::endl;
-                if (repl.scopes.empty() || repl.scopes[0].empty()) {
+                bool any = false;
+                for (size_t i = 0; i < repl.globals.size(); i++) {
+                    if (repl.globals[i].type == Value::UNDEFINED) continue;
+                    std::cout << "  " << AtomTable::name(repl.globalNames.names[i]) << " = " << repl.globals[i].toString() << std::endl;
+                    any = true;
+                }
+                if (!any) {
                     std::cout << "  (none)" << std::endl;
-                } else {
-                    for (const auto& var : repl.scopes[0]) {
-                        std::cout << "  " << var.first << " = " << var.second.toString() << std::endl;
-                    }
                 }
                 lineNumber++;
                 continue;
@@ -1937,9 +5087,9 @@ int main(int argc, char* argv[]) {
                     std::cout << "  (none)" << std::endl;
                 } else {
                     for (const auto& func : repl.functions) {
-                        std::cout << "  " << func.first << "(";
+                        std::cout << "  " << AtomTable::name(func.first) << "(";
                         for (size_t i = 0; i < func.second.params.size(); i++) {
-                            std::cout << func.second.params[i];
+                            std::cout << AtomTable::name(func.second.params[i]);
                             if (i < func.second.params.size() - 1) std::cout << ", ";
                         }
                         std::cout << ")" << std::endl;
@@ -1955,20 +5105,11 @@ int main(int argc, char* argv[]) {
             
             try {
                 Lexer lexer(line);
-                std::vector<Token> tokens = lexer.tokenize();
+                TokenStream tokens = lexer.tokenize();
                 
-                size_t savedCurrent = repl.current;
-                std::vector<Token> savedTokens = std::move(repl.tokens);
-                
-                repl.tokens = std::move(tokens);
-                repl.current = 0;
-                
-                while (!repl.isAtEnd()) {
-                    repl.statement();
-                }
-                
-                repl.tokens = std::move(savedTokens);
-                repl.current = savedCurrent;
+                Parser parser(tokens);
+                repl.declareStructs(parser);
+                repl.run(parser.parse());
                 
             } catch (const LexerError& e) {
                 std::cerr << "Lexer Error: " << e.what() << std::endl;
@@ -1976,6 +5117,7 @@ int main(int argc, char* argv[]) {
                 std::cerr << "Parse Error: " << e.what() << std::endl;
             } catch (const RuntimeError& e) {
                 std::cerr << "Runtime Error: " << e.what() << std::endl;
+                Interpreter::printTrace(e);
             } catch (const std::exception& e) {
                 std::cerr << "Error: " << e.what() << std::endl;
             } catch (...) {
@@ -1988,33 +5130,64 @@ int main(int argc, char* argv[]) {
         return 0;
     }
     
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " [file.choco]" << std::endl;
+    // Options come before the script: --no-cache neither reads nor writes
+    // .chococ files, --compile-only writes them without running anything,
+    // --bench-lex only measures how fast the script is lexed
+    bool useCache = true;
+    bool compileOnly = false;
+    bool benchLex = false;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--no-cache") == 0) {
+            useCache = false;
+        } else if (strcmp(argv[arg], "--compile-only") == 0) {
+            compileOnly = true;
+        } else if (strcmp(argv[arg], "--bench-lex") == 0) {
+            benchLex = true;
+        } else {
+            std::cerr << "Error: Unknown option '" << argv[arg] << "'" << std::endl;
+            return 1;
+        }
+    }
+
+    if (arg >= argc) {
+        std::cerr << "Usage: " << argv[0] << " [--no-cache] [--compile-only] [--bench-lex] [file.choco]" << std::endl;
         std::cerr << "       " << argv[0] << "              (for REPL mode)" << std::endl;
         return 1;
     }
 
-    std::ifstream file(argv[1]);
-    if (!file) {
-        std::cerr << "Error: Could not open file '" << argv[1] << "'" << std::endl;
+    std::string path = argv[arg];
+    if (!std::ifstream(path)) {
+        std::cerr << "Error: Could not open file '" << path << "'" << std::endl;
         return 1;
     }
 
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    std::string source = buffer.str();
+    if (benchLex) {
+        return benchmarkLexer(path);
+    }
 
     try {
-        Lexer lexer(source);
-        std::vector<Token> tokens = lexer.tokenize();
+        Interpreter interpreter;
+        interpreter.useCache = useCache;
 
-        Interpreter interpreter(tokens);
+        const FunctionProto* script;
+        try {
+            script = interpreter.loadScript(path);
+        } catch (const ParseError& e) {
+            std::cerr << "\n[Parse Error] Line " << e.line << ": " << e.what() << std::endl;
+            throw;
+        }
+        if (compileOnly) {
+            std::unordered_set<std::string> seen;
+            interpreter.compileImports(script, seen);
+            return 0;
+        }
 
         ChocoGUI* gui = ChocoGUI::getInstance(argc, argv);
         gui->setCallbackFunction(interpreterCallbackWrapper);
         gui->setInterpreter(&interpreter);
 
-        interpreter.execute();
+        interpreter.execute(script);
         
         return 0;
     } catch (const LexerError& e) {